@@ -0,0 +1,68 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "bench/bench_runner.h"
+
+#include <inttypes.h>
+
+#include "utils/time_utils.h"
+
+namespace fasto {
+namespace bench {
+
+void bench_report_begin(bench_report_t* report, FILE* out) {
+  report->out = out;
+  report->info_count = 0;
+  report->results_count = 0;
+  report->in_results = false;
+  fprintf(out, "{\n  \"info\": {");
+}
+
+void bench_report_info(bench_report_t* report, const char* key, const char* value) {
+  fprintf(report->out, "%s\n    \"%s\": \"%s\"", report->info_count ? "," : "", key, value);
+  report->info_count++;
+}
+
+void bench_run(bench_report_t* report, const char* name, const char* params,
+               uint64_t bytes_per_op, bench_func_t func, void* arg) {
+  func(arg);  // warm up caches, lazy allocations and codec lookahead
+
+  uint64_t iterations = 0;
+  uint64_t min_ns = static_cast<uint64_t>(-1);
+  uint64_t start = utils::currentns();
+  uint64_t elapsed = 0;
+  while (elapsed < BENCH_MIN_TIME_NS || iterations < BENCH_MIN_ITERATIONS) {
+    uint64_t op_start = utils::currentns();
+    func(arg);
+    uint64_t op_ns = utils::currentns() - op_start;
+    if (op_ns < min_ns) {
+      min_ns = op_ns;
+    }
+    iterations++;
+    elapsed = utils::currentns() - start;
+  }
+
+  double ns_per_op = static_cast<double>(elapsed) / iterations;
+  double mb_per_s = bytes_per_op ? (bytes_per_op / (1024.0 * 1024.0)) / (ns_per_op / 1e9) : 0;
+
+  if (!report->in_results) {
+    fprintf(report->out, "\n  },\n  \"benchmarks\": [");
+    report->in_results = true;
+  }
+  fprintf(report->out, "%s\n    {\"name\": \"%s\", \"params\": \"%s\", \"iterations\": %" PRIu64
+          ", \"ns_per_op\": %.1f, \"min_ns_per_op\": %" PRIu64 ", \"mb_per_s\": %.2f}",
+          report->results_count ? "," : "", name, params, iterations, ns_per_op, min_ns,
+          mb_per_s);
+  fflush(report->out);
+  report->results_count++;
+}
+
+void bench_report_end(bench_report_t* report) {
+  if (!report->in_results) {
+    fprintf(report->out, "\n  },\n  \"benchmarks\": [");
+  }
+  fprintf(report->out, "\n  ]\n}\n");
+  fflush(report->out);
+}
+
+}  // namespace bench
+}  // namespace fasto
@@ -0,0 +1,33 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <stdio.h>
+
+#include "macros.h"
+
+#define BENCH_MIN_TIME_NS (300 * 1000 * 1000)
+#define BENCH_MIN_ITERATIONS 5
+
+namespace fasto {
+namespace bench {
+
+typedef void (*bench_func_t)(void* arg);
+
+// results as one JSON document: {"info": {...}, "benchmarks": [{...}, ...]}
+typedef struct bench_report_t {
+  FILE* out;  // not owned
+  int info_count;
+  int results_count;
+  bool in_results;
+} bench_report_t;
+
+void bench_report_begin(bench_report_t* report, FILE* out);
+void bench_report_info(bench_report_t* report, const char* key, const char* value);
+// calls func until BENCH_MIN_TIME_NS passed, bytes_per_op 0 - no throughput
+void bench_run(bench_report_t* report, const char* name, const char* params,
+               uint64_t bytes_per_op, bench_func_t func, void* arg);
+void bench_report_end(bench_report_t* report);
+
+}  // namespace bench
+}  // namespace fasto
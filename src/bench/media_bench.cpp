@@ -0,0 +1,963 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include "log.h"
+
+#include "bench/bench_runner.h"
+
+#include "media/bgr_to_yuv.h"
+#include "media/codec_holder.h"
+#include "media/nal_units.h"
+#include "media/resampler.h"
+#include "media/stream_stats.h"
+#include "media/video_converter.h"
+
+#include "utils/executor.h"
+#include "utils/histogram.h"
+#include "utils/utils.h"
+
+#define BENCH_NAL_BUFFER_SIZE (8 * 1024 * 1024)
+#define BENCH_NAL_MAX_UNITS 65536
+#define BENCH_ENCODE_FRAMES 8  // distinct pictures cycled through the encoder
+#define BENCH_ENCODE_FPS 15
+#define BENCH_IDR_SIZE (64 * 1024)
+#define BENCH_BASE64_SIZE (64 * 1024)
+#define BENCH_HEX_SIZE (16 * 1024)
+#define BENCH_PCM_SAMPLES 1024
+#define BENCH_MUX_PACKETS 256
+#define BENCH_MUX_PACKET_SIZE (16 * 1024)
+#define BENCH_MUX_QUEUE_SIZE 64
+#define BENCH_IO_PACKETS 1024  // of BENCH_MUX_PACKET_SIZE, one file per iteration
+#define BENCH_IO_PATH "bench_io.mkv"  // current directory, the disk under test
+#define BENCH_STATS_FRAMES 1024
+#define BENCH_EXECUTOR_TASKS 1024
+
+namespace {
+
+using namespace fasto;
+
+typedef struct bench_resolution_t {
+  int width;
+  int height;
+} bench_resolution_t;
+
+const bench_resolution_t kResolutions[] = { {640, 480}, {1280, 720}, {1920, 1080} };
+// vector bodies with scalar tails of every length, odd last row and chroma column
+const bench_resolution_t kCheckResolutions[] = {
+  {1, 1}, {3, 5}, {17, 9}, {31, 2}, {33, 17}, {63, 7}, {65, 33}, {641, 481}, {1279, 719}
+};
+
+void fill_bgr(uint8_t* data, int width, int height, int seed) {
+  for (int y = 0; y < height; ++y) {
+    uint8_t* row = data + y * width * 3;
+    for (int x = 0; x < width; ++x) {
+      row[x * 3] = (x + seed) & 0xFF;
+      row[x * 3 + 1] = (y + seed * 3) & 0xFF;
+      row[x * 3 + 2] = ((x ^ y) + (rand() & 0x0F)) & 0xFF;
+    }
+  }
+}
+
+// ============== BGR -> YUV420P ============== //
+
+// no noise: chroma of swscale filters and of 2x2 averaging may only differ by rounding
+void fill_bgr_smooth(uint8_t* data, int width, int height) {
+  for (int y = 0; y < height; ++y) {
+    uint8_t* row = data + y * width * 3;
+    for (int x = 0; x < width; ++x) {
+      row[x * 3] = x * 255 / width;
+      row[x * 3 + 1] = y * 255 / height;
+      row[x * 3 + 2] = (x + y) * 255 / (width + height);
+    }
+  }
+}
+
+int max_plane_deviation(const AVFrame* a, const AVFrame* b, int plane, int width, int height) {
+  int max_diff = 0;
+  for (int y = 0; y < height; ++y) {
+    const uint8_t* ra = a->data[plane] + y * a->linesize[plane];
+    const uint8_t* rb = b->data[plane] + y * b->linesize[plane];
+    for (int x = 0; x < width; ++x) {
+      int diff = abs(ra[x] - rb[x]);
+      if (diff > max_diff) {
+        max_diff = diff;
+      }
+    }
+  }
+  return max_diff;
+}
+
+int max_chroma_deviation(const AVFrame* a, const AVFrame* b) {
+  int max_diff = 0;
+  for (int plane = 1; plane < 3; ++plane) {
+    int diff = max_plane_deviation(a, b, plane, (a->width + 1) / 2, (a->height + 1) / 2);
+    if (diff > max_diff) {
+      max_diff = diff;
+    }
+  }
+  return max_diff;
+}
+
+int max_deviation(const AVFrame* a, const AVFrame* b, bool luma_only) {
+  int max_diff = max_plane_deviation(a, b, 0, a->width, a->height);
+  for (int plane = 1; !luma_only && plane < 3; ++plane) {
+    int diff = max_plane_deviation(a, b, plane, (a->width + 1) / 2, (a->height + 1) / 2);
+    if (diff > max_diff) {
+      max_diff = diff;
+    }
+  }
+  return max_diff;
+}
+
+void sws_convert(struct SwsContext* sws_ctx, const uint8_t* bgr, int height, AVFrame* frame) {
+  const uint8_t* src_data[4] = { bgr, NULL, NULL, NULL };
+  int src_linesize[4] = { frame->width * 3, 0, 0, 0 };
+  sws_scale(sws_ctx, src_data, src_linesize, 0, height, frame->data, frame->linesize);
+}
+
+/* kernel against scalar code (must be equal) and against swscale (at most 1 LSB):
+ * luma on a noisy picture, all planes on a smooth one; chroma of a noisy picture is
+ * only reported, a 2x2 box and the swscale chroma filter differ by far more there */
+bool check_bgr_to_yuv(bench::bench_report_t* report) {
+  int max_diff = 0;
+  int max_chroma_diff_noisy = 0;
+  bool equal = true;
+  for (size_t i = 0; i < sizeof(kResolutions) / sizeof(kResolutions[0]); ++i) {
+    int width = kResolutions[i].width;
+    int height = kResolutions[i].height;
+    media::video_converter_t* converter = media::alloc_video_converter(width, height,
+                                                                       AV_PIX_FMT_YUV420P, 1);
+    struct SwsContext* sws_ctx = sws_getContext(width, height, AV_PIX_FMT_BGR24, width, height,
+                                                AV_PIX_FMT_YUV420P,
+                                                SWS_BICUBIC | SWS_ACCURATE_RND, NULL, NULL,
+                                                NULL);
+    uint8_t* bgr = reinterpret_cast<uint8_t*>(malloc(width * height * 3));
+    AVFrame* frames[3] = { NULL, NULL, NULL };
+    for (int j = 0; converter && j < 3; ++j) {
+      frames[j] = media::video_converter_alloc_frame(converter);
+    }
+    if (!converter || !sws_ctx || !bgr || !frames[0] || !frames[1] || !frames[2]) {
+      equal = false;
+    } else {
+      for (int smooth = 0; smooth < 2; ++smooth) {
+        if (smooth) {
+          fill_bgr_smooth(bgr, width, height);
+        } else {
+          fill_bgr(bgr, width, height, 0);
+        }
+        media::bgr_to_yuv(bgr, width * 3, width, height, AV_PIX_FMT_BGR24, frames[0]->data,
+                          frames[0]->linesize, AV_PIX_FMT_YUV420P);
+        media::bgr_to_yuv_c(bgr, width * 3, width, height, AV_PIX_FMT_BGR24, frames[1]->data,
+                            frames[1]->linesize, AV_PIX_FMT_YUV420P);
+        sws_convert(sws_ctx, bgr, height, frames[2]);
+
+        equal = equal && max_deviation(frames[0], frames[1], false) == 0;
+        int diff = max_deviation(frames[0], frames[2], !smooth);
+        if (diff > max_diff) {
+          max_diff = diff;
+        }
+        if (!smooth) {
+          diff = max_chroma_deviation(frames[0], frames[2]);
+          if (diff > max_chroma_diff_noisy) {
+            max_chroma_diff_noisy = diff;
+          }
+        }
+      }
+    }
+
+    for (int j = 0; j < 3; ++j) {
+      av_frame_free(&frames[j]);
+    }
+    free(bgr);
+    if (sws_ctx) {
+      sws_freeContext(sws_ctx);
+    }
+    if (converter) {
+      media::free_video_converter(converter);
+    }
+  }
+
+  char value[16];
+  snprintf(value, sizeof(value), "%d", max_diff);
+  bench::bench_report_info(report, "bgr_to_yuv_kernel", media::bgr_to_yuv_kernel_name());
+  bench::bench_report_info(report, "bgr_to_yuv_max_diff_swscale", value);
+  snprintf(value, sizeof(value), "%d", max_chroma_diff_noisy);
+  bench::bench_report_info(report, "bgr_to_yuv_max_chroma_diff_swscale_noisy", value);
+  bench::bench_report_info(report, "bgr_to_yuv_equals_c", equal ? "true" : "false");
+  return equal && max_diff <= 1;
+}
+
+/* every source and destination format at odd and uneven sizes, padded strides:
+ * the selected kernel must give the same bytes as the scalar code */
+bool check_bgr_to_yuv_formats(bench::bench_report_t* report) {
+  const enum AVPixelFormat src_fmts[] = { AV_PIX_FMT_BGR24, AV_PIX_FMT_BGRA };
+  const enum AVPixelFormat dst_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 };
+  bool equal = true;
+  for (size_t i = 0; i < sizeof(kCheckResolutions) / sizeof(kCheckResolutions[0]); ++i) {
+    int width = kCheckResolutions[i].width;
+    int height = kCheckResolutions[i].height;
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    for (size_t s = 0; s < sizeof(src_fmts) / sizeof(src_fmts[0]); ++s) {
+      int bpp = src_fmts[s] == AV_PIX_FMT_BGR24 ? 3 : 4;
+      int linesize = width * bpp + 7;
+      uint8_t* src = reinterpret_cast<uint8_t*>(malloc(linesize * height));
+      for (int j = 0; src && j < linesize * height; ++j) {
+        src[j] = rand() & 0xFF;
+      }
+
+      for (size_t d = 0; src && d < sizeof(dst_fmts) / sizeof(dst_fmts[0]); ++d) {
+        bool nv12 = dst_fmts[d] == AV_PIX_FMT_NV12;
+        int dst_linesize[3] = { width + 5, nv12 ? chroma_width * 2 + 3 : chroma_width + 3,
+                                nv12 ? 0 : chroma_width + 3 };
+        size_t size = dst_linesize[0] * height +
+            (dst_linesize[1] + dst_linesize[2]) * chroma_height;
+        uint8_t* out[2] = { reinterpret_cast<uint8_t*>(calloc(1, size)),
+                            reinterpret_cast<uint8_t*>(calloc(1, size)) };
+        if (out[0] && out[1]) {
+          uint8_t* dst[2][3];
+          for (int k = 0; k < 2; ++k) {
+            dst[k][0] = out[k];
+            dst[k][1] = dst[k][0] + dst_linesize[0] * height;
+            dst[k][2] = nv12 ? NULL : dst[k][1] + dst_linesize[1] * chroma_height;
+          }
+          media::bgr_to_yuv(src, linesize, width, height, src_fmts[s], dst[0], dst_linesize,
+                            dst_fmts[d]);
+          media::bgr_to_yuv_c(src, linesize, width, height, src_fmts[s], dst[1], dst_linesize,
+                              dst_fmts[d]);
+          // padding included, a kernel writing past a row shows up too
+          if (memcmp(out[0], out[1], size) != 0) {
+            debug_error("bgr_to_yuv %s -> %s %dx%d differs from scalar code\n",
+                        av_get_pix_fmt_name(src_fmts[s]), av_get_pix_fmt_name(dst_fmts[d]),
+                        width, height);
+            equal = false;
+          }
+        } else {
+          equal = false;
+        }
+        free(out[0]);
+        free(out[1]);
+      }
+      if (!src) {
+        equal = false;
+      }
+      free(src);
+    }
+  }
+
+  bench::bench_report_info(report, "bgr_to_yuv_formats_equal_c", equal ? "true" : "false");
+  return equal;
+}
+
+typedef struct convert_ctx_t {
+  media::video_converter_t* converter;
+  struct SwsContext* sws_ctx;
+  AVFrame* frame;
+  uint8_t* bgr;
+  int width;
+  int height;
+  int bpp;
+} convert_ctx_t;
+
+void convert_op(void* arg) {
+  convert_ctx_t* ctx = reinterpret_cast<convert_ctx_t*>(arg);
+  enum AVPixelFormat src_fmt = ctx->bpp == 3 ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_BGRA;
+  media::video_converter_convert_to(ctx->converter, ctx->bgr, ctx->width * ctx->bpp, ctx->width,
+                                    ctx->height, src_fmt, ctx->frame);
+}
+
+void convert_c_op(void* arg) {
+  convert_ctx_t* ctx = reinterpret_cast<convert_ctx_t*>(arg);
+  media::bgr_to_yuv_c(ctx->bgr, ctx->width * 3, ctx->width, ctx->height, AV_PIX_FMT_BGR24,
+                      ctx->frame->data, ctx->frame->linesize, AV_PIX_FMT_YUV420P);
+}
+
+void convert_swscale_op(void* arg) {
+  convert_ctx_t* ctx = reinterpret_cast<convert_ctx_t*>(arg);
+  sws_convert(ctx->sws_ctx, ctx->bgr, ctx->height, ctx->frame);
+}
+
+void bench_convert_case(bench::bench_report_t* report, const char* name, int width, int height,
+                        int bpp, enum AVPixelFormat dst_fmt, bench::bench_func_t func) {
+  convert_ctx_t ctx;
+  ctx.width = width;
+  ctx.height = height;
+  ctx.bpp = bpp;
+  ctx.converter = media::alloc_video_converter(width, height, dst_fmt, 1);
+  // swscale as the converter used it before the kernel
+  ctx.sws_ctx = sws_getContext(width, height, AV_PIX_FMT_BGR24, width, height, dst_fmt,
+                               SWS_BICUBIC, NULL, NULL, NULL);
+  ctx.bgr = reinterpret_cast<uint8_t*>(malloc(width * height * bpp));
+  ctx.frame = ctx.converter ? media::video_converter_alloc_frame(ctx.converter) : NULL;
+  if (ctx.sws_ctx && ctx.bgr && ctx.frame) {
+    for (int i = 0; i < width * height * bpp; ++i) {
+      ctx.bgr[i] = rand() & 0xFF;
+    }
+
+    char params[32];
+    snprintf(params, sizeof(params), "%dx%d", width, height);
+    bench::bench_run(report, name, params, width * height * bpp, func, &ctx);
+  }
+
+  av_frame_free(&ctx.frame);
+  free(ctx.bgr);
+  if (ctx.sws_ctx) {
+    sws_freeContext(ctx.sws_ctx);
+  }
+  if (ctx.converter) {
+    media::free_video_converter(ctx.converter);
+  }
+}
+
+void bench_convert(bench::bench_report_t* report) {
+  for (size_t i = 0; i < sizeof(kResolutions) / sizeof(kResolutions[0]); ++i) {
+    int width = kResolutions[i].width;
+    int height = kResolutions[i].height;
+    bench_convert_case(report, "bgr_to_yuv420p", width, height, 3, AV_PIX_FMT_YUV420P,
+                       convert_op);
+    bench_convert_case(report, "bgr_to_yuv420p_c", width, height, 3, AV_PIX_FMT_YUV420P,
+                       convert_c_op);
+    bench_convert_case(report, "bgr_to_yuv420p_swscale", width, height, 3, AV_PIX_FMT_YUV420P,
+                       convert_swscale_op);
+    bench_convert_case(report, "bgr_to_nv12", width, height, 3, AV_PIX_FMT_NV12, convert_op);
+    bench_convert_case(report, "bgra_to_yuv420p", width, height, 4, AV_PIX_FMT_YUV420P,
+                       convert_op);
+  }
+}
+
+// ============== H.264 encode ============== //
+
+typedef struct encode_ctx_t {
+  media::encoder_t* encoder;
+  AVFrame* frames[BENCH_ENCODE_FRAMES];
+  int64_t pts;
+} encode_ctx_t;
+
+void encode_op(void* arg) {
+  encode_ctx_t* ctx = reinterpret_cast<encode_ctx_t*>(arg);
+  AVFrame* frame = ctx->frames[ctx->pts % BENCH_ENCODE_FRAMES];
+  frame->pts = ctx->pts++;
+
+  AVPacket pkt;
+  av_init_packet(&pkt);
+  pkt.data = NULL;
+  pkt.size = 0;
+  media::encoder_send_frame(ctx->encoder, frame);
+  while (media::encoder_receive_packet(ctx->encoder, &pkt) == 0) {
+    av_free_packet(&pkt);
+  }
+}
+
+void bench_encode(bench::bench_report_t* report) {
+  for (size_t i = 0; i < sizeof(kResolutions) / sizeof(kResolutions[0]); ++i) {
+    int width = kResolutions[i].width;
+    int height = kResolutions[i].height;
+    encode_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.encoder = media::alloc_video_encoder_by_codecid(AV_CODEC_ID_H264, width, height,
+                                                       BENCH_ENCODE_FPS, NULL, NULL);
+    if (!ctx.encoder) {
+      debug_error("H.264 encoder not available, encode benchmark skipped\n");
+      return;
+    }
+
+    AVCodecContext* cc = ctx.encoder->context;
+    media::video_converter_t* converter = media::alloc_video_converter(cc->width, cc->height,
+                                                                       cc->pix_fmt, 1);
+    uint8_t* bgr = reinterpret_cast<uint8_t*>(malloc(width * height * 3));
+    bool ready = converter && bgr;
+    for (int j = 0; ready && j < BENCH_ENCODE_FRAMES; ++j) {
+      ctx.frames[j] = media::video_converter_alloc_frame(converter);
+      fill_bgr(bgr, width, height, j * 7);
+      ready = ctx.frames[j] &&
+          media::video_converter_convert_to(converter, bgr, width * 3, width, height,
+                                            AV_PIX_FMT_BGR24, ctx.frames[j]) ==
+          SUCCESS_RESULT_VALUE;
+    }
+
+    if (ready) {
+      char params[64];
+      snprintf(params, sizeof(params), "%s %dx%d", cc->codec->name, width, height);
+      bench::bench_run(report, "h264_encode", params, 0, encode_op, &ctx);
+    }
+
+    for (int j = 0; j < BENCH_ENCODE_FRAMES; ++j) {
+      av_frame_free(&ctx.frames[j]);
+    }
+    free(bgr);
+    if (converter) {
+      media::free_video_converter(converter);
+    }
+    media::free_encoder(ctx.encoder);
+  }
+}
+
+// ============== NAL units ============== //
+
+/* synthetic Annex-B stream: SPS, PPS, IDR then non-IDR slices of random
+ * payload with emulation prevention applied, like an encoder would emit */
+size_t append_nal(uint8_t* buf, size_t pos, size_t capacity, uint8_t type,
+                  size_t payload_size, bool long_start_code) {
+  if (pos + payload_size * 2 + 5 > capacity) {
+    return pos;
+  }
+
+  if (long_start_code) {
+    buf[pos++] = 0;
+  }
+  buf[pos++] = 0;
+  buf[pos++] = 0;
+  buf[pos++] = 1;
+  buf[pos++] = 0x60 | type;
+
+  int zeros = 0;
+  for (size_t i = 0; i < payload_size; ++i) {
+    uint8_t byte = (rand() % 4 == 0) ? 0 : rand() & 0xFF;
+    if (zeros >= 2 && byte <= 3) {
+      buf[pos++] = 3;  // emulation_prevention_three_byte
+      zeros = 0;
+    }
+    buf[pos++] = byte;
+    zeros = byte == 0 ? zeros + 1 : 0;
+  }
+  if (buf[pos - 1] == 0) {
+    buf[pos - 1] = 0x80;  // rbsp_stop_one_bit
+  }
+  return pos;
+}
+
+size_t fill_annexb_stream(uint8_t* buf, size_t capacity, size_t slice_size) {
+  const size_t au_max_size = (16 + slice_size * (4 + 11)) * 2 + 14 * 5;
+  size_t pos = 0;
+  while (pos + au_max_size <= capacity) {
+    pos = append_nal(buf, pos, capacity, NAL_UNIT_TYPE_SPS, 12, true);
+    pos = append_nal(buf, pos, capacity, NAL_UNIT_TYPE_PPS, 4, true);
+    pos = append_nal(buf, pos, capacity, NAL_UNIT_TYPE_CODED_SLICE_IDR, slice_size * 4, true);
+    for (int i = 0; i < 11; ++i) {
+      pos = append_nal(buf, pos, capacity, NAL_UNIT_TYPE_CODED_SLICE_NON_IDR, slice_size,
+                       i % 2 == 0);
+    }
+  }
+  return pos;
+}
+
+typedef struct nal_ctx_t {
+  uint8_t* buf;
+  int size;
+  media::nal_unit_info_t* units;
+  int count;
+} nal_ctx_t;
+
+void find_nal_unit_op(void* arg) {
+  nal_ctx_t* ctx = reinterpret_cast<nal_ctx_t*>(arg);
+  int count = 0;
+  int off = 0;
+  while (off < ctx->size) {
+    int nal_start = 0, nal_end = 0;
+    uint8_t nal_type = 0;
+    int len = media::find_nal_unit(ctx->buf + off, ctx->size - off, &nal_start, &nal_end,
+                                   &nal_type);
+    if (len <= 0) {
+      break;
+    }
+    count++;
+    off += nal_end;
+  }
+  ctx->count = count;
+}
+
+void find_nal_units_op(void* arg) {
+  nal_ctx_t* ctx = reinterpret_cast<nal_ctx_t*>(arg);
+  ctx->count = media::find_nal_units(ctx->buf, ctx->size, ctx->units, BENCH_NAL_MAX_UNITS);
+}
+
+void bench_nal_units(bench::bench_report_t* report) {
+  nal_ctx_t ctx;
+  ctx.buf = reinterpret_cast<uint8_t*>(malloc(BENCH_NAL_BUFFER_SIZE));
+  ctx.units = reinterpret_cast<media::nal_unit_info_t*>(
+                calloc(BENCH_NAL_MAX_UNITS, sizeof(media::nal_unit_info_t)));
+  if (!ctx.buf || !ctx.units) {
+    free(ctx.buf);
+    free(ctx.units);
+    return;
+  }
+
+  const size_t slice_sizes[] = { 512, 4096, 32768, 131072 };
+  for (size_t i = 0; i < sizeof(slice_sizes) / sizeof(slice_sizes[0]); ++i) {
+    srand(i);
+    ctx.size = fill_annexb_stream(ctx.buf, BENCH_NAL_BUFFER_SIZE, slice_sizes[i]);
+
+    char params[32];
+    snprintf(params, sizeof(params), "slice %zu", slice_sizes[i]);
+    bench::bench_run(report, "find_nal_unit", params, ctx.size, find_nal_unit_op, &ctx);
+    int old_count = ctx.count;
+    bench::bench_run(report, "find_nal_units", params, ctx.size, find_nal_units_op, &ctx);
+    if (old_count != ctx.count) {
+      debug_error("NAL count mismatch %d != %d for %s\n", old_count, ctx.count, params);
+    }
+  }
+
+  free(ctx.units);
+  free(ctx.buf);
+}
+
+// ============== SPS/PPS key frame ============== //
+
+typedef struct key_frame_ctx_t {
+  media::own_nal_unit_t* nalu;
+  uint8_t* raw_idr;  // 4 byte length + IDR slice
+  uint32_t raw_idr_len;
+  uint8_t* dst;
+  uint32_t dst_size;
+} key_frame_ctx_t;
+
+void create_key_frame_op(void* arg) {
+  key_frame_ctx_t* ctx = reinterpret_cast<key_frame_ctx_t*>(arg);
+  uint32_t len = 0;
+  uint8_t* key_frame = media::create_sps_pps_key_frame(ctx->nalu, ctx->raw_idr, ctx->raw_idr_len,
+                                                       &len);
+  free(key_frame);
+}
+
+void write_key_frame_op(void* arg) {
+  key_frame_ctx_t* ctx = reinterpret_cast<key_frame_ctx_t*>(arg);
+  uint32_t len = 0;
+  media::write_sps_pps_key_frame(ctx->nalu, ctx->raw_idr, ctx->raw_idr_len, ctx->dst,
+                                 ctx->dst_size, &len);
+}
+
+void bench_key_frame(bench::bench_report_t* report) {
+  static const uint8_t sps[] = { 0x67, 0x42, 0xC0, 0x1E, 0xDA, 0x02, 0x80, 0xBF, 0xE5, 0x84 };
+  static const uint8_t pps[] = { 0x68, 0xCE, 0x3C, 0x80 };
+
+  key_frame_ctx_t ctx;
+  ctx.nalu = reinterpret_cast<media::own_nal_unit_t*>(calloc(1, sizeof(media::own_nal_unit_t)));
+  ctx.raw_idr_len = BENCH_IDR_SIZE + 4;
+  ctx.raw_idr = reinterpret_cast<uint8_t*>(malloc(ctx.raw_idr_len));
+  if (!ctx.nalu || !ctx.raw_idr) {
+    free(ctx.nalu);
+    free(ctx.raw_idr);
+    return;
+  }
+
+  ctx.nalu->parametr_count = 2;
+  ctx.nalu->parametrs = reinterpret_cast<media::len_value_t*>(
+                          calloc(2, sizeof(media::len_value_t)));
+  ctx.nalu->parametrs[0].len = sizeof(sps);
+  memcpy(ctx.nalu->parametrs[0].value, sps, sizeof(sps));
+  ctx.nalu->parametrs[1].len = sizeof(pps);
+  memcpy(ctx.nalu->parametrs[1].value, pps, sizeof(pps));
+
+  uint32_t slice_len = BENCH_IDR_SIZE;
+  memcpy(ctx.raw_idr, &slice_len, sizeof(slice_len));
+  ctx.raw_idr[4] = 0x65;
+  for (uint32_t i = 5; i < ctx.raw_idr_len; ++i) {
+    ctx.raw_idr[i] = rand() & 0xFF;
+  }
+
+  ctx.dst_size = media::sps_pps_key_frame_size(ctx.nalu, ctx.raw_idr_len);
+  ctx.dst = reinterpret_cast<uint8_t*>(malloc(ctx.dst_size));
+
+  char params[32];
+  snprintf(params, sizeof(params), "idr %d", BENCH_IDR_SIZE);
+  bench::bench_run(report, "create_sps_pps_key_frame", params, ctx.raw_idr_len,
+                   create_key_frame_op, &ctx);
+  if (ctx.dst) {
+    bench::bench_run(report, "write_sps_pps_key_frame", params, ctx.raw_idr_len,
+                     write_key_frame_op, &ctx);
+  }
+
+  free(ctx.dst);
+  free(ctx.raw_idr);
+  media::free_own_nal_unit(ctx.nalu);
+}
+
+// ============== base64 / hex ============== //
+
+typedef struct encode_text_ctx_t {
+  char* src;
+  char* dst;
+  int len;
+} encode_text_ctx_t;
+
+void base64_op(void* arg) {
+  encode_text_ctx_t* ctx = reinterpret_cast<encode_text_ctx_t*>(arg);
+  utils::Base64encode(ctx->dst, ctx->src, ctx->len);
+}
+
+void hex_op(void* arg) {
+  encode_text_ctx_t* ctx = reinterpret_cast<encode_text_ctx_t*>(arg);
+  free(utils::hex_encode(ctx->src, ctx->len));
+}
+
+void bench_text_encode(bench::bench_report_t* report) {
+  encode_text_ctx_t ctx;
+  ctx.src = reinterpret_cast<char*>(malloc(BENCH_BASE64_SIZE));
+  ctx.dst = reinterpret_cast<char*>(malloc(utils::Base64encode_len(BENCH_BASE64_SIZE)));
+  if (!ctx.src || !ctx.dst) {
+    free(ctx.src);
+    free(ctx.dst);
+    return;
+  }
+
+  for (int i = 0; i < BENCH_BASE64_SIZE; ++i) {
+    ctx.src[i] = rand() & 0xFF;
+  }
+
+  char params[32];
+  ctx.len = BENCH_BASE64_SIZE;
+  snprintf(params, sizeof(params), "%d bytes", ctx.len);
+  bench::bench_run(report, "base64_encode", params, ctx.len, base64_op, &ctx);
+
+  ctx.len = BENCH_HEX_SIZE;
+  snprintf(params, sizeof(params), "%d bytes", ctx.len);
+  bench::bench_run(report, "hex_encode", params, ctx.len, hex_op, &ctx);
+
+  free(ctx.dst);
+  free(ctx.src);
+}
+
+// ============== PCM resampling ============== //
+
+typedef struct resample_ctx_t {
+  media::resampler_t* resampler;
+  uint8_t** dst;
+  const uint8_t* src[1];
+} resample_ctx_t;
+
+void resample_op(void* arg) {
+  resample_ctx_t* ctx = reinterpret_cast<resample_ctx_t*>(arg);
+  media::resampler_convert(ctx->resampler, ctx->dst, ctx->resampler->dst_nb_samples, ctx->src,
+                           BENCH_PCM_SAMPLES);
+}
+
+// capture chunks of uneven size, as from a sound card callback, into encoder frames
+void resample_stream_op(void* arg) {
+  static const int chunks[] = {160, 441, 1024, 80, 320};
+  resample_ctx_t* ctx = reinterpret_cast<resample_ctx_t*>(arg);
+  int offset = 0;
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+    const uint8_t* src[1] = {ctx->src[0] + offset * sizeof(int16_t)};
+    media::resampler_send_samples(ctx->resampler, src, chunks[i]);
+    while (media::resampler_receive_frame(ctx->resampler, false)) {
+    }
+    offset += chunks[i];
+  }
+}
+
+void bench_resample(bench::bench_report_t* report) {
+  AVCodecContext* outctx = avcodec_alloc_context3(NULL);
+  if (!outctx) {
+    return;
+  }
+
+  // capture format of the recorder into what the AAC encoder wants
+  outctx->sample_rate = 48000;
+  outctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+  outctx->channel_layout = AV_CH_LAYOUT_MONO;
+  outctx->channels = 1;
+  outctx->codec_type = AVMEDIA_TYPE_AUDIO;  // 20 ms frames for the streaming case
+
+  resample_ctx_t ctx;
+  ctx.dst = NULL;
+  ctx.resampler = media::alloc_resampler(outctx, 8000, AV_SAMPLE_FMT_S16, AV_CH_LAYOUT_MONO,
+                                         BENCH_PCM_SAMPLES);
+  // streaming case reads 2025 samples
+  int16_t* pcm = reinterpret_cast<int16_t*>(malloc(BENCH_PCM_SAMPLES * 2 * sizeof(int16_t)));
+  if (ctx.resampler && pcm &&
+      media::resampler_alloc_array_and_samples(ctx.resampler, &ctx.dst) != ERROR_RESULT_VALUE) {
+    for (int i = 0; i < BENCH_PCM_SAMPLES * 2; ++i) {
+      pcm[i] = static_cast<int16_t>((i * 997) & 0x7FFF);
+    }
+    ctx.src[0] = reinterpret_cast<const uint8_t*>(pcm);
+    bench::bench_run(report, "resampler_convert", "8000 s16 mono -> 48000 fltp mono",
+                     BENCH_PCM_SAMPLES * sizeof(int16_t), resample_op, &ctx);
+    bench::bench_run(report, "resampler_stream", "8000 s16 mono chunks -> 48000 fltp 20 ms frames",
+                     (160 + 441 + 1024 + 80 + 320) * sizeof(int16_t), resample_stream_op, &ctx);
+  }
+
+  if (ctx.dst) {
+    av_freep(&ctx.dst[0]);
+    av_freep(&ctx.dst);
+  }
+  free(pcm);
+  if (ctx.resampler) {
+    media::free_resampler(ctx.resampler);
+  }
+  avcodec_free_context(&outctx);
+}
+
+// ============== null muxer ============== //
+
+typedef struct mux_ctx_t {
+  media::output_stream_t* ostream;
+  AVPacket src;  // refcounted, every write takes a reference
+  int64_t pts;
+} mux_ctx_t;
+
+void mux_op(void* arg) {
+  mux_ctx_t* ctx = reinterpret_cast<mux_ctx_t*>(arg);
+  for (int i = 0; i < BENCH_MUX_PACKETS; ++i) {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    av_packet_ref(&pkt, &ctx->src);
+    pkt.pts = pkt.dts = ctx->pts++;
+    pkt.flags = i == 0 ? AV_PKT_FLAG_KEY : 0;
+    media::write_video_frame(ctx->ostream, &pkt);
+    av_free_packet(&pkt);
+  }
+  media::flush_output_stream(ctx->ostream);
+}
+
+void bench_mux(bench::bench_report_t* report, size_t writer_queue_size) {
+  mux_ctx_t ctx;
+  ctx.pts = 0;
+  ctx.ostream = media::alloc_output_stream(NULL, "bench.null", "null", 0,
+                                             media::OUTPUT_IO_AVIO);
+  if (!ctx.ostream) {
+    return;
+  }
+
+  if (media::add_video_stream_without_codec(ctx.ostream, AV_CODEC_ID_H264, 1280, 720,
+                                            BENCH_ENCODE_FPS) == ERROR_RESULT_VALUE ||
+      avformat_write_header(ctx.ostream->oformat_context, NULL) < 0) {
+    media::free_output_stream(ctx.ostream);
+    return;
+  }
+
+  if (writer_queue_size) {
+    media::start_output_stream_writer(ctx.ostream, writer_queue_size);
+  }
+
+  av_init_packet(&ctx.src);
+  if (av_new_packet(&ctx.src, BENCH_MUX_PACKET_SIZE) == 0) {
+    memset(ctx.src.data, 0x5A, BENCH_MUX_PACKET_SIZE);
+    char params[64];
+    snprintf(params, sizeof(params), "%d packets of %d bytes, %s", BENCH_MUX_PACKETS,
+             BENCH_MUX_PACKET_SIZE, writer_queue_size ? "writer thread" : "in place");
+    bench::bench_run(report, "mux_null", params, BENCH_MUX_PACKETS * BENCH_MUX_PACKET_SIZE,
+                     mux_op, &ctx);
+  }
+
+  media::close_output_stream_file(ctx.ostream);
+  av_free_packet(&ctx.src);
+  media::free_output_stream(ctx.ostream);
+}
+
+// ============== file output backends ============== //
+
+typedef struct io_ctx_t {
+  media::output_io_backend_t backend;
+  AVPacket src;
+} io_ctx_t;
+
+// whole file: header, packets, trailer with the seeks back of the muxer, close
+void io_file_op(void* arg) {
+  io_ctx_t* ctx = reinterpret_cast<io_ctx_t*>(arg);
+  media::output_stream_t* ostream = media::alloc_output_stream(NULL, BENCH_IO_PATH, "matroska",
+                                                               0, ctx->backend);
+  if (!ostream) {
+    return;
+  }
+
+  if (media::add_video_stream_without_codec(ostream, AV_CODEC_ID_H264, 1280, 720,
+                                            BENCH_ENCODE_FPS) == ERROR_RESULT_VALUE ||
+      avformat_write_header(ostream->oformat_context, NULL) < 0) {
+    media::free_output_stream(ostream);
+    return;
+  }
+
+  for (int i = 0; i < BENCH_IO_PACKETS; ++i) {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    av_packet_ref(&pkt, &ctx->src);
+    pkt.pts = pkt.dts = i;
+    pkt.flags = i % BENCH_ENCODE_FPS == 0 ? AV_PKT_FLAG_KEY : 0;
+    media::write_video_frame(ostream, &pkt);
+    av_free_packet(&pkt);
+  }
+
+  media::close_output_stream_file(ostream);
+  media::free_output_stream(ostream);
+}
+
+void bench_io(bench::bench_report_t* report) {
+  io_ctx_t ctx;
+  av_init_packet(&ctx.src);
+  if (av_new_packet(&ctx.src, BENCH_MUX_PACKET_SIZE) != 0) {
+    return;
+  }
+  memset(ctx.src.data, 0x5A, BENCH_MUX_PACKET_SIZE);
+
+  const media::output_io_backend_t backends[] = {
+    media::OUTPUT_IO_AVIO, media::OUTPUT_IO_MMAP, media::OUTPUT_IO_DIRECT
+  };
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+    ctx.backend = backends[i];
+    char params[64];
+    snprintf(params, sizeof(params), "%s, %d packets of %d bytes",
+             media::output_io_backend_name(ctx.backend), BENCH_IO_PACKETS,
+             BENCH_MUX_PACKET_SIZE);
+    bench::bench_run(report, "io_file", params, BENCH_IO_PACKETS * BENCH_MUX_PACKET_SIZE,
+                     io_file_op, &ctx);
+  }
+
+  unlink(BENCH_IO_PATH);
+  av_free_packet(&ctx.src);
+}
+
+// ============== latency instrumentation ============== //
+
+typedef struct stats_ctx_t {
+  utils::histogram_t* hist;
+  media::stream_stats_t* stats;
+  uint64_t value;
+  int64_t pts;
+} stats_ctx_t;
+
+void histogram_record_op(void* arg) {
+  stats_ctx_t* ctx = reinterpret_cast<stats_ctx_t*>(arg);
+  for (int i = 0; i < BENCH_STATS_FRAMES; ++i) {
+    ctx->value = ctx->value * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+    utils::histogram_record(ctx->hist, ctx->value >> 36);
+  }
+}
+
+void stream_stats_frame_op(void* arg) {
+  stats_ctx_t* ctx = reinterpret_cast<stats_ctx_t*>(arg);
+  for (int i = 0; i < BENCH_STATS_FRAMES; ++i) {
+    int64_t pts = ctx->pts++;
+    media::stream_stats_captured(ctx->stats, pts);
+    media::stream_stats_converted(ctx->stats, pts);
+    media::stream_stats_encoded(ctx->stats, pts);
+    media::stream_stats_video_muxed(ctx->stats, pts, BENCH_MUX_PACKET_SIZE);
+  }
+}
+
+void bench_stream_stats(bench::bench_report_t* report) {
+  stats_ctx_t ctx;
+  ctx.hist = reinterpret_cast<utils::histogram_t*>(calloc(1, sizeof(utils::histogram_t)));
+  ctx.stats = media::alloc_stream_stats();
+  ctx.value = 1;
+  ctx.pts = 0;
+  if (!ctx.hist || !ctx.stats) {
+    free(ctx.hist);
+    media::free_stream_stats(ctx.stats);
+    return;
+  }
+
+  char params[32];
+  snprintf(params, sizeof(params), "%d values", BENCH_STATS_FRAMES);
+  bench::bench_run(report, "histogram_record", params, 0, histogram_record_op, &ctx);
+  snprintf(params, sizeof(params), "%d frames, 4 stages", BENCH_STATS_FRAMES);
+  bench::bench_run(report, "stream_stats_frame", params, 0, stream_stats_frame_op, &ctx);
+
+  free(ctx.hist);
+  media::free_stream_stats(ctx.stats);
+}
+
+// ============== shared executor ============== //
+
+typedef struct executor_ctx_t {
+  utils::executor_t* executor;
+  utils::executor_task_t tasks[BENCH_EXECUTOR_TASKS];
+  int remaining;
+} executor_ctx_t;
+
+void executor_task_op(void* arg) {
+  executor_ctx_t* ctx = reinterpret_cast<executor_ctx_t*>(arg);
+  __atomic_sub_fetch(&ctx->remaining, 1, __ATOMIC_ACQ_REL);
+}
+
+void executor_op(void* arg) {
+  executor_ctx_t* ctx = reinterpret_cast<executor_ctx_t*>(arg);
+  __atomic_store_n(&ctx->remaining, BENCH_EXECUTOR_TASKS, __ATOMIC_RELEASE);
+  for (int i = 0; i < BENCH_EXECUTOR_TASKS; ++i) {
+    utils::executor_submit(ctx->executor, &ctx->tasks[i]);
+  }
+  while (__atomic_load_n(&ctx->remaining, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+void bench_executor(bench::bench_report_t* report) {
+  executor_ctx_t* ctx = reinterpret_cast<executor_ctx_t*>(calloc(1, sizeof(executor_ctx_t)));
+  if (!ctx) {
+    return;
+  }
+
+  ctx->executor = utils::alloc_executor(0);
+  if (!ctx->executor) {
+    free(ctx);
+    return;
+  }
+
+  for (int i = 0; i < BENCH_EXECUTOR_TASKS; ++i) {
+    ctx->tasks[i].run = executor_task_op;
+    ctx->tasks[i].arg = ctx;
+    ctx->tasks[i].priority = i % 4 ? utils::EXECUTOR_PRIORITY_HIGH : utils::EXECUTOR_PRIORITY_LOW;
+  }
+
+  char params[48];
+  snprintf(params, sizeof(params), "%d tasks, %zu threads", BENCH_EXECUTOR_TASKS,
+           utils::executor_thread_count(ctx->executor));
+  bench::bench_run(report, "executor_submit_run", params, 0, executor_op, ctx);
+
+  utils::free_executor(ctx->executor);
+  free(ctx);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  FILE* out = stdout;
+  if (argc > 1) {
+    out = fopen(argv[1], "w");
+    if (!out) {
+      fasto::debug_perror_arg("fopen", argv[1], errno);
+      return EXIT_FAILURE;
+    }
+  }
+
+  fasto::set_log_level(fasto::LOG_ERROR);
+  av_register_all();
+
+  fasto::bench::bench_report_t report;
+  fasto::bench::bench_report_begin(&report, out);
+  fasto::bench::bench_report_info(&report, "nal_scanner", fasto::media::nal_scanner_name());
+  fasto::bench::bench_report_info(&report, "libavcodec", LIBAVCODEC_IDENT);
+  bool accurate = check_bgr_to_yuv(&report);
+  accurate = check_bgr_to_yuv_formats(&report) && accurate;
+
+  bench_convert(&report);
+  bench_encode(&report);
+  bench_nal_units(&report);
+  bench_key_frame(&report);
+  bench_text_encode(&report);
+  bench_resample(&report);
+  bench_mux(&report, 0);
+  bench_mux(&report, BENCH_MUX_QUEUE_SIZE);
+  bench_io(&report);
+  bench_stream_stats(&report);
+  bench_executor(&report);
+
+  fasto::bench::bench_report_end(&report);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return accurate ? EXIT_SUCCESS : EXIT_FAILURE;
+}
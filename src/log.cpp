@@ -2,6 +2,7 @@
 
 #include "log.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -9,32 +10,298 @@
 #include <stdarg.h>
 #include <string.h>
 
+// the functions themselves are always built
+#undef debug_msg
+#undef debug_warning
+#undef debug_error
+
+#define LOG_REPEAT_SLOTS 64  // formats tracked by the repeat limiter, hashed by address
+#define LOG_FLUSHER_IDLE_MSEC 100  // flusher wakes up at least that often
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
 namespace {
 
-const char * log_text[] = {
-  "MSG",
-  "WARNING",
-  "ERROR",
-  "CRITICAL_ERROR"
+typedef struct log_prefix_t {
+  const char* text;
+  size_t len;
+} log_prefix_t;
+
+#define LOG_PREFIX(text) { text, sizeof(text) - 1 }
+
+const log_prefix_t log_prefix[] = {
+  LOG_PREFIX("[MSG] "),
+  LOG_PREFIX("[WARNING] "),
+  LOG_PREFIX("[ERROR] "),
+  LOG_PREFIX("[CRITICAL_ERROR] ")
 };
 
+typedef struct log_record_t {
+  size_t seq;  // ring position it may be written at or read from
+  fasto::log_level_t level;
+  time_t time;
+  int len;
+  char text[LOG_RECORD_SIZE];
+} log_record_t;
+
+typedef struct log_repeat_t {
+  const char* format;
+  time_t second;
+  uint32_t count;
+  uint32_t suppressed;
+} log_repeat_t;
+
+// bounded multi-producer ring, producers claim cells with a CAS on tail,
+// the flusher is the only consumer
+typedef struct logger_t {
+  log_record_t ring[LOG_RING_SIZE];
+  size_t tail;
+  char tail_pad[CACHE_LINE_SIZE - sizeof(size_t)];
+  size_t head;
+  char head_pad[CACHE_LINE_SIZE - sizeof(size_t)];
+
+  uint64_t dropped;  // ring was full
+  log_repeat_t repeats[LOG_REPEAT_SLOTS];
+
+  bool started;  // else messages are written in the caller thread
+  bool stopping;
+  int waiting;  // flusher sleeps on cond
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t flushed;
+
+  time_t cached_second;  // flusher only
+  char cached_time[16];
+  size_t cached_time_len;
+} logger_t;
+
+logger_t g_logger;
+pthread_once_t g_logger_once = PTHREAD_ONCE_INIT;
 fasto::log_level_t g_level = fasto::LOG_WARNING;
 
-void dprintva(FILE * file, fasto::log_level_t level, const char * format, va_list ap) {
-  struct tm stm;
-  time_t etime;
-  char buf[16] = {0};
+void deadline_after_msec(struct timespec* ts, long msec) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += msec / 1000;
+  ts->tv_nsec += (msec % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
 
-  time(&etime);
-  localtime_r(&etime, &stm);
-  strftime(buf, sizeof(buf), "%d-%b@%T", &stm);
+const char* format_time(time_t second, size_t* len) {
+  if (second != g_logger.cached_second || !g_logger.cached_time_len) {
+    struct tm stm;
+    localtime_r(&second, &stm);
+    g_logger.cached_time_len = strftime(g_logger.cached_time, sizeof(g_logger.cached_time),
+                                        "%d-%b@%T", &stm);
+    g_logger.cached_second = second;
+  }
+  *len = g_logger.cached_time_len;
+  return g_logger.cached_time;
+}
 
-  char * ret = NULL;
-  const char * level_str = log_text[level];
-  int res = asprintf(&ret, "[%s] %s : %s", level_str, buf, format);
-  DCHECK_NE(res, -1);
-  vfprintf(file, ret, ap);
-  free(ret);
+void write_line(FILE* file, fasto::log_level_t level, time_t second, const char* text,
+                size_t len) {
+  size_t time_len = 0;
+  const char* time_str = format_time(second, &time_len);
+  fwrite(log_prefix[level].text, 1, log_prefix[level].len, file);
+  fwrite(time_str, 1, time_len, file);
+  fwrite(" : ", 1, 3, file);
+  fwrite(text, 1, len, file);
+}
+
+// records in order until the first one not committed yet, returns how many
+size_t write_records() {
+  size_t count = 0;
+  flockfile(stdout);
+  for (;;) {
+    size_t pos = g_logger.head;
+    log_record_t* rec = &g_logger.ring[pos & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+      break;
+    }
+
+    write_line(stdout, rec->level, rec->time, rec->text, rec->len);
+    __atomic_store_n(&rec->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_logger.head, pos + 1, __ATOMIC_RELEASE);
+    count++;
+  }
+
+  uint64_t dropped = __atomic_exchange_n(&g_logger.dropped, 0, __ATOMIC_ACQ_REL);
+  if (dropped) {
+    char text[64];
+    int len = snprintf(text, sizeof(text), "%llu messages dropped, log ring full\n",
+                       static_cast<unsigned long long>(dropped));
+    write_line(stdout, fasto::LOG_WARNING, time(NULL), text, len);
+  }
+  funlockfile(stdout);
+
+  if (count || dropped) {
+    fflush(stdout);
+  }
+  return count;
+}
+
+bool has_record() {
+  size_t pos = g_logger.head;
+  const log_record_t* rec = &g_logger.ring[pos & (LOG_RING_SIZE - 1)];
+  return __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+void* flusher_routine(void* arg) {
+  (void)arg;
+  for (;;) {
+    if (write_records()) {
+      continue;
+    }
+
+    pthread_mutex_lock(&g_logger.lock);
+    pthread_cond_broadcast(&g_logger.flushed);
+    if (g_logger.stopping && !has_record()) {
+      pthread_mutex_unlock(&g_logger.lock);
+      break;
+    }
+    __atomic_store_n(&g_logger.waiting, 1, __ATOMIC_SEQ_CST);
+    if (!has_record()) {
+      // a producer missing the waiting flag is picked up at the timeout
+      struct timespec deadline;
+      deadline_after_msec(&deadline, LOG_FLUSHER_IDLE_MSEC);
+      pthread_cond_timedwait(&g_logger.cond, &g_logger.lock, &deadline);
+    }
+    __atomic_store_n(&g_logger.waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&g_logger.lock);
+  }
+  return NULL;
+}
+
+void stop_logger() {
+  if (!__atomic_load_n(&g_logger.started, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_logger.lock);
+  g_logger.stopping = true;
+  pthread_cond_signal(&g_logger.cond);
+  pthread_mutex_unlock(&g_logger.lock);
+  pthread_join(g_logger.tid, NULL);
+  // late messages, e.g. from other exit handlers, are written in place
+  __atomic_store_n(&g_logger.started, false, __ATOMIC_RELEASE);
+}
+
+void start_logger() {
+  for (size_t i = 0; i < LOG_RING_SIZE; ++i) {
+    g_logger.ring[i].seq = i;
+  }
+  pthread_mutex_init(&g_logger.lock, NULL);
+  pthread_cond_init(&g_logger.cond, NULL);
+  pthread_cond_init(&g_logger.flushed, NULL);
+
+  if (pthread_create(&g_logger.tid, NULL, flusher_routine, NULL) == 0) {
+    __atomic_store_n(&g_logger.started, true, __ATOMIC_RELEASE);
+    atexit(stop_logger);
+  }
+}
+
+// approximate under contention, a racing update at most lets a few more through
+bool suppress_repeat(const char* format, time_t now, uint32_t* suppressed,
+                     const char** suppressed_format) {
+  log_repeat_t* rep = &g_logger.repeats[(reinterpret_cast<uintptr_t>(format) >> 3) %
+                                        LOG_REPEAT_SLOTS];
+  *suppressed = 0;
+  if (__atomic_load_n(&rep->format, __ATOMIC_ACQUIRE) != format ||
+      __atomic_load_n(&rep->second, __ATOMIC_ACQUIRE) != now) {
+    *suppressed_format = __atomic_load_n(&rep->format, __ATOMIC_ACQUIRE);
+    *suppressed = __atomic_exchange_n(&rep->suppressed, 0, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&rep->count, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&rep->second, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&rep->format, format, __ATOMIC_RELEASE);
+    return false;
+  }
+
+  if (__atomic_add_fetch(&rep->count, 1, __ATOMIC_ACQ_REL) <= LOG_REPEATS_PER_SEC) {
+    return false;
+  }
+  __atomic_add_fetch(&rep->suppressed, 1, __ATOMIC_ACQ_REL);
+  return true;
+}
+
+void enqueue_va(fasto::log_level_t level, time_t now, const char* format, va_list ap) {
+  if (!__atomic_load_n(&g_logger.started, __ATOMIC_ACQUIRE)) {
+    char text[LOG_RECORD_SIZE];
+    int len = vsnprintf(text, sizeof(text), format, ap);
+    len = len < 0 ? 0 : len >= LOG_RECORD_SIZE ? LOG_RECORD_SIZE - 1 : len;
+    flockfile(stdout);
+    write_line(stdout, level, now, text, len);
+    funlockfile(stdout);
+    return;
+  }
+
+  size_t pos = __atomic_load_n(&g_logger.tail, __ATOMIC_RELAXED);
+  log_record_t* rec = NULL;
+  for (;;) {
+    rec = &g_logger.ring[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&g_logger.tail, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      __atomic_add_fetch(&g_logger.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&g_logger.tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  rec->level = level;
+  rec->time = now;
+  int len = vsnprintf(rec->text, LOG_RECORD_SIZE, format, ap);
+  if (len >= LOG_RECORD_SIZE) {
+    len = LOG_RECORD_SIZE - 1;
+    rec->text[len - 1] = '\n';
+  }
+  rec->len = len < 0 ? 0 : len;
+  __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+  if (__atomic_load_n(&g_logger.waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&g_logger.lock);
+    pthread_cond_signal(&g_logger.cond);
+    pthread_mutex_unlock(&g_logger.lock);
+  }
+}
+
+void enqueue(fasto::log_level_t level, time_t now, const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  enqueue_va(level, now, format, ap);
+  va_end(ap);
+}
+
+void dprintva(fasto::log_level_t level, const char * format, va_list ap) {
+  pthread_once(&g_logger_once, start_logger);
+
+  time_t now = time(NULL);
+  uint32_t suppressed = 0;
+  const char* suppressed_format = NULL;
+  // a critical message may be the last one before the process goes down
+  if (level < fasto::LOG_CRITICAL_ERROR &&
+      suppress_repeat(format, now, &suppressed, &suppressed_format)) {
+    return;
+  }
+  if (suppressed && suppressed_format) {
+    enqueue(fasto::LOG_WARNING, now, "%u repeats suppressed of: %s", suppressed,
+            suppressed_format);
+  }
+
+  enqueue_va(level, now, format, ap);
+  if (level >= fasto::LOG_CRITICAL_ERROR) {
+    fasto::log_flush();
+  }
 }
 
 }  // namespace
@@ -49,7 +316,7 @@ void debug_msg(const char *format, ...) {
   if (g_level <= LOG_MSG) {
     va_list ap;
     va_start(ap, format);
-    dprintva(stdout, LOG_MSG, format, ap);
+    dprintva(LOG_MSG, format, ap);
     va_end(ap);
   }
 }
@@ -58,7 +325,7 @@ void debug_warning(const char *format, ...) {
   if (g_level <= LOG_WARNING) {
     va_list ap;
     va_start(ap, format);
-    dprintva(stdout, LOG_WARNING, format, ap);
+    dprintva(LOG_WARNING, format, ap);
     va_end(ap);
   }
 }
@@ -67,7 +334,7 @@ void debug_error(const char *format, ...) {
   if (g_level <= LOG_ERROR) {
     va_list ap;
     va_start(ap, format);
-    dprintva(stdout, LOG_ERROR, format, ap);
+    dprintva(LOG_ERROR, format, ap);
     va_end(ap);
   }
 }
@@ -76,7 +343,7 @@ void debug_critical_error(const char *format, ...) {
   if (g_level <= LOG_CRITICAL_ERROR) {
     va_list ap;
     va_start(ap, format);
-    dprintva(stdout, LOG_CRITICAL_ERROR, format, ap);
+    dprintva(LOG_CRITICAL_ERROR, format, ap);
     va_end(ap);
   }
 }
@@ -85,7 +352,7 @@ void debug_critical_notify(const char *format, ...) {
   if (g_level <= LOG_CRITICAL_ERROR) {
     va_list ap;
     va_start(ap, format);
-    dprintva(stdout, LOG_CRITICAL_ERROR, format, ap);
+    dprintva(LOG_CRITICAL_ERROR, format, ap);
     va_end(ap);
   }
 }
@@ -100,4 +367,21 @@ void debug_perror_arg(const char* function, const char* arg, int err) {
   debug_error("Function %s with args %s failed: %s\n", function, arg, strer);
 }
 
+void log_flush() {
+  if (!__atomic_load_n(&g_logger.started, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  size_t target = __atomic_load_n(&g_logger.tail, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&g_logger.lock);
+  while (__atomic_load_n(&g_logger.head, __ATOMIC_ACQUIRE) < target &&
+         __atomic_load_n(&g_logger.started, __ATOMIC_ACQUIRE)) {
+    pthread_cond_signal(&g_logger.cond);
+    struct timespec deadline;
+    deadline_after_msec(&deadline, LOG_FLUSHER_IDLE_MSEC);
+    pthread_cond_timedwait(&g_logger.flushed, &g_logger.lock, &deadline);
+  }
+  pthread_mutex_unlock(&g_logger.lock);
+}
+
 }  // namespace fasto
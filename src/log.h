@@ -4,22 +4,54 @@
 
 #include "macros.h"
 
+// numeric log_level_t for the preprocessor
+#define LOG_LEVEL_MSG 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_ERROR 2
+
+// messages below it are not compiled, their arguments not evaluated but still type checked
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_MSG
+#endif
+
+#define LOG_RECORD_SIZE 512  // longer messages are cut
+#define LOG_RING_SIZE 1024  // records waiting for the flusher, more are dropped
+#define LOG_REPEATS_PER_SEC 10  // same format more often in one second is suppressed,
+                                // critical messages are never
+
+// printf checking of the format and the arguments, also of calls compiled out
+#define LOG_PRINTF_FORMAT(fmt_index, args_index) \
+  __attribute__((format(printf, fmt_index, args_index)))
+
 namespace fasto {
 
 typedef enum log_level_t {
-    LOG_MSG = 0,
-    LOG_WARNING,
-    LOG_ERROR,
+    LOG_MSG = LOG_LEVEL_MSG,
+    LOG_WARNING = LOG_LEVEL_WARNING,
+    LOG_ERROR = LOG_LEVEL_ERROR,
     LOG_CRITICAL_ERROR
 } log_level_t;
 
+/* messages are formatted in the caller thread into a preallocated lock-free ring and
+ * written to stdout by a background thread; critical ones are flushed before return */
 void set_log_level(log_level_t level);
-void debug_msg(const char *format, ...);
-void debug_warning(const char *format, ...);
-void debug_error(const char *format, ...);
-void debug_critical_error(const char *format, ...);
-void debug_critical_notify(const char *format, ...);
+void debug_msg(const char *format, ...) LOG_PRINTF_FORMAT(1, 2);
+void debug_warning(const char *format, ...) LOG_PRINTF_FORMAT(1, 2);
+void debug_error(const char *format, ...) LOG_PRINTF_FORMAT(1, 2);
+void debug_critical_error(const char *format, ...) LOG_PRINTF_FORMAT(1, 2);
+void debug_critical_notify(const char *format, ...) LOG_PRINTF_FORMAT(1, 2);
 void debug_perror(const char *function, int err);
 void debug_perror_arg(const char *function, const char *arg, int err);
+void log_flush();  // returns once every queued message is written
 
 }  // namespace fasto
+
+#if LOG_COMPILED_LEVEL > LOG_LEVEL_MSG
+#define debug_msg(...) do { if (0) ::fasto::debug_msg(__VA_ARGS__); } while (0)
+#endif
+#if LOG_COMPILED_LEVEL > LOG_LEVEL_WARNING
+#define debug_warning(...) do { if (0) ::fasto::debug_warning(__VA_ARGS__); } while (0)
+#endif
+#if LOG_COMPILED_LEVEL > LOG_LEVEL_ERROR
+#define debug_error(...) do { if (0) ::fasto::debug_error(__VA_ARGS__); } while (0)
+#endif
@@ -1,23 +1,307 @@
 // Copyright (c) 2016 Alexandr Topilski. All rights reserved.
 
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <set>
+#include <string>
+
 #include <opencv2/opencv.hpp>
 extern "C" {
 #include <libavformat/avformat.h>
 }
 
+#include "media/media_stream_input.h"
 #include "media/media_stream_output.h"
+#ifdef WITH_PREVIEW
+#include "media/preview.h"
+#endif
+#include "utils/time_utils.h"
 
 #define BIT_PER_SAMPLE 2
 #define AUDIO_CHANNELS 1
 #define AUDIO_BITRATE 8000
 #define AUDIO_SAMPLE_RATE 8000
 #define AUDIO_BITRATE_OUT 48000
+#define VIDEO_PIPELINE_DEPTH 8
+#define VIDEO_MAX_BACKLOG 4
+#define MUXER_QUEUE_SIZE 64
+#define AVIO_BUFFER_SIZE (1024 * 1024)
+#define TRANSCODE_DEFAULT_FPS 25  // input without a frame rate
 
 const char * outfilename = "out.mp4";
 
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+void usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-p every_nth [-w width]] [-n frames] [output]\n"
+                  "       %s -i input [-n frames] [output]\n"
+                  "  records the default camera until SIGINT/SIGTERM or n frames,\n"
+                  "  -p shows every_nth frame in a window, -w its width"
+#ifndef WITH_PREVIEW
+                  " (not built)"
+#endif
+                  "\n"
+                  "  -i transcodes a file, or each file of a directory into the output\n"
+                  "     directory (required, created if missing, not the input one),\n"
+                  "     as fast as the encoder goes\n", name, name);
+}
+
+void init_params(fasto::media::media_stream_params_t* params, int width, int height,
+                 uint32_t fps) {
+  params->height_video = height;
+  params->width_video = width;
+  params->video_fps = fps;
+
+  params->audio_bit_rate = AUDIO_BITRATE;
+  params->audio_channels = AUDIO_CHANNELS;
+  params->audio_sample_rate = AUDIO_SAMPLE_RATE;
+  params->bit_per_sample = BIT_PER_SAMPLE;
+
+  params->audio_bit_rate_out = AUDIO_BITRATE_OUT;
+  params->audio_channels_out = AUDIO_CHANNELS;
+  params->audio_sample_rate_out = AUDIO_SAMPLE_RATE;
+  params->audio_codec = fasto::media::MEDIA_AUDIO_AAC;  // mp4, opus needs mkv/webm/ts
+  params->audio_frame_msec = 0;  // opus default
+  params->audio_dtx = false;
+  params->need_encode = true;  // encodeing and after that write to file
+  params->video_profile = fasto::media::MEDIA_VIDEO_PROFILE_DEFAULT;
+  params->video_bit_rate = 0;  // codec default quality
+  params->video_gop_size = 0;  // profile default
+  params->video_thread_count = 0;  // auto
+  params->video_thread_type = 0;  // codec default
+  params->video_cpu_mask = 0;  // not pinned
+  params->pipeline_depth = VIDEO_PIPELINE_DEPTH;  // capture thread only enqueues
+  params->video_max_backlog = VIDEO_MAX_BACKLOG;  // frames dropped evenly past that
+  params->muxer_queue_size = MUXER_QUEUE_SIZE;  // disk stalls absorbed by writer thread
+  params->avio_buffer_size = AVIO_BUFFER_SIZE;
+  params->io_backend = fasto::media::OUTPUT_IO_AVIO;  // mmap or O_DIRECT with many recordings
+  params->offline = false;
+}
+
+// frames written or ERROR_RESULT_VALUE
+long transcode_file(const char* input_path, const char* output_path, long max_frames) {
+  fasto::media::media_stream_input_t* input =
+      fasto::media::alloc_media_stream_input(input_path, NULL);
+  if (!input) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  uint32_t fps = TRANSCODE_DEFAULT_FPS;
+  if (input->frame_rate.num > 0 && input->frame_rate.den > 0) {
+    fps = (input->frame_rate.num + input->frame_rate.den / 2) / input->frame_rate.den;
+    if (!fps) {
+      fps = 1;
+    }
+  }
+
+  fasto::media::media_stream_params_t params;
+  init_params(&params, input->width, input->height, fps);
+  params.video_max_backlog = 0;  // nothing dropped, the reader waits for the encoder
+  params.offline = true;
+
+  fasto::media::media_stream_t* ostream = fasto::media::alloc_video_stream(output_path, &params);
+  if (!ostream) {
+    fasto::media::free_media_stream_input(input);
+    return ERROR_RESULT_VALUE;
+  }
+
+  long frames = 0;
+  while (!stop_requested && (!max_frames || frames < max_frames)) {
+    fasto::media::media_input_frame_t* frame = fasto::media::media_stream_input_read(input);
+    if (!frame) {
+      break;
+    }
+    if (!frame->mat.empty() &&
+        fasto::media::write_video_frame_to_media_stream_at(ostream, &frame->mat,
+                                                           frame->pts_msec) ==
+        SUCCESS_RESULT_VALUE) {
+      frames++;
+    }
+    fasto::media::media_stream_input_release(input, frame);
+  }
+
+  fasto::media::free_video_stream(ostream);  // flushes the encoder
+  fasto::media::free_media_stream_input(input);
+  return frames;
+}
+
+void print_speed(const char* name, long frames, uint64_t elapsed_ns) {
+  double sec = elapsed_ns / 1e9;
+  printf("%s: %ld frames in %.2f s, %.1f fps\n", name, frames, sec,
+         sec > 0 ? frames / sec : 0.0);
+}
+
+bool same_file(const struct stat* a, const struct stat* b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+// true if path names the same file as st, the output would truncate the input being read
+bool is_input_file(const char* path, const struct stat* st) {
+  struct stat ost;
+  return stat(path, &ost) == 0 && same_file(&ost, st);
+}
+
+/* <dir>/<base>.mp4, or <base>-2.mp4 and so on if an earlier input of the batch already
+ * got that name (cam1.mov and cam1.mkv), outputs of the same run never overwrite each other */
+std::string unique_output_path(const char* dir, const std::string& base,
+                               std::set<std::string>* used) {
+  std::string out = std::string(dir) + "/" + base + ".mp4";
+  for (int n = 2; used->count(out); ++n) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%d", n);
+    out = std::string(dir) + "/" + base + suffix + ".mp4";
+  }
+  used->insert(out);
+  return out;
+}
+
+// output_path NULL - out.mp4 for a file, directory input needs an explicit output directory
+int transcode(const char* input_path, const char* output_path, long max_frames) {
+  struct stat st;
+  if (stat(input_path, &st) != 0) {
+    perror(input_path);
+    return EXIT_FAILURE;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    if (!output_path) {
+      output_path = outfilename;
+    }
+    if (is_input_file(output_path, &st)) {
+      fprintf(stderr, "%s: output is the input file\n", output_path);
+      return EXIT_FAILURE;
+    }
+
+    uint64_t start_ns = fasto::utils::currentns();
+    long frames = transcode_file(input_path, output_path, max_frames);
+    if (frames == ERROR_RESULT_VALUE) {
+      return EXIT_FAILURE;
+    }
+    print_speed(output_path, frames, fasto::utils::currentns() - start_ns);
+    return EXIT_SUCCESS;
+  }
+
+  if (!output_path) {
+    fprintf(stderr, "%s: a directory input needs an output directory\n", input_path);
+    return EXIT_FAILURE;
+  }
+
+  struct stat dst;
+  if (stat(output_path, &dst) != 0) {
+    if (mkdir(output_path, 0755) != 0 || stat(output_path, &dst) != 0) {
+      perror(output_path);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!S_ISDIR(dst.st_mode)) {
+    fprintf(stderr, "%s: output is not a directory\n", output_path);
+    return EXIT_FAILURE;
+  }
+  if (same_file(&dst, &st)) {
+    fprintf(stderr, "%s: output directory is the input directory\n", output_path);
+    return EXIT_FAILURE;
+  }
+
+  struct dirent** entries = NULL;
+  int count = scandir(input_path, &entries, NULL, alphasort);
+  if (count < 0) {
+    perror(input_path);
+    return EXIT_FAILURE;
+  }
+
+  int result = EXIT_SUCCESS;
+  long total_frames = 0;
+  std::set<std::string> outputs;  // produced by this run
+  uint64_t total_start_ns = fasto::utils::currentns();
+  for (int i = 0; i < count; ++i) {
+    std::string in = std::string(input_path) + "/" + entries[i]->d_name;
+    struct stat est;
+    if (stop_requested || stat(in.c_str(), &est) != 0 || !S_ISREG(est.st_mode)) {
+      free(entries[i]);
+      continue;
+    }
+
+    std::string base = entries[i]->d_name;
+    size_t dot = base.rfind('.');
+    if (dot != std::string::npos && dot != 0) {
+      base.erase(dot);
+    }
+    std::string out = unique_output_path(output_path, base, &outputs);
+    if (is_input_file(out.c_str(), &est)) {  // hard or symbolic link into the input
+      fprintf(stderr, "%s: output is the input file, skipped\n", out.c_str());
+      result = EXIT_FAILURE;
+      free(entries[i]);
+      continue;
+    }
+
+    uint64_t start_ns = fasto::utils::currentns();
+    long frames = transcode_file(in.c_str(), out.c_str(), max_frames);
+    if (frames == ERROR_RESULT_VALUE) {
+      fprintf(stderr, "%s: transcode failed\n", in.c_str());
+      result = EXIT_FAILURE;
+    } else {
+      print_speed(out.c_str(), frames, fasto::utils::currentns() - start_ns);
+      total_frames += frames;
+    }
+    free(entries[i]);
+  }
+  free(entries);
+
+  print_speed("total", total_frames, fasto::utils::currentns() - total_start_ns);
+  return result;
+}
+
+}  // namespace
+
 int main(int argc, char *argv[]) {
+  uint32_t preview_every = 0;  // headless
+  int preview_width = 0;
+  long max_frames = 0;  // until stopped
+  const char* input_path = NULL;  // camera
+  int opt;
+  while ((opt = getopt(argc, argv, "i:p:w:n:h")) != -1) {
+    switch (opt) {
+      case 'i':
+        input_path = optarg;
+        break;
+      case 'p':
+        preview_every = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        preview_width = atoi(optarg);
+        break;
+      case 'n':
+        max_frames = atol(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if (optind < argc) {
+    outfilename = argv[optind];
+  }
+
   av_register_all();
 
+  signal(SIGINT, handle_stop_signal);
+  signal(SIGTERM, handle_stop_signal);
+  if (input_path) {
+    return transcode(input_path, optind < argc ? argv[optind] : NULL, max_frames);
+  }
+
   cv::VideoCapture cap(0); // open the default camera
   if(!cap.isOpened())  // check if we succeeded
     return EXIT_FAILURE;
@@ -26,34 +310,45 @@ int main(int argc, char *argv[]) {
   int frame_height = cap.get(CV_CAP_PROP_FRAME_HEIGHT);
 
   fasto::media::media_stream_params_t params;
-  params.height_video = frame_height;
-  params.width_video = frame_width;
-  params.video_fps = 15;
-
-  params.audio_bit_rate = AUDIO_BITRATE;
-  params.audio_channels = AUDIO_CHANNELS;
-  params.audio_sample_rate = AUDIO_SAMPLE_RATE;
-  params.bit_per_sample = BIT_PER_SAMPLE;
-
-  params.audio_bit_rate_out = AUDIO_BITRATE_OUT;
-  params.audio_channels_out = AUDIO_CHANNELS;
-  params.audio_sample_rate_out = AUDIO_SAMPLE_RATE;
-  params.need_encode = true;  // encodeing and after that write to file
+  init_params(&params, frame_width, frame_height, 15);
 
   fasto::media::media_stream_t* ostream = fasto::media::alloc_video_stream(outfilename, &params);
   if(!ostream){
       return EXIT_FAILURE;
   }
 
-  for(;;){
-       cv::Mat frame;
-       cap >> frame;
-       cv::imshow( "Frame", frame);
-       fasto::media::write_video_frame_to_media_stream(ostream, &frame);
-       if(cv::waitKey(30) >= 0)
-         break;
+#ifdef WITH_PREVIEW
+  fasto::media::preview_t* preview = NULL;
+  if (preview_every) {
+    preview = fasto::media::alloc_preview("Frame", preview_every, preview_width);
+  }
+#else
+  if (preview_every) {
+    fprintf(stderr, "built without preview, recording headless\n");
+  }
+  (void)preview_width;
+#endif
+
+  for (long i = 0; !stop_requested && (!max_frames || i < max_frames); ++i) {
+    cv::Mat frame;  // new buffer each time, the pipeline and preview reference the last one
+    cap >> frame;
+    if (frame.empty()) {
+      break;
+    }
+    fasto::media::write_video_frame_to_media_stream(ostream, &frame);
+#ifdef WITH_PREVIEW
+    fasto::media::preview_offer(preview, &frame);
+    if (fasto::media::preview_quit_requested(preview)) {
+      break;
+    }
+#endif
   }
 
+#ifdef WITH_PREVIEW
+  if (preview) {
+    fasto::media::free_preview(preview);
+  }
+#endif
   fasto::media::free_video_stream(ostream);
 
   // the camera will be deinitialized automatically in VideoCapture destructor
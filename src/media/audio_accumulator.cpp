@@ -0,0 +1,151 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/audio_accumulator.h"
+
+#include "log.h"
+
+#include "media/ffmpeg_utils.h"
+
+namespace fasto {
+namespace media {
+
+audio_accumulator_t* alloc_audio_accumulator(const AVCodecContext* ctx) {
+  if (!ctx || ctx->codec_type != AVMEDIA_TYPE_AUDIO || ctx->sample_rate <= 0) {
+    debug_perror("alloc_audio_accumulator", EINVAL);
+    return NULL;
+  }
+
+  audio_accumulator_t* acc = reinterpret_cast<audio_accumulator_t*>(
+                               calloc(1, sizeof(audio_accumulator_t)));
+  if (!acc) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  bool variable = !ctx->frame_size ||
+      (ctx->codec && (ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE));
+  acc->frame_size = variable ?
+                    ctx->sample_rate * AUDIO_ACCUMULATOR_DEFAULT_FRAME_MSEC / 1000 :
+                    ctx->frame_size;
+  acc->small_last_frame = variable ||
+      (ctx->codec && (ctx->codec->capabilities & AV_CODEC_CAP_SMALL_LAST_FRAME));
+  acc->channels = ctx->channels;
+  acc->sample_fmt = ctx->sample_fmt;
+
+  acc->fifo = av_audio_fifo_alloc(acc->sample_fmt, acc->channels, acc->frame_size * 4);
+  if (!acc->fifo) {
+    debug_perror("av_audio_fifo_alloc", ENOMEM);
+    free_audio_accumulator(acc);
+    return NULL;
+  }
+
+  acc->frame = av_frame_alloc();
+  if (!acc->frame) {
+    debug_perror("av_frame_alloc", ENOMEM);
+    free_audio_accumulator(acc);
+    return NULL;
+  }
+
+  acc->frame->nb_samples = acc->frame_size;
+  acc->frame->format = acc->sample_fmt;
+  acc->frame->channel_layout = ctx->channel_layout;
+  acc->frame->channels = ctx->channels;
+  acc->frame->sample_rate = ctx->sample_rate;
+  int ret = av_frame_get_buffer(acc->frame, 0);
+  if (ret < 0) {
+    debug_av_perror("av_frame_get_buffer", ret);
+    free_audio_accumulator(acc);
+    return NULL;
+  }
+
+  debug_msg("Audio accumulator: frame %d samples at %d Hz\n", acc->frame_size,
+            ctx->sample_rate);
+  return acc;
+}
+
+int audio_accumulator_write(audio_accumulator_t* acc, const uint8_t* const* data,
+                            int nb_samples) {
+  if (!acc || !data || nb_samples < 0) {
+    debug_perror("audio_accumulator_write", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  int ret = av_audio_fifo_write(acc->fifo, reinterpret_cast<void**>(const_cast<uint8_t**>(data)),
+                                nb_samples);
+  if (ret < nb_samples) {
+    debug_av_perror("av_audio_fifo_write", ret < 0 ? ret : AVERROR(ENOMEM));
+    return ERROR_RESULT_VALUE;
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+AVFrame* audio_accumulator_next_frame(audio_accumulator_t* acc, bool flush) {
+  if (!acc) {
+    debug_perror("audio_accumulator_next_frame", EINVAL);
+    return NULL;
+  }
+
+  int available = av_audio_fifo_size(acc->fifo);
+  if (available == 0 || (available < acc->frame_size && !flush)) {
+    return NULL;
+  }
+
+  // the encoder may still hold the previous one
+  AVFrame* frame = acc->frame;
+  frame->nb_samples = acc->frame_size;
+  int ret = av_frame_make_writable(frame);
+  if (ret < 0) {
+    debug_av_perror("av_frame_make_writable", ret);
+    return NULL;
+  }
+
+  int nb_samples = FFMIN(available, acc->frame_size);
+  ret = av_audio_fifo_read(acc->fifo, reinterpret_cast<void**>(frame->extended_data), nb_samples);
+  if (ret < nb_samples) {
+    debug_av_perror("av_audio_fifo_read", ret < 0 ? ret : AVERROR(EIO));
+    return NULL;
+  }
+
+  if (nb_samples < acc->frame_size) {
+    if (acc->small_last_frame) {
+      frame->nb_samples = nb_samples;
+    } else {
+      av_samples_set_silence(frame->extended_data, nb_samples, acc->frame_size - nb_samples,
+                             acc->channels, acc->sample_fmt);
+    }
+  }
+
+  frame->pts = acc->next_pts;
+  acc->next_pts += frame->nb_samples;
+  return frame;
+}
+
+int audio_accumulator_size(audio_accumulator_t* acc) {
+  if (!acc) {
+    debug_perror("audio_accumulator_size", EINVAL);
+    return 0;
+  }
+
+  return av_audio_fifo_size(acc->fifo);
+}
+
+void free_audio_accumulator(audio_accumulator_t* acc) {
+  if (!acc) {
+    debug_perror("free_audio_accumulator", EINVAL);
+    return;
+  }
+
+  if (acc->frame) {
+    av_frame_free(&acc->frame);
+  }
+
+  if (acc->fifo) {
+    av_audio_fifo_free(acc->fifo);
+    acc->fifo = NULL;
+  }
+  free(acc);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,40 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+}
+
+#include "macros.h"
+
+#define AUDIO_ACCUMULATOR_DEFAULT_FRAME_MSEC 20  // codecs taking any frame size (pcm)
+
+namespace fasto {
+namespace media {
+
+/* collects PCM of any chunk size in the encoder sample format and gives it back
+ * as frames of exactly the encoder frame_size, pts counted in samples */
+typedef struct audio_accumulator_t {
+  AVAudioFifo* fifo;  // grows once to the largest backlog, then reused
+  AVFrame* frame;  // handed out by audio_accumulator_next_frame
+  int frame_size;
+  bool small_last_frame;  // encoder takes a shorter last frame, else padded with silence
+  int channels;
+  enum AVSampleFormat sample_fmt;
+  int64_t next_pts;  // 1/sample_rate, the encoder time base
+} audio_accumulator_t;
+
+audio_accumulator_t* alloc_audio_accumulator(const AVCodecContext* ctx);  // opened encoder
+// data - one pointer per plane, like AVFrame::extended_data
+int audio_accumulator_write(audio_accumulator_t* acc, const uint8_t* const* data,
+                            int nb_samples);
+/* next full frame or NULL if not enough samples, flush - also the remaining
+ * samples; frame valid until the next call */
+AVFrame* audio_accumulator_next_frame(audio_accumulator_t* acc, bool flush);
+int audio_accumulator_size(audio_accumulator_t* acc);  // buffered samples
+void free_audio_accumulator(audio_accumulator_t* acc);
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,363 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/bgr_to_yuv.h"
+
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "log.h"
+
+// BT.601 limited range, 15 bit fixed point like swscale
+#define YUV_SHIFT 15
+#define RY 8414
+#define GY 16519
+#define BY 3208
+#define RU -4857
+#define GU -9535
+#define BU 14392
+#define RV 14392
+#define GV -12052
+#define BV -2340
+#define Y_OFFSET ((16 << YUV_SHIFT) + (1 << (YUV_SHIFT - 1)))
+// chroma is computed from the sum of 2x2 pixels, so 2 more bits
+#define C_SHIFT (YUV_SHIFT + 2)
+#define C_OFFSET ((128 << C_SHIFT) + (1 << (C_SHIFT - 1)))
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+// two source rows giving two luma rows and one chroma row
+typedef struct row_pair_t {
+  const uint8_t* src0;
+  const uint8_t* src1;  // == src0 for the last row of odd height
+  int bpp;  // 3 - BGR24, 4 - BGRA
+  int width;
+  uint8_t* y0;
+  uint8_t* y1;  // == y0 for the last row of odd height
+  uint8_t* u;
+  uint8_t* v;
+  int uv_step;  // 1 - YUV420P, 2 - NV12 (v == u + 1)
+} row_pair_t;
+
+// converts pixels [from, width), from is even
+typedef void (*row_pair_kernel_t)(const row_pair_t* rows, int from);
+
+typedef struct bgr_to_yuv_kernel_t {
+  const char* name;
+  row_pair_kernel_t convert_row_pair;
+} bgr_to_yuv_kernel_t;
+
+inline uint8_t luma_c(const uint8_t* p) {
+  return (RY * p[2] + GY * p[1] + BY * p[0] + Y_OFFSET) >> YUV_SHIFT;
+}
+
+void row_pair_c(const row_pair_t* rows, int from) {
+  const int bpp = rows->bpp;
+  for (int x = from; x < rows->width; x += 2) {
+    const uint8_t* p00 = rows->src0 + x * bpp;
+    const uint8_t* p10 = rows->src1 + x * bpp;
+    // odd width: last column is its own neighbour
+    const uint8_t* p01 = x + 1 < rows->width ? p00 + bpp : p00;
+    const uint8_t* p11 = x + 1 < rows->width ? p10 + bpp : p10;
+
+    rows->y0[x] = luma_c(p00);
+    rows->y1[x] = luma_c(p10);
+    if (x + 1 < rows->width) {
+      rows->y0[x + 1] = luma_c(p01);
+      rows->y1[x + 1] = luma_c(p11);
+    }
+
+    int bs = p00[0] + p01[0] + p10[0] + p11[0];
+    int gs = p00[1] + p01[1] + p10[1] + p11[1];
+    int rs = p00[2] + p01[2] + p10[2] + p11[2];
+    int pos = (x / 2) * rows->uv_step;
+    rows->u[pos] = (RU * rs + GU * gs + BU * bs + C_OFFSET) >> C_SHIFT;
+    rows->v[pos] = (RV * rs + GV * gs + BV * bs + C_OFFSET) >> C_SHIFT;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// pshufb masks gathering one channel of 16 BGR24 pixels from three 16 byte loads
+const int8_t kBgr24Shuffle[3][3][16] = {
+  { { 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 } },
+  { { 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 } },
+  { { 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 } }
+};
+
+// BGRA dword -> bytes grouped by channel
+const int8_t kBgraShuffle[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+
+// int16 pair (lo, hi) for _mm_madd_epi16
+inline int coef_pair(int lo, int hi) {
+  return static_cast<int>((static_cast<uint32_t>(static_cast<uint16_t>(hi)) << 16) |
+                          static_cast<uint16_t>(lo));
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i gather_bgr24_sse4(const __m128i* v, int channel) {
+  const int8_t (*masks)[16] = kBgr24Shuffle[channel];
+  __m128i c0 = _mm_shuffle_epi8(v[0], _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[0])));
+  __m128i c1 = _mm_shuffle_epi8(v[1], _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[1])));
+  __m128i c2 = _mm_shuffle_epi8(v[2], _mm_loadu_si128(reinterpret_cast<const __m128i*>(masks[2])));
+  return _mm_or_si128(_mm_or_si128(c0, c1), c2);
+}
+
+// 16 pixels -> one u8 vector per channel
+__attribute__((target("sse4.1")))
+inline void load_bgr16_sse4(const uint8_t* src, int bpp, __m128i* b, __m128i* g, __m128i* r) {
+  const __m128i* in = reinterpret_cast<const __m128i*>(src);
+  if (bpp == 3) {
+    __m128i v[3] = { _mm_loadu_si128(in), _mm_loadu_si128(in + 1), _mm_loadu_si128(in + 2) };
+    *b = gather_bgr24_sse4(v, 0);
+    *g = gather_bgr24_sse4(v, 1);
+    *r = gather_bgr24_sse4(v, 2);
+    return;
+  }
+
+  const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kBgraShuffle));
+  __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128(in), mask);
+  __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), mask);
+  __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), mask);
+  __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), mask);
+  __m128i bg01 = _mm_unpacklo_epi32(s0, s1);
+  __m128i ra01 = _mm_unpackhi_epi32(s0, s1);
+  __m128i bg23 = _mm_unpacklo_epi32(s2, s3);
+  __m128i ra23 = _mm_unpackhi_epi32(s2, s3);
+  *b = _mm_unpacklo_epi64(bg01, bg23);
+  *g = _mm_unpackhi_epi64(bg01, bg23);
+  *r = _mm_unpacklo_epi64(ra01, ra23);
+}
+
+// c_bg * (b, g) + c_r * r + offset for 8 int16 values, result still int32 >> shift as int16
+__attribute__((target("sse4.1")))
+inline __m128i dot3_sse4(__m128i b16, __m128i g16, __m128i r16, int cb, int cg, int cr,
+                         int offset, int shift) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i c_bg = _mm_set1_epi32(coef_pair(cb, cg));
+  const __m128i c_r = _mm_set1_epi32(coef_pair(cr, 0));
+  const __m128i off = _mm_set1_epi32(offset);
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+
+  __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b16, g16), c_bg),
+                             _mm_madd_epi16(_mm_unpacklo_epi16(r16, zero), c_r));
+  __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b16, g16), c_bg),
+                             _mm_madd_epi16(_mm_unpackhi_epi16(r16, zero), c_r));
+  lo = _mm_sra_epi32(_mm_add_epi32(lo, off), cnt);
+  hi = _mm_sra_epi32(_mm_add_epi32(hi, off), cnt);
+  return _mm_packs_epi32(lo, hi);
+}
+
+__attribute__((target("sse4.1")))
+inline __m128i luma16_sse4(__m128i b, __m128i g, __m128i r) {
+  __m128i lo = dot3_sse4(_mm_cvtepu8_epi16(b), _mm_cvtepu8_epi16(g), _mm_cvtepu8_epi16(r),
+                         BY, GY, RY, Y_OFFSET, YUV_SHIFT);
+  __m128i hi = dot3_sse4(_mm_unpackhi_epi8(b, _mm_setzero_si128()),
+                         _mm_unpackhi_epi8(g, _mm_setzero_si128()),
+                         _mm_unpackhi_epi8(r, _mm_setzero_si128()),
+                         BY, GY, RY, Y_OFFSET, YUV_SHIFT);
+  return _mm_packus_epi16(lo, hi);
+}
+
+// sums of horizontal pairs of both rows, 8 int16
+__attribute__((target("sse4.1")))
+inline __m128i sum2x2_sse4(__m128i row0, __m128i row1) {
+  const __m128i ones = _mm_set1_epi8(1);
+  return _mm_add_epi16(_mm_maddubs_epi16(row0, ones), _mm_maddubs_epi16(row1, ones));
+}
+
+__attribute__((target("sse4.1")))
+void row_pair_sse4(const row_pair_t* rows, int from) {
+  const int bpp = rows->bpp;
+  int x = from;
+  for (; x + 16 <= rows->width; x += 16) {
+    __m128i b0, g0, r0, b1, g1, r1;
+    load_bgr16_sse4(rows->src0 + x * bpp, bpp, &b0, &g0, &r0);
+    load_bgr16_sse4(rows->src1 + x * bpp, bpp, &b1, &g1, &r1);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->y0 + x), luma16_sse4(b0, g0, r0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->y1 + x), luma16_sse4(b1, g1, r1));
+
+    __m128i bs = sum2x2_sse4(b0, b1);
+    __m128i gs = sum2x2_sse4(g0, g1);
+    __m128i rs = sum2x2_sse4(r0, r1);
+    __m128i u = dot3_sse4(bs, gs, rs, BU, GU, RU, C_OFFSET, C_SHIFT);
+    __m128i v = dot3_sse4(bs, gs, rs, BV, GV, RV, C_OFFSET, C_SHIFT);
+    __m128i uv = _mm_packus_epi16(u, v);  // u0..u7 v0..v7
+
+    int pos = x / 2;
+    if (rows->uv_step == 2) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->u + pos * 2),
+                       _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+    } else {
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(rows->u + pos), uv);
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(rows->v + pos), _mm_srli_si128(uv, 8));
+    }
+  }
+
+  row_pair_c(rows, x);
+}
+
+// same as dot3_sse4 for 16 int16 values, packs within lanes keep the order
+__attribute__((target("avx2")))
+inline __m256i dot3_avx2(__m256i b16, __m256i g16, __m256i r16, int cb, int cg, int cr,
+                         int offset, int shift) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i c_bg = _mm256_set1_epi32(coef_pair(cb, cg));
+  const __m256i c_r = _mm256_set1_epi32(coef_pair(cr, 0));
+  const __m256i off = _mm256_set1_epi32(offset);
+  const __m128i cnt = _mm_cvtsi32_si128(shift);
+
+  __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(b16, g16), c_bg),
+                                _mm256_madd_epi16(_mm256_unpacklo_epi16(r16, zero), c_r));
+  __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(b16, g16), c_bg),
+                                _mm256_madd_epi16(_mm256_unpackhi_epi16(r16, zero), c_r));
+  lo = _mm256_sra_epi32(_mm256_add_epi32(lo, off), cnt);
+  hi = _mm256_sra_epi32(_mm256_add_epi32(hi, off), cnt);
+  return _mm256_packs_epi32(lo, hi);
+}
+
+__attribute__((target("avx2")))
+inline __m256i luma16_avx2(__m128i b, __m128i g, __m128i r) {
+  return dot3_avx2(_mm256_cvtepu8_epi16(b), _mm256_cvtepu8_epi16(g), _mm256_cvtepu8_epi16(r),
+                   BY, GY, RY, Y_OFFSET, YUV_SHIFT);
+}
+
+__attribute__((target("avx2")))
+inline __m256i combine_avx2(__m128i lo, __m128i hi) {
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+__attribute__((target("avx2")))
+void row_pair_avx2(const row_pair_t* rows, int from) {
+  const int bpp = rows->bpp;
+  int x = from;
+  for (; x + 32 <= rows->width; x += 32) {
+    const uint8_t* src0 = rows->src0 + x * bpp;
+    const uint8_t* src1 = rows->src1 + x * bpp;
+    __m128i b0a, g0a, r0a, b0b, g0b, r0b, b1a, g1a, r1a, b1b, g1b, r1b;
+    load_bgr16_sse4(src0, bpp, &b0a, &g0a, &r0a);
+    load_bgr16_sse4(src0 + 16 * bpp, bpp, &b0b, &g0b, &r0b);
+    load_bgr16_sse4(src1, bpp, &b1a, &g1a, &r1a);
+    load_bgr16_sse4(src1 + 16 * bpp, bpp, &b1b, &g1b, &r1b);
+
+    // packus interleaves the lanes of both halves, permute restores pixel order
+    __m256i y0 = _mm256_packus_epi16(luma16_avx2(b0a, g0a, r0a), luma16_avx2(b0b, g0b, r0b));
+    __m256i y1 = _mm256_packus_epi16(luma16_avx2(b1a, g1a, r1a), luma16_avx2(b1b, g1b, r1b));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(rows->y0 + x),
+                        _mm256_permute4x64_epi64(y0, 0xD8));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(rows->y1 + x),
+                        _mm256_permute4x64_epi64(y1, 0xD8));
+
+    __m256i bs = combine_avx2(sum2x2_sse4(b0a, b1a), sum2x2_sse4(b0b, b1b));
+    __m256i gs = combine_avx2(sum2x2_sse4(g0a, g1a), sum2x2_sse4(g0b, g1b));
+    __m256i rs = combine_avx2(sum2x2_sse4(r0a, r1a), sum2x2_sse4(r0b, r1b));
+    __m256i u = dot3_avx2(bs, gs, rs, BU, GU, RU, C_OFFSET, C_SHIFT);
+    __m256i v = dot3_avx2(bs, gs, rs, BV, GV, RV, C_OFFSET, C_SHIFT);
+    // u0..u15 v0..v15
+    __m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(u, v), 0xD8);
+    __m128i u8 = _mm256_castsi256_si128(uv);
+    __m128i v8 = _mm256_extracti128_si256(uv, 1);
+
+    int pos = x / 2;
+    if (rows->uv_step == 2) {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->u + pos * 2), _mm_unpacklo_epi8(u8, v8));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->u + pos * 2 + 16),
+                       _mm_unpackhi_epi8(u8, v8));
+    } else {
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->u + pos), u8);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(rows->v + pos), v8);
+    }
+  }
+
+  row_pair_sse4(rows, x);
+}
+#endif
+
+const bgr_to_yuv_kernel_t* select_bgr_to_yuv_kernel() {
+  static const bgr_to_yuv_kernel_t kernel_c = { "c", row_pair_c };
+#if defined(__x86_64__) || defined(__i386__)
+  static const bgr_to_yuv_kernel_t kernel_sse4 = { "sse4.1", row_pair_sse4 };
+  static const bgr_to_yuv_kernel_t kernel_avx2 = { "avx2", row_pair_avx2 };
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &kernel_avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return &kernel_sse4;
+  }
+#endif
+  return &kernel_c;
+}
+
+const bgr_to_yuv_kernel_t* bgr_to_yuv_kernel() {
+  static const bgr_to_yuv_kernel_t* kernel = select_bgr_to_yuv_kernel();
+  return kernel;
+}
+
+int convert_frame(row_pair_kernel_t convert_row_pair, const uint8_t* src, int linesize,
+                  int width, int height, enum AVPixelFormat src_fmt, uint8_t* const dst[],
+                  const int dst_linesize[], enum AVPixelFormat dst_fmt) {
+  if (!src || !dst || !dst_linesize || width <= 0 || height <= 0 ||
+      !bgr_to_yuv_supported(src_fmt, dst_fmt)) {
+    debug_perror("bgr_to_yuv", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  row_pair_t rows;
+  rows.bpp = src_fmt == AV_PIX_FMT_BGR24 ? 3 : 4;
+  rows.width = width;
+  rows.uv_step = dst_fmt == AV_PIX_FMT_NV12 ? 2 : 1;
+
+  for (int y = 0; y < height; y += 2) {
+    bool last_odd = y + 1 == height;
+    rows.src0 = src + y * linesize;
+    rows.src1 = last_odd ? rows.src0 : rows.src0 + linesize;
+    rows.y0 = dst[0] + y * dst_linesize[0];
+    rows.y1 = last_odd ? rows.y0 : rows.y0 + dst_linesize[0];
+    rows.u = dst[1] + (y / 2) * dst_linesize[1];
+    rows.v = rows.uv_step == 2 ? rows.u + 1 : dst[2] + (y / 2) * dst_linesize[2];
+    convert_row_pair(&rows, 0);
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+}  // namespace
+
+bool bgr_to_yuv_supported(enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt) {
+  return (src_fmt == AV_PIX_FMT_BGR24 || src_fmt == AV_PIX_FMT_BGRA) &&
+      (dst_fmt == AV_PIX_FMT_YUV420P || dst_fmt == AV_PIX_FMT_NV12);
+}
+
+int bgr_to_yuv(const uint8_t* src, int linesize, int width, int height,
+               enum AVPixelFormat src_fmt, uint8_t* const dst[], const int dst_linesize[],
+               enum AVPixelFormat dst_fmt) {
+  return convert_frame(bgr_to_yuv_kernel()->convert_row_pair, src, linesize, width, height,
+                       src_fmt, dst, dst_linesize, dst_fmt);
+}
+
+int bgr_to_yuv_c(const uint8_t* src, int linesize, int width, int height,
+                 enum AVPixelFormat src_fmt, uint8_t* const dst[], const int dst_linesize[],
+                 enum AVPixelFormat dst_fmt) {
+  return convert_frame(row_pair_c, src, linesize, width, height, src_fmt, dst, dst_linesize,
+                       dst_fmt);
+}
+
+const char* bgr_to_yuv_kernel_name() {
+  return bgr_to_yuv_kernel()->name;
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,30 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#include "macros.h"
+
+namespace fasto {
+namespace media {
+
+/* same size BGR24/BGRA -> YUV420P/NV12 without swscale, BT.601 limited range,
+ * chroma is the average of each 2x2 block; SSE4.1/AVX2 kernel picked at runtime,
+ * every kernel gives the same bytes as the scalar one; luma is within 1 LSB of swscale,
+ * chroma only on smooth content: swscale filters chroma over more than the 2x2 block,
+ * on noise and sharp edges the two differ by many LSB */
+bool bgr_to_yuv_supported(enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt);
+int bgr_to_yuv(const uint8_t* src, int linesize, int width, int height,
+               enum AVPixelFormat src_fmt, uint8_t* const dst[], const int dst_linesize[],
+               enum AVPixelFormat dst_fmt);
+// scalar reference of bgr_to_yuv
+int bgr_to_yuv_c(const uint8_t* src, int linesize, int width, int height,
+                 enum AVPixelFormat src_fmt, uint8_t* const dst[], const int dst_linesize[],
+                 enum AVPixelFormat dst_fmt);
+const char* bgr_to_yuv_kernel_name();  // kernel selected for this cpu
+
+}  // namespace media
+}  // namespace fasto
@@ -2,13 +2,49 @@
 
 #include "media/codec_holder.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
 #include "log.h"
 
+#include "media/muxer_writer.h"
+#include "media/output_fanout.h"
+#include "media/packet_pool.h"
+#include "media/segment_rotator.h"
+#include "media/stream_stats.h"
+
 #define STREAM_FRAME_RATE2 90000
 #define STREAM_PIX_FMT AV_PIX_FMT_YUV420P /* default pix_fmt */
+#define OUTPUT_IO_BUFFER_SIZE (64 * 1024)  // in front of a file_writer_t without avio_buffer_size
 
 namespace {
 
+// requested rate if the encoder takes it, else the closest higher one (libopus: 8k..48k)
+int supported_sample_rate(const AVCodec* codec, int sampleRate) {
+  if (!codec->supported_samplerates) {
+    return sampleRate;
+  }
+
+  int higher = 0;
+  int lower = 0;
+  for (const int* rate = codec->supported_samplerates; *rate; ++rate) {
+    if (*rate == sampleRate) {
+      return sampleRate;
+    }
+    if (*rate > sampleRate && (!higher || *rate < higher)) {
+      higher = *rate;
+    } else if (*rate < sampleRate && *rate > lower) {
+      lower = *rate;
+    }
+  }
+  return higher ? higher : lower ? lower : sampleRate;
+}
+
 void prepare_audio_ctx(AVCodecContext* ctx, AVCodec* codec, int sampleRate,
                        int channels, int audioBitrate) {
   if (!ctx || !codec) {
@@ -16,6 +52,7 @@ void prepare_audio_ctx(AVCodecContext* ctx, AVCodec* codec, int sampleRate,
   }
 
   if (codec->type == AVMEDIA_TYPE_AUDIO) {
+    sampleRate = supported_sample_rate(codec, sampleRate);
     ctx->bit_rate = audioBitrate;
     ctx->sample_fmt = codec->sample_fmts ? codec->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
     ctx->sample_rate = sampleRate;
@@ -24,8 +61,7 @@ void prepare_audio_ctx(AVCodecContext* ctx, AVCodec* codec, int sampleRate,
     // ctx->time_base = (AVRational) {1, sampleRate};
     ctx->time_base.num  = 1;
     ctx->time_base.den  = sampleRate;
-    ctx->codec_type = codec->type;
-    ctx->frame_size = sampleRate;
+    ctx->codec_type = codec->type;  // frame_size is chosen by the encoder in avcodec_open2
   }
 }
 
@@ -79,13 +115,6 @@ void prepare_video_decoder(decoder_t* codec_holder, int width, int height) {
   AVCodec* codec = codec_holder->codec;
 
   prepare_video_ctx(ctx, codec, width, height);
-
-  /*
-    if (ctx->codec_id == AV_CODEC_ID_H264) {
-      ctx->thread_count = 5;
-      ctx->thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
-    }
-  */
 }
 
 void prepare_video_encoder(encoder_t* codec_holder, int width, int height, AVRational time_base) {
@@ -144,10 +173,8 @@ void prepare_audio_output_stream(output_stream_t* ostream, AVCodec* codec, int s
   }
 
   AVCodecContext* ctx = ostream->audio_stream->codec;
-  AVRational sr = { 1, sampleRate };
-  ostream->audio_stream->time_base = sr;
-
   prepare_audio_ctx(ctx, codec, sampleRate, channels, audioBitrate);
+  ostream->audio_stream->time_base = ctx->time_base;  // 1 / rate the encoder runs at
 
   /* Some formats want stream headers to be separate. */
   if (ostream->oformat_context->flags & AVFMT_GLOBALHEADER) {
@@ -179,6 +206,9 @@ void prepare_video_output_stream(output_stream_t* ostream, AVCodec* codec, int w
   enc.codec = codec;
   enc.context = ctx;
   prepare_video_encoder(&enc, width, height, tb);
+  if (bit_rate > 0) {
+    ctx->bit_rate = bit_rate;
+  }
 
   /* Some formats want stream headers to be separate. */
   if (ostream->oformat_context->flags & AVFMT_GLOBALHEADER) {
@@ -226,7 +256,7 @@ int init_output_frame(AVFrame **frame, AVCodecContext *output_codec_context, int
    * sure that the audio frame can hold as many samples as specified.
    */
   if ((error = av_frame_get_buffer(*frame, 0)) < 0) {
-    debug_error("Could allocate output frame samples (error '%s')\n", error);
+    debug_av_perror("av_frame_get_buffer", error);
     av_frame_free(frame);
     return error;
   }
@@ -234,9 +264,274 @@ int init_output_frame(AVFrame **frame, AVCodecContext *output_codec_context, int
   return 0;
 }
 
+void prepare_codec_threading(AVCodecContext* ctx, const codec_threading_t* threading) {
+  if (!ctx || !threading) {
+    return;
+  }
+
+  ctx->thread_count = threading->thread_count;
+  if (threading->thread_type) {
+    ctx->thread_type = threading->thread_type;
+  }
+}
+
+/* libavcodec and external encoders spawn their workers inside avcodec_open2,
+ * the workers inherit the affinity of the opening thread */
+bool pin_current_thread(uint64_t cpu_mask, cpu_set_t* prev) {
+#ifdef __linux__
+  if (!cpu_mask) {
+    return false;
+  }
+
+  pthread_t self = pthread_self();
+  int err = pthread_getaffinity_np(self, sizeof(cpu_set_t), prev);
+  if (err) {
+    debug_perror("pthread_getaffinity_np", err);
+    return false;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu) {
+    if (cpu_mask & (UINT64_C(1) << cpu)) {
+      CPU_SET(cpu, &set);
+    }
+  }
+
+  err = pthread_setaffinity_np(self, sizeof(cpu_set_t), &set);
+  if (err) {
+    debug_perror("pthread_setaffinity_np", err);
+    return false;
+  }
+  return true;
+#else
+  if (cpu_mask) {
+    debug_warning("codec cpu pinning not supported on this platform\n");
+  }
+  return false;
+#endif
+}
+
+void restore_current_thread(const cpu_set_t* prev) {
+#ifdef __linux__
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), prev);
+  if (err) {
+    debug_perror("pthread_setaffinity_np", err);
+  }
+#endif
+}
+
+int direct_io_write(void* opaque, uint8_t* buf, int buf_size) {
+  AVIOContext* direct_io = reinterpret_cast<AVIOContext*>(opaque);
+  avio_write(direct_io, buf, buf_size);
+  return direct_io->error < 0 ? direct_io->error : buf_size;
+}
+
+int64_t direct_io_seek(void* opaque, int64_t offset, int whence) {
+  AVIOContext* direct_io = reinterpret_cast<AVIOContext*>(opaque);
+  if (whence & AVSEEK_SIZE) {
+    return avio_size(direct_io);
+  }
+  return avio_seek(direct_io, offset, whence);
+}
+
+int file_writer_avio_write(void* opaque, uint8_t* buf, int buf_size) {
+  file_writer_t* writer = reinterpret_cast<file_writer_t*>(opaque);
+  if (file_writer_write(writer, buf, buf_size) == ERROR_RESULT_VALUE) {
+    return AVERROR(writer->error ? writer->error : EIO);
+  }
+  return buf_size;
+}
+
+int64_t file_writer_avio_seek(void* opaque, int64_t offset, int whence) {
+  file_writer_t* writer = reinterpret_cast<file_writer_t*>(opaque);
+  if (whence & AVSEEK_SIZE) {
+    return writer->size;
+  }
+  int64_t pos = file_writer_seek(writer, offset, whence & ~AVSEEK_FORCE);
+  return pos < 0 ? AVERROR(EINVAL) : pos;
+}
+
+int open_file_writer_io(output_stream_t* ostream, const char* file_path, int avio_buffer_size,
+                        output_io_backend_t io_backend) {
+  AVFormatContext* oformat_context = ostream->oformat_context;
+  ostream->file_writer = alloc_file_writer(file_path, io_backend, 0);
+  if (!ostream->file_writer) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  int buffer_size = avio_buffer_size > 0 ? avio_buffer_size : OUTPUT_IO_BUFFER_SIZE;
+  unsigned char* buffer = reinterpret_cast<unsigned char*>(av_malloc(buffer_size));
+  if (!buffer) {
+    debug_perror("av_malloc", ENOMEM);
+    free_file_writer(ostream->file_writer);
+    ostream->file_writer = NULL;
+    return ERROR_RESULT_VALUE;
+  }
+
+  oformat_context->pb = avio_alloc_context(buffer, buffer_size, 1, ostream->file_writer,
+                                           NULL, file_writer_avio_write, file_writer_avio_seek);
+  if (!oformat_context->pb) {
+    debug_perror("avio_alloc_context", ENOMEM);
+    av_free(buffer);
+    free_file_writer(ostream->file_writer);
+    ostream->file_writer = NULL;
+    return ERROR_RESULT_VALUE;
+  }
+
+  oformat_context->pb->seekable = AVIO_SEEKABLE_NORMAL;
+  oformat_context->flush_packets = 0;
+  return SUCCESS_RESULT_VALUE;
+}
+
+/* with avio_buffer_size the muxer writes through a buffer of that size
+ * into an unbuffered protocol context, one write per full buffer */
+int open_output_io(output_stream_t* ostream, const char* file_path, int avio_buffer_size,
+                   output_io_backend_t io_backend) {
+  AVFormatContext* oformat_context = ostream->oformat_context;
+  if (oformat_context->oformat->flags & AVFMT_NOFILE) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  if (io_backend != OUTPUT_IO_AVIO) {
+    return open_file_writer_io(ostream, file_path, avio_buffer_size, io_backend);
+  }
+
+  if (avio_buffer_size <= 0) {
+    int nres = avio_open(&oformat_context->pb, file_path, AVIO_FLAG_WRITE);
+    if (nres < 0) {
+      debug_av_perror("avio_open", nres);
+      return ERROR_RESULT_VALUE;
+    }
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  int nres = avio_open(&ostream->direct_io, file_path, AVIO_FLAG_WRITE | AVIO_FLAG_DIRECT);
+  if (nres < 0) {
+    debug_av_perror("avio_open", nres);
+    return ERROR_RESULT_VALUE;
+  }
+
+  unsigned char* buffer = reinterpret_cast<unsigned char*>(av_malloc(avio_buffer_size));
+  if (!buffer) {
+    debug_perror("av_malloc", ENOMEM);
+    avio_closep(&ostream->direct_io);
+    return ERROR_RESULT_VALUE;
+  }
+
+  oformat_context->pb = avio_alloc_context(buffer, avio_buffer_size, 1, ostream->direct_io,
+                                           NULL, direct_io_write, direct_io_seek);
+  if (!oformat_context->pb) {
+    debug_perror("avio_alloc_context", ENOMEM);
+    av_free(buffer);
+    avio_closep(&ostream->direct_io);
+    return ERROR_RESULT_VALUE;
+  }
+
+  oformat_context->pb->seekable = ostream->direct_io->seekable;
+  oformat_context->flush_packets = 0;  // let the buffer fill up between packets
+  return SUCCESS_RESULT_VALUE;
+}
+
+void close_output_io(output_stream_t* ostream) {
+  AVFormatContext* oformat_context = ostream->oformat_context;
+  AVOutputFormat *fmt = oformat_context->oformat;
+  if (ostream->direct_io) {
+    /* Buffered context forwards to direct_io, flush it first. */
+    avio_flush(oformat_context->pb);
+    av_free(oformat_context->pb->buffer);
+    av_free(oformat_context->pb);
+    oformat_context->pb = NULL;
+    avio_closep(&ostream->direct_io);
+  } else if (ostream->file_writer) {
+    avio_flush(oformat_context->pb);
+    av_free(oformat_context->pb->buffer);
+    av_free(oformat_context->pb);
+    oformat_context->pb = NULL;
+    if (free_file_writer(ostream->file_writer) == ERROR_RESULT_VALUE) {
+      debug_error("%s was not written completely!\n", oformat_context->filename);
+    }
+    ostream->file_writer = NULL;
+  } else if (!(fmt->flags & AVFMT_NOFILE) && oformat_context->pb) {
+    /* Close the output file. */
+    avio_closep(&oformat_context->pb);
+  }
+}
+
+/* packets pointing at caller memory are copied into the stream pool,
+ * so the writer thread and fanout outputs may keep references */
+void make_packet_refcounted(packet_pool_t* pool, AVPacket* pkt) {
+  if (pkt->buf || !pkt->data) {
+    return;
+  }
+
+  if (pool && pkt->size <= pool->buffer_size) {
+    AVBufferRef* buf = packet_pool_get_buffer(pool, pkt->size);
+    if (buf) {
+      memcpy(buf->data, pkt->data, pkt->size);
+      pkt->buf = buf;
+      pkt->data = buf->data;
+      return;
+    }
+  }
+
+  AVPacket ref;
+  av_init_packet(&ref);
+  if (av_packet_ref(&ref, pkt) == 0) {
+    av_packet_move_ref(pkt, &ref);
+  }
+}
+
+int write_stream_frame(output_stream_t* ostream, AVStream* st, packet_pool_t* pool,
+                       AVPacket* pkt) {
+  /* with a rotator the writer of the source file may be
+   * stopped by the rotator thread, only the rotator is asked;
+   * set by rotate_media_stream while packets are written */
+  segment_rotator_t* rotator = __atomic_load_n(&ostream->rotator, __ATOMIC_ACQUIRE);
+  if (rotator || ostream->writer ||
+      (ostream->fanout && output_fanout_size(ostream->fanout))) {
+    make_packet_refcounted(pool, pkt);
+  }
+
+  if (ostream->fanout) {
+    output_fanout_write(ostream->fanout, st, pkt);
+  }
+
+  if (rotator && segment_rotator_write(rotator, st, pkt)) {
+    av_free_packet(pkt);
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  if (ostream->writer) {
+    pkt->stream_index = st->index;
+    return muxer_writer_push(ostream->writer, pkt);
+  }
+
+  return write_frame(ostream->oformat_context, st, pkt);
+}
+
+// left by avcodec_open2, e.g. options a libavcodec build does not know yet
+void free_unused_options(const AVCodecContext* ctx, AVDictionary** opt) {
+  AVDictionaryEntry* entry = NULL;
+  while ((entry = av_dict_get(*opt, "", entry, AV_DICT_IGNORE_SUFFIX))) {
+    debug_warning("%s ignored option %s=%s\n", ctx->codec ? ctx->codec->name : "codec",
+                  entry->key, entry->value);
+  }
+  av_dict_free(opt);
+}
+
+void log_packet_pool_stats(const char* name, packet_pool_t* pool) {
+  packet_pool_stats_t stats;
+  packet_pool_get_stats(pool, &stats);
+  debug_msg("%s packet pool: hits %" PRIu64 ", misses %" PRIu64 ", high water %" PRIu64
+            " buffers of %d bytes\n", name, stats.hits, stats.misses, stats.high_water,
+            pool->buffer_size);
+}
+
 }  // namespace
 
-decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id) {
+decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id,
+                                          const codec_threading_t* threading) {
   decoder_t* codec_holder = reinterpret_cast<decoder_t*>(calloc(1, sizeof(decoder_t)));
   if (!codec_holder) {
     debug_perror("calloc", ENOMEM);
@@ -255,9 +550,9 @@ decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id) {
     return NULL;
   }
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, 0);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, NULL,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     return NULL;
   }
@@ -265,7 +560,8 @@ decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id) {
   return codec_holder;
 }
 
-decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id) {
+decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id,
+                                          const codec_threading_t* threading) {
   decoder_t* codec_holder = reinterpret_cast<decoder_t*>(malloc(sizeof(decoder_t)));
   if (!codec_holder) {
     return NULL;
@@ -283,9 +579,9 @@ decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id) {
     return NULL;
   }
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, 0);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, NULL,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     return NULL;
   }
@@ -293,7 +589,8 @@ decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id) {
   return codec_holder;
 }
 
-decoder_t* alloc_video_decoder(enum AVCodecID codec_id, int width, int height, int bit_rate) {
+decoder_t* alloc_video_decoder(enum AVCodecID codec_id, int width, int height, int bit_rate,
+                               const codec_threading_t* threading) {
   decoder_t* codec_holder = reinterpret_cast<decoder_t*>(calloc(1, sizeof(decoder_t)));
   if (!codec_holder) {
     debug_perror("calloc", ENOMEM);
@@ -314,9 +611,9 @@ decoder_t* alloc_video_decoder(enum AVCodecID codec_id, int width, int height, i
 
   prepare_video_decoder(codec_holder, width, height);
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, 0);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, NULL,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     return NULL;
   }
@@ -325,7 +622,8 @@ decoder_t* alloc_video_decoder(enum AVCodecID codec_id, int width, int height, i
 }
 
 decoder_t* alloc_audio_decoder(enum AVCodecID codec_id, int sample_rate,
-                               int channels, int audio_bitrate) {
+                               int channels, int audio_bitrate,
+                               const codec_threading_t* threading) {
   decoder_t* codec_holder = reinterpret_cast<decoder_t*>(malloc(sizeof(decoder_t)));
   if (!codec_holder) {
     return NULL;
@@ -345,9 +643,9 @@ decoder_t* alloc_audio_decoder(enum AVCodecID codec_id, int sample_rate,
 
   prepare_audio_decoder(codec_holder, sample_rate, channels, audio_bitrate);
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, 0);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, NULL,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     return NULL;
   }
@@ -355,7 +653,7 @@ decoder_t* alloc_audio_decoder(enum AVCodecID codec_id, int sample_rate,
   return codec_holder;
 }
 
-decoder_t* alloc_decoder_by_ctx(const AVCodecContext *ctx) {
+decoder_t* alloc_decoder_by_ctx(const AVCodecContext *ctx, const codec_threading_t* threading) {
   if (!ctx) {
     debug_perror("alloc_decoder_by_ctx", EINVAL);
     return NULL;
@@ -385,9 +683,9 @@ decoder_t* alloc_decoder_by_ctx(const AVCodecContext *ctx) {
     return NULL;
   }
 
-  nres = avcodec_open2(codec_holder->context, codec_holder->codec, 0);
+  nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, NULL,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     return NULL;
   }
@@ -409,6 +707,19 @@ void free_decoder(decoder_t* holder) {
   free(holder);
 }
 
+int decoder_send_packet(decoder_t* holder, const AVPacket *avpkt) {
+  if (!holder || !holder->context) {
+    debug_perror("decoder_send_packet", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  int ret = avcodec_send_packet(holder->context, avpkt);
+  if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+    debug_av_perror("avcodec_send_packet", ret);
+  }
+  return ret;
+}
+
 int decoder_decode_video(decoder_t* holder, AVFrame *picture, const AVPacket *avpkt) {
   if (!holder || !avpkt || !holder->context) {
     debug_perror("decoder_decode_video", EINVAL);
@@ -416,7 +727,7 @@ int decoder_decode_video(decoder_t* holder, AVFrame *picture, const AVPacket *av
   }
 
   if (holder->context->codec_type != AVMEDIA_TYPE_VIDEO) {
-    debug_perror("decoder_decode_audio invalid codec type", EINVAL);
+    debug_perror("decoder_decode_video invalid codec type", EINVAL);
     return ERROR_RESULT_VALUE;
   }
 
@@ -427,11 +738,7 @@ int decoder_decode_video(decoder_t* holder, AVFrame *picture, const AVPacket *av
     return len;
   }
 
-  if (got_picture) {
-    return len;
-  } else {
-    return ERROR_RESULT_VALUE;
-  }
+  return got_picture ? len : ERROR_RESULT_VALUE;
 }
 
 int decoder_decode_audio(decoder_t* holder, AVFrame *frame, const AVPacket *avpkt) {
@@ -452,15 +759,25 @@ int decoder_decode_audio(decoder_t* holder, AVFrame *frame, const AVPacket *avpk
     return len;
   }
 
-  if (got_sample) {
-    return len;
-  } else {
-    return ERROR_RESULT_VALUE;
+  return got_sample ? len : ERROR_RESULT_VALUE;
+}
+
+int decoder_receive_frame(decoder_t* holder, AVFrame *frame) {
+  if (!holder || !frame || !holder->context) {
+    debug_perror("decoder_receive_frame", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  int ret = avcodec_receive_frame(holder->context, frame);
+  if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+    debug_av_perror("avcodec_receive_frame", ret);
   }
+  return ret;
 }
 
 encoder_t* alloc_video_encoder_by_codecid(enum AVCodecID codec_id, int width, int height,
-                                          int fps, AVDictionary * opt) {
+                                          int fps, const codec_threading_t* threading,
+                                          AVDictionary * opt) {
   encoder_t* codec_holder = reinterpret_cast<encoder_t*>(malloc(sizeof(encoder_t)));
   if (!codec_holder) {
     return NULL;
@@ -481,9 +798,9 @@ encoder_t* alloc_video_encoder_by_codecid(enum AVCodecID codec_id, int width, in
   AVRational tb = { 1, fps };
   prepare_video_encoder(codec_holder, width, height, tb);
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, &opt);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, &opt,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     free(codec_holder);
     return NULL;
@@ -493,7 +810,8 @@ encoder_t* alloc_video_encoder_by_codecid(enum AVCodecID codec_id, int width, in
 }
 
 encoder_t* alloc_audio_encoder_by_codecid(enum AVCodecID codec_id, int sample_rate, int channels,
-                                          int audio_bitrate, AVDictionary * opt) {
+                                          int audio_bitrate, const codec_threading_t* threading,
+                                          AVDictionary * opt) {
   encoder_t* codec_holder = reinterpret_cast<encoder_t*>(malloc(sizeof(encoder_t)));
   if (!codec_holder) {
     return NULL;
@@ -513,9 +831,9 @@ encoder_t* alloc_audio_encoder_by_codecid(enum AVCodecID codec_id, int sample_ra
 
   prepare_audio_encoder(codec_holder, sample_rate, channels, audio_bitrate);
 
-  int nres = avcodec_open2(codec_holder->context, codec_holder->codec, &opt);
+  int nres = open_codec_context(codec_holder->context, codec_holder->codec, threading, &opt,
+                                &codec_holder->threading);
   if (nres < 0) {
-    debug_av_perror("avcodec_open2", nres);
     avcodec_free_context(&codec_holder->context);
     free(codec_holder);
     return NULL;
@@ -538,13 +856,22 @@ void free_encoder(encoder_t *holder) {
   free(holder);
 }
 
-int encoder_encode_audio(encoder_t *holder, AVPacket* pkt, const AVFrame *frame, int* got_packet) {
-  if (!holder || !frame || !holder->context) {
-    debug_perror("codec_holder_encode_audio", EINVAL);
-    return ERROR_RESULT_VALUE;
+int encoder_send_frame(encoder_t *holder, const AVFrame *frame) {
+  if (!holder || !holder->context) {
+    debug_perror("encoder_send_frame", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  return encode_send_frame(holder->context, frame);
+}
+
+int encoder_receive_packet(encoder_t *holder, AVPacket *pkt) {
+  if (!holder || !holder->context) {
+    debug_perror("encoder_receive_packet", EINVAL);
+    return AVERROR(EINVAL);
   }
 
-  return encode_audio_frame(holder->context, frame, pkt, got_packet);
+  return encode_receive_packet(holder->context, pkt);
 }
 
 AVOutputFormat* find_avoutformat_by_codecids(enum AVCodecID vcodec_id, enum AVCodecID acodec_id) {
@@ -567,7 +894,8 @@ AVOutputFormat* find_avoutformat_by_codecids(enum AVCodecID vcodec_id, enum AVCo
 }
 
 output_stream_t* alloc_output_stream(AVOutputFormat *oformat, const char *file_path,
-                                     const char *format_name) {
+                                     const char *format_name, int avio_buffer_size,
+                                     output_io_backend_t io_backend) {
   if (!file_path && !oformat && !format_name) {
     debug_perror("alloc_output_stream", EINVAL);
     return NULL;
@@ -587,23 +915,17 @@ output_stream_t* alloc_output_stream(AVOutputFormat *oformat, const char *file_p
     return NULL;
   }
 
-  AVFormatContext* oformat_context = ostream->oformat_context;
-
-  AVOutputFormat *fmt = oformat_context->oformat;
   /* open the output file, if needed */
-  if (!(fmt->flags & AVFMT_NOFILE)) {
-    nres = avio_open(&oformat_context->pb, file_path, AVIO_FLAG_WRITE);
-    if (nres < 0) {
-      debug_av_perror("avio_open", nres);
-      free(ostream);
-      return NULL;
-    }
+  if (open_output_io(ostream, file_path, avio_buffer_size, io_backend) == ERROR_RESULT_VALUE) {
+    free(ostream);
+    return NULL;
   }
 
   return ostream;
 }
 
-output_stream_t* alloc_output_stream_without_codec(const char *file_path) {
+output_stream_t* alloc_output_stream_without_codec(const char *file_path, int avio_buffer_size,
+                                                   output_io_backend_t io_backend) {
   if (!file_path) {
     debug_perror("alloc_output_stream_without_codec", EINVAL);
     return NULL;
@@ -640,13 +962,9 @@ output_stream_t* alloc_output_stream_without_codec(const char *file_path) {
   strcpy(formatContext->filename, file_path);
 
   /* open the output file, if needed */
-  if (!(fmt->flags & AVFMT_NOFILE)) {
-    nres = avio_open(&ostream->oformat_context->pb, file_path, AVIO_FLAG_WRITE);
-    if (nres < 0) {
-      debug_av_perror("avio_open", nres);
-      free(ostream);
-      return NULL;
-    }
+  if (open_output_io(ostream, file_path, avio_buffer_size, io_backend) == ERROR_RESULT_VALUE) {
+    free(ostream);
+    return NULL;
   }
 
   return ostream;
@@ -658,19 +976,24 @@ void free_output_stream(output_stream_t *ostream) {
     return;
   }
 
+  if (ostream->writer) {
+    stop_output_stream_writer(ostream);
+  }
+
   if (ostream->auduo_frame_buffer) {
     av_frame_free(&ostream->auduo_frame_buffer);
   }
 
+  if (ostream->video_packets) {
+    log_packet_pool_stats("video", ostream->video_packets);
+    free_packet_pool(ostream->video_packets);
+    ostream->video_packets = NULL;
+  }
+
   AVFormatContext* oformat_context = ostream->oformat_context;
 
   if (oformat_context) {
-    AVOutputFormat *fmt = oformat_context->oformat;
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-      /* Close the output file. */
-      avio_closep(&oformat_context->pb);
-    }
-
+    close_output_io(ostream);
     avformat_free_context(ostream->oformat_context);
     ostream->oformat_context = NULL;
   }
@@ -712,6 +1035,7 @@ int open_audio_stream(output_stream_t* ostream, AVDictionary* opt) {
   AVCodecContext* cc = ostream->audio_stream->codec;
 
   int ret = avcodec_open2(cc, cc->codec, &opt);
+  free_unused_options(cc, &opt);
   if (ret < 0) {
     debug_av_perror("avcodec_open2", ret);
     return ERROR_RESULT_VALUE;
@@ -726,6 +1050,33 @@ int open_audio_stream(output_stream_t* ostream, AVDictionary* opt) {
   return SUCCESS_RESULT_VALUE;
 }
 
+void prepare_video_low_latency(output_stream_t* ostream, int gop_size, AVDictionary** opt) {
+  if (!ostream || !ostream->video_stream || !opt) {
+    debug_perror("prepare_video_low_latency", EINVAL);
+    return;
+  }
+
+  AVCodecContext* ctx = ostream->video_stream->codec;
+  ctx->max_b_frames = 0;
+  if (gop_size > 0) {
+    ctx->gop_size = gop_size;
+  }
+  if (ctx->bit_rate > 0 && ctx->time_base.num > 0) {
+    // one frame of buffer, every frame about the same size with intra refresh
+    ctx->rc_max_rate = ctx->bit_rate;
+    ctx->rc_buffer_size = static_cast<int>(ctx->bit_rate * ctx->time_base.num /
+                                           ctx->time_base.den);
+  }
+
+  if (ctx->codec && strcmp(ctx->codec->name, "libx264") == 0) {
+    av_dict_set(opt, "preset", "veryfast", AV_DICT_DONT_OVERWRITE);
+    av_dict_set(opt, "tune", "zerolatency", 0);
+    av_dict_set(opt, "rc-lookahead", "0", 0);
+    av_dict_set(opt, "intra-refresh", "1", 0);
+    av_dict_set(opt, "forced-idr", "1", 0);  // rotation still starts files with an IDR
+  }
+}
+
 int add_video_stream(output_stream_t *ostream, enum AVCodecID codec_id, int width, int height,
                      int bit_rate, int fps) {
   if (!ostream) {
@@ -784,10 +1135,56 @@ int add_video_stream_without_codec(output_stream_t *ostream, enum AVCodecID code
     videoContext->flags |= CODEC_FLAG_GLOBAL_HEADER;
   }
 
+  // key frames with SPS/PPS in front are assembled here, a raw picture bounds them
+  int raw_size = av_image_get_buffer_size(videoContext->pix_fmt, width, height, 1);
+  if (raw_size > 0 && !ostream->video_packets) {
+    ostream->video_packets = alloc_packet_pool(raw_size);
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+int add_stream_copy(output_stream_t* ostream, const AVStream* src) {
+  if (!ostream || !src || !src->codec) {
+    debug_perror("add_stream_copy", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  enum AVMediaType type = src->codec->codec_type;
+  if (type != AVMEDIA_TYPE_VIDEO && type != AVMEDIA_TYPE_AUDIO) {
+    debug_perror("add_stream_copy invalid codec type", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  AVFormatContext* oformat_context = ostream->oformat_context;
+  AVStream* st = avformat_new_stream(oformat_context, NULL);
+  if (!st) {
+    debug_error("Could not allocate stream\n");
+    return ERROR_RESULT_VALUE;
+  }
+
+  int ret = avcodec_copy_context(st->codec, src->codec);
+  if (ret < 0) {
+    debug_av_perror("avcodec_copy_context", ret);
+    return ERROR_RESULT_VALUE;
+  }
+
+  st->codec->codec_tag = 0;  // tag of the source container may be invalid here
+  st->time_base = src->time_base;
+  if (oformat_context->oformat->flags & AVFMT_GLOBALHEADER) {
+    st->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if (type == AVMEDIA_TYPE_VIDEO) {
+    ostream->video_stream = st;
+  } else {
+    ostream->audio_stream = st;
+  }
   return SUCCESS_RESULT_VALUE;
 }
 
-int open_video_stream(output_stream_t* ostream, AVDictionary *opt_arg) {
+int open_video_stream(output_stream_t* ostream, const codec_threading_t* threading,
+                      AVDictionary *opt_arg) {
   if (!ostream) {
     debug_perror("open_video_stream", EINVAL);
     return ERROR_RESULT_VALUE;
@@ -795,53 +1192,94 @@ int open_video_stream(output_stream_t* ostream, AVDictionary *opt_arg) {
 
   AVCodecContext *cc = ostream->video_stream->codec;
   /* open the codec */
-  int ret = avcodec_open2(cc, cc->codec, &opt_arg);
+  int ret = open_codec_context(cc, cc->codec, threading, &opt_arg, &ostream->video_threading);
+  free_unused_options(cc, &opt_arg);
   if (ret < 0) {
-    debug_av_perror("avcodec_open2", ret);
     return ERROR_RESULT_VALUE;
   }
 
   return SUCCESS_RESULT_VALUE;
 }
 
-int encode_audio_frame(AVCodecContext* ctx, const AVFrame* frame,
-                       AVPacket* pktout, int* got_packet) {
-  *got_packet = -1;
-  if (!ctx || !frame) {
-    debug_perror("encode_audio_frame", EINVAL);
-    return ERROR_RESULT_VALUE;
+int open_codec_context(AVCodecContext* ctx, const AVCodec* codec,
+                       const codec_threading_t* threading, AVDictionary** opt,
+                       codec_threading_t* applied) {
+  if (!ctx) {
+    debug_perror("open_codec_context", EINVAL);
+    return AVERROR(EINVAL);
   }
 
-  if (ctx->codec_type != AVMEDIA_TYPE_AUDIO) {
-    debug_perror("encode_audio_frame invalid codec type", EINVAL);
-    return ERROR_RESULT_VALUE;
+  prepare_codec_threading(ctx, threading);
+
+  cpu_set_t prev;
+  bool pinned = threading && pin_current_thread(threading->cpu_mask, &prev);
+  int ret = avcodec_open2(ctx, codec, opt);
+  if (pinned) {
+    restore_current_thread(&prev);
   }
 
-  int len = avcodec_encode_audio2(ctx, pktout, frame, got_packet);
-  if (len < 0) {
-    debug_av_perror("avcodec_encode_audio2", len);
-    return len;
+  if (ret < 0) {
+    debug_av_perror("avcodec_open2", ret);
+    return ret;
   }
 
-  return len;
+  codec_threading_t result;
+  result.thread_count = ctx->thread_count;  // resolved by libavcodec if auto requested
+  result.thread_type = ctx->active_thread_type;
+  result.cpu_mask = pinned ? threading->cpu_mask : 0;
+  if (applied) {
+    *applied = result;
+  }
+
+  debug_msg("Opened codec %s: requested threads %d type %d, applied threads %d type %s"
+            " cpu_mask 0x%" PRIx64 "\n", ctx->codec ? ctx->codec->name : "unknown",
+            threading ? threading->thread_count : -1, threading ? threading->thread_type : -1,
+            result.thread_count,
+            result.thread_type == FF_THREAD_FRAME ? "frame" :
+            result.thread_type == FF_THREAD_SLICE ? "slice" : "none",
+            result.cpu_mask);
+  return ret;
 }
 
-int encode_ostream_audio_frame(output_stream_t* ostream, AVFrame* frame,
-                               AVPacket* pktout, int* got_packet) {
-  if (!ostream || !frame) {
-    debug_perror("encode_ostream_audio_frame", EINVAL);
-    return ERROR_RESULT_VALUE;
+int encode_send_frame(AVCodecContext* ctx, const AVFrame* frame) {
+  if (!ctx) {
+    debug_perror("encode_send_frame", EINVAL);
+    return AVERROR(EINVAL);
   }
 
-  AVCodecContext* cc = ostream->audio_stream->codec;
-  return encode_audio_frame(cc, frame, pktout, got_packet);
+  int ret = avcodec_send_frame(ctx, frame);
+  if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+    debug_av_perror("avcodec_send_frame", ret);
+  }
+  return ret;
 }
 
-int encode_ostream_audio_buffer(output_stream_t* ostream, const uint8_t *buf, int buf_size,
-                                AVPacket* pktout, int* got_packet) {
-  if (!ostream || !buf || buf_size <= 0) {
-    debug_perror("encode_ostream_audio_frame", EINVAL);
-    return ERROR_RESULT_VALUE;
+int encode_receive_packet(AVCodecContext* ctx, AVPacket* pkt) {
+  if (!ctx || !pkt) {
+    debug_perror("encode_receive_packet", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  int ret = avcodec_receive_packet(ctx, pkt);
+  if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+    debug_av_perror("avcodec_receive_packet", ret);
+  }
+  return ret;
+}
+
+int send_ostream_audio_frame(output_stream_t* ostream, const AVFrame* frame) {
+  if (!ostream || !ostream->audio_stream) {
+    debug_perror("send_ostream_audio_frame", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  return encode_send_frame(ostream->audio_stream->codec, frame);
+}
+
+int send_ostream_audio_buffer(output_stream_t* ostream, const uint8_t *buf, int buf_size) {
+  if (!ostream || !ostream->audio_stream || !buf || buf_size <= 0) {
+    debug_perror("send_ostream_audio_buffer", EINVAL);
+    return AVERROR(EINVAL);
   }
 
   AVCodecContext* cc = ostream->audio_stream->codec;
@@ -850,10 +1288,24 @@ int encode_ostream_audio_buffer(output_stream_t* ostream, const uint8_t *buf, in
                                      buf, buf_size, 0);
   if (ret < 0) {
     debug_av_perror("avcodec_fill_audio_frame", ret);
-    return ERROR_RESULT_VALUE;
+    return ret;
   }
 
-  return encode_audio_frame(cc, ostream->auduo_frame_buffer, pktout, got_packet);
+  return encode_send_frame(cc, ostream->auduo_frame_buffer);
+}
+
+int receive_ostream_audio_packet(output_stream_t* ostream, AVPacket* pkt) {
+  if (!ostream || !ostream->audio_stream) {
+    debug_perror("receive_ostream_audio_packet", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  AVCodecContext* cc = ostream->audio_stream->codec;
+  int ret = encode_receive_packet(cc, pkt);
+  if (ret == 0) {
+    av_packet_rescale_ts(pkt, cc->time_base, ostream->audio_stream->time_base);
+  }
+  return ret;
 }
 
 void update_packet_pts(AVRational ctime_base, AVRational stime_base, int64_t frame_id,
@@ -974,49 +1426,178 @@ int write_audio_frame(output_stream_t* ostream, AVPacket *pkt) {
     return ERROR_RESULT_VALUE;
   }
 
-  return write_frame(ostream->oformat_context, ostream->audio_stream, pkt);
+  stream_stats_audio_muxed(ostream->stats, pkt->size);
+  return write_stream_frame(ostream, ostream->audio_stream, NULL, pkt);
+}
+
+int send_ostream_video_frame(output_stream_t* ostream, AVFrame* frame) {
+  if (!ostream || !ostream->video_stream) {
+    debug_perror("send_ostream_video_frame", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  if (frame) {
+    // frames are reused, a forced type would otherwise stick
+    frame->pict_type = __atomic_exchange_n(&ostream->force_key_frame, 0, __ATOMIC_ACQ_REL) ?
+                         AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+  }
+  return encode_send_frame(ostream->video_stream->codec, frame);
 }
 
-int encode_video_frame(AVCodecContext* ctx, const AVFrame* frame,
-                       AVPacket* pktout, int* got_packet) {
-  *got_packet = -1;
-  if (!ctx || !frame) {
-    debug_perror("encode_audio_frame", EINVAL);
+int receive_ostream_video_packet(output_stream_t* ostream, AVPacket* pkt) {
+  if (!ostream || !ostream->video_stream) {
+    debug_perror("receive_ostream_video_packet", EINVAL);
+    return AVERROR(EINVAL);
+  }
+
+  AVCodecContext* cc = ostream->video_stream->codec;
+  int ret = encode_receive_packet(cc, pkt);
+  if (ret == 0) {
+    if (pkt->pts != AV_NOPTS_VALUE) {
+      stream_stats_encoded(ostream->stats, pkt->pts);
+    }
+    av_packet_rescale_ts(pkt, cc->time_base, ostream->video_stream->time_base);
+  }
+  return ret;
+}
+
+int write_video_frame(output_stream_t *ostream, AVPacket *pkt) {
+  if (!ostream) {
+    debug_perror("write_audio_frame", EINVAL);
     return ERROR_RESULT_VALUE;
   }
 
-  if (ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
-    debug_perror("encode_video_frame invalid codec type", EINVAL);
+  if (ostream->stats) {
+    int64_t pts = pkt->pts == AV_NOPTS_VALUE ? -1 :
+                  av_rescale_q(pkt->pts, ostream->video_stream->time_base,
+                               ostream->video_stream->codec->time_base);
+    stream_stats_video_muxed(ostream->stats, pts, pkt->size);
+  }
+
+  return write_stream_frame(ostream, ostream->video_stream, ostream->video_packets, pkt);
+}
+
+output_stream_t* alloc_output_stream_copy(const output_stream_t* source, const char* file_path,
+                                          const char* format_name, AVDictionary* opt,
+                                          int avio_buffer_size, output_io_backend_t io_backend,
+                                          size_t writer_queue_size) {
+  if (!source || !file_path) {
+    debug_perror("alloc_output_stream_copy", EINVAL);
+    return NULL;
+  }
+
+  output_stream_t* ostream = alloc_output_stream(NULL, file_path, format_name, avio_buffer_size,
+                                                 io_backend);
+  if (!ostream) {
+    return NULL;
+  }
+
+  if (source->video_stream && add_stream_copy(ostream, source->video_stream) ==
+      ERROR_RESULT_VALUE) {
+    free_output_stream(ostream);
+    return NULL;
+  }
+
+  if (source->audio_stream && add_stream_copy(ostream, source->audio_stream) ==
+      ERROR_RESULT_VALUE) {
+    free_output_stream(ostream);
+    return NULL;
+  }
+
+  AVDictionary* header_opt = NULL;
+  av_dict_copy(&header_opt, opt, 0);
+  int ret = avformat_write_header(ostream->oformat_context, &header_opt);
+  av_dict_free(&header_opt);
+  if (ret < 0) {
+    debug_av_perror("avformat_write_header", ret);
+    free_output_stream(ostream);
+    return NULL;
+  }
+
+  if (writer_queue_size &&
+      start_output_stream_writer(ostream, writer_queue_size) == ERROR_RESULT_VALUE) {
+    debug_error("start_output_stream_writer failed, %s written synchronously!\n", file_path);
+  }
+
+  return ostream;
+}
+
+int close_output_stream_file(output_stream_t* ostream) {
+  if (!ostream || !ostream->oformat_context) {
+    debug_perror("close_output_stream_file", EINVAL);
     return ERROR_RESULT_VALUE;
   }
 
-  int len = avcodec_encode_video2(ctx, pktout, frame, got_packet);
-  if (len < 0) {
-    debug_av_perror("avcodec_encode_video2", len);
-    return len;
+  if (ostream->file_closed) {
+    return SUCCESS_RESULT_VALUE;
   }
 
-  return len;
+  stop_output_stream_writer(ostream);
+  int ret = av_write_trailer(ostream->oformat_context);
+  if (ret < 0) {
+    debug_av_perror("av_write_trailer", ret);
+  }
+  close_output_io(ostream);
+  ostream->file_closed = true;
+  return ret < 0 ? ERROR_RESULT_VALUE : SUCCESS_RESULT_VALUE;
 }
 
-int encode_ostream_video_frame(output_stream_t* ostream, AVFrame* frame,
-                               AVPacket* pktout, int* got_packet) {
-  if (!ostream || !frame) {
-    debug_perror("encode_ostream_audio_frame", EINVAL);
+void request_video_key_frame(output_stream_t* ostream) {
+  if (!ostream) {
+    debug_perror("request_video_key_frame", EINVAL);
+    return;
+  }
+
+  __atomic_store_n(&ostream->force_key_frame, 1, __ATOMIC_RELEASE);
+}
+
+int start_output_stream_writer(output_stream_t* ostream, size_t queue_size) {
+  if (!ostream || !ostream->oformat_context || queue_size == 0) {
+    debug_perror("start_output_stream_writer", EINVAL);
     return ERROR_RESULT_VALUE;
   }
 
-  AVCodecContext* cc = ostream->video_stream->codec;
-  return encode_video_frame(cc, frame, pktout, got_packet);
+  if (ostream->writer) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  ostream->writer = alloc_muxer_writer(ostream->oformat_context, queue_size);
+  if (!ostream->writer) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  return SUCCESS_RESULT_VALUE;
 }
 
-int write_video_frame(output_stream_t *ostream, AVPacket *pkt) {
+int flush_output_stream(output_stream_t* ostream) {
   if (!ostream) {
-    debug_perror("write_audio_frame", EINVAL);
+    debug_perror("flush_output_stream", EINVAL);
     return ERROR_RESULT_VALUE;
   }
 
-  return write_frame(ostream->oformat_context, ostream->video_stream, pkt);
+  if (ostream->writer) {
+    return muxer_writer_flush(ostream->writer);
+  }
+
+  if (ostream->oformat_context && ostream->oformat_context->pb) {
+    avio_flush(ostream->oformat_context->pb);
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+void stop_output_stream_writer(output_stream_t* ostream) {
+  if (!ostream) {
+    debug_perror("stop_output_stream_writer", EINVAL);
+    return;
+  }
+
+  if (!ostream->writer) {
+    return;
+  }
+
+  muxer_writer_flush(ostream->writer);
+  free_muxer_writer(ostream->writer);
+  ostream->writer = NULL;
 }
 
 void close_output_stream(output_stream_t* ostream) {
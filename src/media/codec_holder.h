@@ -9,42 +9,77 @@ extern "C" {
 }
 
 #include "media/ffmpeg_utils.h"
+#include "media/file_writer.h"
 
 namespace fasto {
 namespace media {
 
+struct packet_pool_t;
+struct muxer_writer_t;
+struct output_fanout_t;
+struct segment_rotator_t;
+struct stream_stats_t;
+struct file_writer_t;
+
+typedef struct codec_threading_t {
+  int thread_count;  // 0 - auto, one thread per core
+  int thread_type;  // FF_THREAD_FRAME | FF_THREAD_SLICE, 0 - codec default
+  uint64_t cpu_mask;  // bit per cpu the codec threads pinned to, 0 - not pinned
+} codec_threading_t;
+
 typedef struct decoder_t {
   AVCodec* codec;
   AVCodecContext* context;
+  codec_threading_t threading;  // applied by avcodec_open2
 } decoder_t;
 
-decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id);  // avcodec_find_decoder
-decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id);  // avcodec_find_decoder
+// threading may be NULL, libavcodec defaults used
+decoder_t* alloc_video_decoder_by_codecid(enum AVCodecID codec_id,
+                                          const codec_threading_t* threading);
+decoder_t* alloc_audio_decoder_by_codecid(enum AVCodecID codec_id,
+                                          const codec_threading_t* threading);
 
 decoder_t* alloc_video_decoder(enum AVCodecID codec_id, int width,
-                               int height, int bit_rate);  // avcodec_find_decoder
+                               int height, int bit_rate,
+                               const codec_threading_t* threading);  // avcodec_find_decoder
 decoder_t* alloc_audio_decoder(enum AVCodecID codec_id, int sample_rate,
-                               int channels, int audio_bitrate);  // avcodec_find_decoder
+                               int channels, int audio_bitrate,
+                               const codec_threading_t* threading);  // avcodec_find_decoder
 
-decoder_t* alloc_decoder_by_ctx(const AVCodecContext *ctx);  // avcodec_find_decoder
+decoder_t* alloc_decoder_by_ctx(const AVCodecContext *ctx,
+                                const codec_threading_t* threading);  // avcodec_find_decoder
 void free_decoder(decoder_t *holder);
 
+/* send/receive, a packet may give several frames or none yet (frame threads);
+ * NULL or empty avpkt (data NULL, size 0) starts the drain; AVERROR(EAGAIN) from send
+ * means frames must be received first */
+int decoder_send_packet(decoder_t *holder, const AVPacket *avpkt);
+// 0 and a frame, AVERROR(EAGAIN) if more packets needed, AVERROR_EOF once drained
+int decoder_receive_frame(decoder_t *holder, AVFrame *frame);
+/* deprecated, one frame per packet through avcodec_decode_video2/avcodec_decode_audio4:
+ * bytes used if a frame came out, else ERROR_RESULT_VALUE; frames a packet gives beyond
+ * the first and the ones delayed by frame threads are lost, do not mix with send/receive
+ * on the same decoder */
 int decoder_decode_video(decoder_t *holder, AVFrame *picture, const AVPacket *avpkt);
 int decoder_decode_audio(decoder_t *holder, AVFrame *frame, const AVPacket *avpkt);
 
 typedef struct encoder_t {
   AVCodec* codec;
   AVCodecContext* context;
+  codec_threading_t threading;  // applied by avcodec_open2
 } encoder_t;
 
 encoder_t* alloc_video_encoder_by_codecid(enum AVCodecID codec_id, int width, int height,
-                                          int fps, AVDictionary * opt);
+                                          int fps, const codec_threading_t* threading,
+                                          AVDictionary * opt);
 encoder_t* alloc_audio_encoder_by_codecid(enum AVCodecID codec_id, int sample_rate,
                                           int channels, int audio_bitrate,
+                                          const codec_threading_t* threading,
                                           AVDictionary *opt);  // avcodec_find_encoder
 void free_encoder(encoder_t *holder);
 
-int encoder_encode_audio(encoder_t *holder, AVPacket* pkt, const AVFrame *frame, int *got_packet);
+int encoder_send_frame(encoder_t *holder, const AVFrame *frame);
+int encoder_receive_packet(encoder_t *holder, AVPacket *pkt);
 
 
 typedef struct output_stream_t {
@@ -53,37 +88,67 @@ typedef struct output_stream_t {
   AVStream* video_stream;
 
   AVFrame* auduo_frame_buffer;
+  codec_threading_t video_threading;  // applied by open_video_stream
+
+  struct packet_pool_t* video_packets;  // passthrough key frames and their copies
+
+  AVIOContext* direct_io;  // unbuffered file behind oformat_context->pb, may be NULL
+  struct file_writer_t* file_writer;  // mmap or O_DIRECT file behind oformat_context->pb
+  struct muxer_writer_t* writer;  // NULL - packets written in caller thread
+  struct output_fanout_t* fanout;  // more muxers fed with the same packets, not owned
+  struct segment_rotator_t* rotator;  // takes over the file at rotation, not owned
+  int force_key_frame;  // next encoded video frame is a key frame
+  bool file_closed;  // trailer written, streams kept for the encoders
+
+  struct stream_stats_t* stats;  // encoded and muxed packets timed and counted, not owned
 } output_stream_t;
 
 AVOutputFormat* find_avoutformat_by_codecids(enum AVCodecID vcodec_id, enum AVCodecID acodec_id);
 
+// avio_buffer_size 0 - libavformat default buffering, io_backend other than OUTPUT_IO_AVIO
+// writes the file through a file_writer_t
 output_stream_t* alloc_output_stream(AVOutputFormat *oformat,
-                                     const char *file_path, const char *format_name);
-output_stream_t* alloc_output_stream_without_codec(const char *file_path);
+                                     const char *file_path, const char *format_name,
+                                     int avio_buffer_size, output_io_backend_t io_backend);
+output_stream_t* alloc_output_stream_without_codec(const char *file_path, int avio_buffer_size,
+                                                   output_io_backend_t io_backend);
 void free_output_stream(output_stream_t *ostream);
 
 int add_audio_stream(output_stream_t* ostream, enum AVCodecID codec_id, int sample_rate,
                      int channels, int audio_bitrate);
-int open_audio_stream(output_stream_t* ostream, AVDictionary *opt);
+int open_audio_stream(output_stream_t* ostream, AVDictionary *opt);  // opt freed
+// zero b-frames and lookahead, zerolatency tune, intra refresh spread over gop_size frames
+// instead of IDRs, vbv of one frame when bit_rate is set; call before open_video_stream
+void prepare_video_low_latency(output_stream_t* ostream, int gop_size, AVDictionary** opt);
 
 int add_video_stream(output_stream_t *ostream, enum AVCodecID codec_id, int width, int height,
                      int bit_rate, int fps);
 int add_video_stream_without_codec(output_stream_t *ostream, enum AVCodecID codec_id,
                                    int width, int height,
                                    int fps);  // open not needed, encode impossible
-int open_video_stream(output_stream_t* ostream, AVDictionary *opt_arg);
-
-int encode_audio_frame(AVCodecContext* ctx, const AVFrame* frame,
-                       AVPacket* pktout, int* got_packet);
-int encode_ostream_audio_frame(output_stream_t* ostream, AVFrame* frame,
-                               AVPacket* pktout, int* got_packet);
-int encode_ostream_audio_buffer(output_stream_t* ostream, const uint8_t *buf, int buf_size,
-                                AVPacket* pktout, int *got_packet);
-
-int encode_video_frame(AVCodecContext* ctx, const AVFrame* frame,
-                       AVPacket* pktout, int* got_packet);
-int encode_ostream_video_frame(output_stream_t* ostream, AVFrame* frame,
-                               AVPacket* pktout, int *got_packet);
+int open_video_stream(output_stream_t* ostream, const codec_threading_t* threading,
+                      AVDictionary *opt_arg);  // opt_arg freed, unused options logged
+// muxer only stream with codec parameters of src, packets of src written unchanged
+int add_stream_copy(output_stream_t* ostream, const AVStream* src);
+
+// avcodec_open2 with requested threading, codec threads inherit cpu_mask affinity,
+// applied (may be NULL) receives what libavcodec actually uses
+int open_codec_context(AVCodecContext* ctx, const AVCodec* codec,
+                       const codec_threading_t* threading, AVDictionary** opt,
+                       codec_threading_t* applied);
+
+/* send/receive, frame NULL starts the drain; send returns AVERROR(EAGAIN) if packets must
+ * be received first, receive 0 and a refcounted packet, AVERROR(EAGAIN) if the encoder
+ * wants more input, AVERROR_EOF once drained */
+int encode_send_frame(AVCodecContext* ctx, const AVFrame* frame);
+int encode_receive_packet(AVCodecContext* ctx, AVPacket* pkt);
+// ostream versions, packets come out in the stream time base, in the refcounted buffers
+// libavcodec allocated (this encode API takes no caller buffer) and are passed on as they are
+int send_ostream_audio_frame(output_stream_t* ostream, const AVFrame* frame);
+int send_ostream_audio_buffer(output_stream_t* ostream, const uint8_t *buf, int buf_size);
+int receive_ostream_audio_packet(output_stream_t* ostream, AVPacket* pkt);
+int send_ostream_video_frame(output_stream_t* ostream, AVFrame* frame);  // forced key frame
+int receive_ostream_video_packet(output_stream_t* ostream, AVPacket* pkt);
 
 void update_packet_pts(AVRational ctime_base, AVRational stime_base,
                        int64_t frame_id, AVPacket *pkt);
@@ -106,6 +171,22 @@ void init_audio_packet(output_stream_t* ostream, uint8_t *data, int size,
 int write_audio_frame(output_stream_t* ostream, AVPacket *pkt);
 int write_video_frame(output_stream_t *ost, AVPacket *pkt);
 
+// new file muxing packets of source unchanged, header written, writer started if queue size set
+output_stream_t* alloc_output_stream_copy(const output_stream_t* source, const char* file_path,
+                                          const char* format_name, AVDictionary* opt,
+                                          int avio_buffer_size, output_io_backend_t io_backend,
+                                          size_t writer_queue_size);
+// drains the writer, writes trailer and closes the file, encoders stay open
+int close_output_stream_file(output_stream_t* ostream);
+void request_video_key_frame(output_stream_t* ostream);  // thread safe
+
+// after avformat_write_header, write_*_frame then only queue packets for the writer thread
+int start_output_stream_writer(output_stream_t* ostream, size_t queue_size);
+// every packet written so far reaches AVIO and AVIO is flushed
+int flush_output_stream(output_stream_t* ostream);
+// flush and join writer thread, call before av_write_trailer
+void stop_output_stream_writer(output_stream_t* ostream);
+
 void close_output_stream(output_stream_t* ostream);
 
 }  // namespace media
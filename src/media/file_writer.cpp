@@ -0,0 +1,537 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/file_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+int64_t align_down(int64_t value, int64_t align) {
+  return value - value % align;
+}
+
+int64_t align_up(int64_t value, int64_t align) {
+  return align_down(value + align - 1, align);
+}
+
+size_t min_size(size_t a, size_t b) {
+  return a < b ? a : b;
+}
+
+int get_error(file_writer_t* writer) {
+  return __atomic_load_n(&writer->error, __ATOMIC_ACQUIRE);
+}
+
+// first error wins, the O_DIRECT thread sets it under the lock
+void set_error(file_writer_t* writer, const char* function, int err) {
+  if (!get_error(writer)) {
+    __atomic_store_n(&writer->error, err, __ATOMIC_RELEASE);
+    debug_perror(function, err);
+  }
+}
+
+int pwrite_full(int fd, const uint8_t* data, size_t size, int64_t offset) {
+  while (size) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// short read past the end of the file is zero filled
+int pread_full(int fd, uint8_t* data, size_t size, int64_t offset) {
+  while (size) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (n == 0) {
+      memset(data, 0, size);
+      break;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// ============== OUTPUT_IO_MMAP ============== //
+
+int mmap_reserve(file_writer_t* writer, int64_t end) {
+  if (end <= writer->allocated) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  int64_t allocated = align_up(end, static_cast<int64_t>(writer->chunk_size) *
+                                    FILE_WRITER_PREALLOC_CHUNKS);
+#ifdef __linux__
+  // blocks reserved up front: no allocation while writing back and less fragmentation
+  if (fallocate(writer->fd, 0, writer->allocated, allocated - writer->allocated) == 0) {
+    writer->allocated = allocated;
+    return SUCCESS_RESULT_VALUE;
+  }
+  if (errno != EOPNOTSUPP && errno != ENOSYS) {
+    set_error(writer, "fallocate", errno);
+    return ERROR_RESULT_VALUE;
+  }
+#endif
+  // sparse file, mapped pages past its end would fault
+  if (ftruncate(writer->fd, allocated) != 0) {
+    set_error(writer, "ftruncate", errno);
+    return ERROR_RESULT_VALUE;
+  }
+  writer->allocated = allocated;
+  return SUCCESS_RESULT_VALUE;
+}
+
+void mmap_retire(file_writer_t* writer) {
+  if (!writer->window) {
+    return;
+  }
+
+  if (munmap(writer->window, writer->chunk_size) != 0) {
+    set_error(writer, "munmap", errno);
+  }
+  writer->window = NULL;
+
+#ifdef __linux__
+  /* writeback of the window starts now instead of when dirty pages pile up,
+   * the window retired before is waited for and dropped from the page cache */
+  sync_file_range(writer->fd, writer->window_offset, writer->chunk_size,
+                  SYNC_FILE_RANGE_WRITE);
+  if (writer->retired_offset >= 0 && writer->retired_offset != writer->window_offset) {
+    sync_file_range(writer->fd, writer->retired_offset, writer->chunk_size,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(writer->fd, writer->retired_offset, writer->chunk_size,
+                  POSIX_FADV_DONTNEED);
+  }
+#endif
+  writer->retired_offset = writer->window_offset;
+  writer->chunks_written++;
+}
+
+int mmap_map(file_writer_t* writer, int64_t offset) {
+  if (mmap_reserve(writer, offset + writer->chunk_size) == ERROR_RESULT_VALUE) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  void* window = mmap(NULL, writer->chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      writer->fd, offset);
+  if (window == MAP_FAILED) {
+    set_error(writer, "mmap", errno);
+    return ERROR_RESULT_VALUE;
+  }
+
+  madvise(window, writer->chunk_size, MADV_SEQUENTIAL);
+  writer->window = reinterpret_cast<uint8_t*>(window);
+  writer->window_offset = offset;
+  return SUCCESS_RESULT_VALUE;
+}
+
+int mmap_write(file_writer_t* writer, const uint8_t* data, size_t size) {
+  while (size) {
+    int64_t pos = writer->pos;
+    int64_t window_end = writer->window_offset + writer->chunk_size;
+    size_t n = 0;
+    if (writer->window && pos >= writer->window_offset && pos < window_end) {
+      n = min_size(size, static_cast<size_t>(window_end - pos));
+      memcpy(writer->window + (pos - writer->window_offset), data, n);
+    } else if (!writer->window || pos > writer->window_offset) {
+      mmap_retire(writer);
+      if (mmap_map(writer, align_down(pos, writer->chunk_size)) == ERROR_RESULT_VALUE) {
+        return ERROR_RESULT_VALUE;
+      }
+      continue;
+    } else {
+      // behind the window, shares the page cache with the mapping
+      n = min_size(size, static_cast<size_t>(writer->window_offset - pos));
+      int err = pwrite_full(writer->fd, data, n, pos);
+      if (err) {
+        set_error(writer, "pwrite", err);
+        return ERROR_RESULT_VALUE;
+      }
+      writer->writes_behind++;
+    }
+
+    writer->pos += n;
+    data += n;
+    size -= n;
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+int mmap_close(file_writer_t* writer) {
+  mmap_retire(writer);
+  return SUCCESS_RESULT_VALUE;
+}
+
+// ============== OUTPUT_IO_DIRECT ============== //
+
+void* direct_thread_routine(void* arg) {
+  file_writer_t* writer = reinterpret_cast<file_writer_t*>(arg);
+
+  pthread_mutex_lock(&writer->lock);
+  while (true) {
+    while (!writer->pending && !writer->closed) {
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    if (!writer->pending) {
+      break;
+    }
+
+    uint8_t* buffer = writer->pending;
+    int64_t offset = writer->pending_offset;
+    pthread_mutex_unlock(&writer->lock);
+
+    int err = pwrite_full(writer->fd, buffer, writer->chunk_size, offset);
+
+    pthread_mutex_lock(&writer->lock);
+    if (err) {
+      set_error(writer, "pwrite", err);
+    }
+    writer->pending = NULL;
+    writer->chunks_written++;
+    pthread_cond_broadcast(&writer->cond);
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return NULL;
+}
+
+void direct_wait_pending(file_writer_t* writer) {
+  pthread_mutex_lock(&writer->lock);
+  while (writer->pending) {
+    pthread_cond_wait(&writer->cond, &writer->lock);
+  }
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// filled buffer to the thread, the caller continues in the other one
+void direct_submit(file_writer_t* writer) {
+  pthread_mutex_lock(&writer->lock);
+  if (writer->pending) {
+    writer->writer_waits++;
+    while (writer->pending) {
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+  }
+  writer->pending = writer->buffers[writer->fill_index];
+  writer->pending_offset = writer->buffer_offset;
+  pthread_cond_signal(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+
+  writer->fill_index ^= 1;
+  writer->buffer_offset += writer->chunk_size;
+  writer->buffer_end = 0;
+}
+
+// read-modify-write of the blocks touched, rare: container headers patched at the end
+int direct_write_behind(file_writer_t* writer, const uint8_t* data, size_t size, int64_t pos) {
+  direct_wait_pending(writer);
+  while (size) {
+    int64_t block_offset = align_down(pos, FILE_WRITER_ALIGN);
+    size_t start = pos - block_offset;
+    size_t n = min_size(size, FILE_WRITER_ALIGN - start);
+    if (n != FILE_WRITER_ALIGN) {
+      int err = pread_full(writer->fd, writer->block, FILE_WRITER_ALIGN, block_offset);
+      if (err) {
+        set_error(writer, "pread", err);
+        return ERROR_RESULT_VALUE;
+      }
+    }
+    memcpy(writer->block + start, data, n);
+    int err = pwrite_full(writer->fd, writer->block, FILE_WRITER_ALIGN, block_offset);
+    if (err) {
+      set_error(writer, "pwrite", err);
+      return ERROR_RESULT_VALUE;
+    }
+
+    pos += n;
+    data += n;
+    size -= n;
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+int direct_write(file_writer_t* writer, const uint8_t* data, size_t size) {
+  while (size) {
+    int64_t pos = writer->pos;
+    uint8_t* buffer = writer->buffers[writer->fill_index];
+    size_t n = 0;
+    if (pos < writer->buffer_offset) {
+      n = min_size(size, static_cast<size_t>(writer->buffer_offset - pos));
+      if (direct_write_behind(writer, data, n, pos) == ERROR_RESULT_VALUE) {
+        return ERROR_RESULT_VALUE;
+      }
+      writer->writes_behind++;
+    } else if (pos < writer->buffer_offset + static_cast<int64_t>(writer->chunk_size)) {
+      size_t start = pos - writer->buffer_offset;
+      if (start > writer->buffer_end) {
+        memset(buffer + writer->buffer_end, 0, start - writer->buffer_end);
+      }
+      n = min_size(size, writer->chunk_size - start);
+      memcpy(buffer + start, data, n);
+      if (start + n > writer->buffer_end) {
+        writer->buffer_end = start + n;
+      }
+      if (writer->buffer_end == writer->chunk_size) {
+        direct_submit(writer);
+      }
+    } else {
+      // seek past the buffer, the gap is zeros
+      memset(buffer + writer->buffer_end, 0, writer->chunk_size - writer->buffer_end);
+      writer->buffer_end = writer->chunk_size;
+      direct_submit(writer);
+      continue;
+    }
+
+    if (get_error(writer)) {
+      return ERROR_RESULT_VALUE;
+    }
+    writer->pos += n;
+    data += n;
+    size -= n;
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+// the tail goes out padded to a whole block, truncated to the logical size afterwards
+int direct_close(file_writer_t* writer) {
+  if (!writer->thread_started) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  direct_wait_pending(writer);
+  if (writer->buffer_end && !get_error(writer)) {
+    size_t tail = align_up(writer->buffer_end, FILE_WRITER_ALIGN);
+    uint8_t* buffer = writer->buffers[writer->fill_index];
+    memset(buffer + writer->buffer_end, 0, tail - writer->buffer_end);
+    int err = pwrite_full(writer->fd, buffer, tail, writer->buffer_offset);
+    if (err) {
+      set_error(writer, "pwrite", err);
+    }
+    writer->buffer_end = 0;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  writer->closed = true;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->tid, NULL);
+  writer->thread_started = false;
+  return SUCCESS_RESULT_VALUE;
+}
+
+int direct_init(file_writer_t* writer) {
+  for (int i = 0; i < 2; ++i) {
+    void* buffer = NULL;
+    int err = posix_memalign(&buffer, FILE_WRITER_ALIGN, writer->chunk_size);
+    if (err) {
+      debug_perror("posix_memalign", err);
+      return ERROR_RESULT_VALUE;
+    }
+    writer->buffers[i] = reinterpret_cast<uint8_t*>(buffer);
+  }
+
+  void* block = NULL;
+  int err = posix_memalign(&block, FILE_WRITER_ALIGN, FILE_WRITER_ALIGN);
+  if (err) {
+    debug_perror("posix_memalign", err);
+    return ERROR_RESULT_VALUE;
+  }
+  writer->block = reinterpret_cast<uint8_t*>(block);
+
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  err = pthread_create(&writer->tid, NULL, direct_thread_routine, writer);
+  if (err) {
+    debug_perror("pthread_create", err);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    return ERROR_RESULT_VALUE;
+  }
+
+  writer->thread_started = true;
+  return SUCCESS_RESULT_VALUE;
+}
+
+void direct_release(file_writer_t* writer) {
+  free(writer->buffers[0]);
+  free(writer->buffers[1]);
+  free(writer->block);
+}
+
+int open_file(const char* path, output_io_backend_t backend) {
+  int flags = O_RDWR | O_CREAT | O_TRUNC;  // mapped and read back for read-modify-write
+#ifdef O_DIRECT
+  if (backend == OUTPUT_IO_DIRECT) {
+    int fd = open(path, flags | O_DIRECT, 0644);
+    if (fd >= 0 || errno != EINVAL) {
+      return fd;
+    }
+    debug_warning("%s: O_DIRECT not supported by the filesystem, written through the page cache\n",
+                  path);
+  }
+#else
+  if (backend == OUTPUT_IO_DIRECT) {
+    debug_warning("%s: O_DIRECT not supported on this platform, written through the page cache\n",
+                  path);
+  }
+#endif
+  return open(path, flags, 0644);
+}
+
+}  // namespace
+
+file_writer_t* alloc_file_writer(const char* path, output_io_backend_t backend,
+                                 size_t chunk_size) {
+  if (!path || (backend != OUTPUT_IO_MMAP && backend != OUTPUT_IO_DIRECT)) {
+    debug_perror("alloc_file_writer", EINVAL);
+    return NULL;
+  }
+
+  file_writer_t* writer = reinterpret_cast<file_writer_t*>(calloc(1, sizeof(file_writer_t)));
+  if (!writer) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  int64_t align = page_size > FILE_WRITER_ALIGN ? page_size : FILE_WRITER_ALIGN;
+  writer->chunk_size = align_up(chunk_size ? chunk_size : FILE_WRITER_DEFAULT_CHUNK, align);
+  writer->backend = backend;
+  writer->retired_offset = -1;
+
+  writer->fd = open_file(path, backend);
+  if (writer->fd < 0) {
+    debug_perror_arg("open", path, errno);
+    free(writer);
+    return NULL;
+  }
+
+  if (backend == OUTPUT_IO_DIRECT && direct_init(writer) == ERROR_RESULT_VALUE) {
+    direct_release(writer);
+    close(writer->fd);
+    unlink(path);
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+int file_writer_write(file_writer_t* writer, const uint8_t* data, size_t size) {
+  if (!writer || (!data && size)) {
+    debug_perror("file_writer_write", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  if (get_error(writer)) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  int ret = writer->backend == OUTPUT_IO_MMAP ? mmap_write(writer, data, size) :
+                                                direct_write(writer, data, size);
+  if (writer->pos > writer->size) {
+    writer->size = writer->pos;
+  }
+  return ret;
+}
+
+int64_t file_writer_seek(file_writer_t* writer, int64_t offset, int whence) {
+  if (!writer) {
+    debug_perror("file_writer_seek", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  int64_t pos = offset;
+  if (whence == SEEK_CUR) {
+    pos += writer->pos;
+  } else if (whence == SEEK_END) {
+    pos += writer->size;
+  } else if (whence != SEEK_SET) {
+    pos = -1;
+  }
+
+  if (pos < 0) {
+    debug_perror("file_writer_seek", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  writer->pos = pos;
+  return pos;
+}
+
+int free_file_writer(file_writer_t* writer) {
+  if (!writer) {
+    debug_perror("free_file_writer", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  if (writer->backend == OUTPUT_IO_MMAP) {
+    mmap_close(writer);
+  } else {
+    direct_close(writer);
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    direct_release(writer);
+  }
+
+  // preallocated or padded tail cut off
+  if (ftruncate(writer->fd, writer->size) != 0) {
+    set_error(writer, "ftruncate", errno);
+  }
+  if (close(writer->fd) != 0) {
+    set_error(writer, "close", errno);
+  }
+
+  debug_msg("File writer %s finished, %" PRId64 " bytes, chunks %" PRIu64
+            ", writer waits %" PRIu64 ", writes behind %" PRIu64 "\n",
+            output_io_backend_name(writer->backend), writer->size, writer->chunks_written,
+            writer->writer_waits, writer->writes_behind);
+
+  int ret = writer->error ? ERROR_RESULT_VALUE : SUCCESS_RESULT_VALUE;
+  free(writer);
+  return ret;
+}
+
+const char* output_io_backend_name(output_io_backend_t backend) {
+  switch (backend) {
+    case OUTPUT_IO_AVIO:
+      return "avio";
+    case OUTPUT_IO_MMAP:
+      return "mmap";
+    case OUTPUT_IO_DIRECT:
+      return "direct";
+  }
+  return "unknown";
+}
+
+}  // namespace media
+}  // namespace fasto
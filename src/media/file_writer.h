@@ -0,0 +1,74 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "macros.h"
+
+#define FILE_WRITER_ALIGN 4096  // O_DIRECT block, smallest mmap window step
+#define FILE_WRITER_DEFAULT_CHUNK (4 * 1024 * 1024)  // mmap window, O_DIRECT buffer
+#define FILE_WRITER_PREALLOC_CHUNKS 16  // mmap: fallocate'd ahead of the window in these steps
+
+namespace fasto {
+namespace media {
+
+typedef enum output_io_backend_t {
+  OUTPUT_IO_AVIO = 0,  // libavformat file protocol through the page cache
+  OUTPUT_IO_MMAP,  // fallocate'd ahead, written through a sliding mmap window
+  OUTPUT_IO_DIRECT  // O_DIRECT aligned blocks from a double buffer, page cache bypassed
+} output_io_backend_t;
+
+/* file written mostly sequentially with rare seeks back (container headers):
+ * mmap keeps at most two windows dirty, the one left behind is written back
+ * and dropped from the page cache while the next one fills; O_DIRECT hands a
+ * full buffer to its own thread and fills the other one meanwhile, writes behind
+ * the buffer are read-modify-write of the blocks they touch */
+typedef struct file_writer_t {
+  int fd;
+  output_io_backend_t backend;
+  size_t chunk_size;  // multiple of FILE_WRITER_ALIGN and of the page size
+  int64_t pos;  // next write offset
+  int64_t size;  // logical end, the file is truncated to it on close
+  int error;  // first errno, every later write fails with it
+
+  // OUTPUT_IO_MMAP
+  uint8_t* window;  // [window_offset, window_offset + chunk_size) mapped, NULL if none
+  int64_t window_offset;
+  int64_t allocated;  // file length fallocate'd so far
+  int64_t retired_offset;  // window written back last, -1 if none
+
+  // OUTPUT_IO_DIRECT
+  uint8_t* buffers[2];
+  uint8_t* block;  // read-modify-write scratch of FILE_WRITER_ALIGN
+  int fill_index;  // buffer filled by the caller
+  int64_t buffer_offset;  // file offset of the filled buffer, chunk aligned
+  size_t buffer_end;  // bytes of the filled buffer holding data
+  uint8_t* pending;  // buffer handed to the thread, NULL once written
+  int64_t pending_offset;
+  bool closed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t tid;
+  bool thread_started;
+
+  uint64_t chunks_written;
+  uint64_t writer_waits;  // a full buffer waited for the previous one to reach the disk
+  uint64_t writes_behind;  // writes before the window or buffer, done in place
+} file_writer_t;
+
+// chunk_size 0 - FILE_WRITER_DEFAULT_CHUNK, O_DIRECT falls back to buffered writes with
+// a warning if the filesystem rejects it, OUTPUT_IO_AVIO is not a file_writer_t backend
+file_writer_t* alloc_file_writer(const char* path, output_io_backend_t backend,
+                                 size_t chunk_size);
+int file_writer_write(file_writer_t* writer, const uint8_t* data, size_t size);
+// SEEK_SET, SEEK_CUR or SEEK_END, new position or ERROR_RESULT_VALUE
+int64_t file_writer_seek(file_writer_t* writer, int64_t offset, int whence);
+// writes what is buffered, truncates to the logical size, ERROR_RESULT_VALUE if any write failed
+int free_file_writer(file_writer_t* writer);
+const char* output_io_backend_name(output_io_backend_t backend);
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,150 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/frame_dropper.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+// what the caller's own processing time allows, 1 if it keeps up
+double realtime_ratio(const frame_dropper_t* dropper) {
+  if (!dropper->process_ns || dropper->process_ns <= dropper->frame_interval_ns) {
+    return 1.0;
+  }
+
+  return static_cast<double>(dropper->frame_interval_ns) / dropper->process_ns;
+}
+
+bool next_in_cadence(frame_dropper_t* dropper) {
+  double ratio = frame_dropper_keep_ratio(dropper);
+  dropper->credit += ratio;
+  bool keep = dropper->credit >= 1.0;
+  if (keep) {
+    dropper->credit -= 1.0;
+  }
+
+  bool dropping = ratio < 1.0;
+  if (dropping != dropper->dropping) {
+    dropper->dropping = dropping;
+    if (dropping) {
+      debug_warning("encoding falls behind, keeping %.0f%% of frames\n", ratio * 100);
+    } else {
+      debug_msg("encoding caught up, %" PRIu64 " frames dropped so far\n",
+                dropper->frames_dropped);
+    }
+  }
+  return keep;
+}
+
+}  // namespace
+
+frame_dropper_t* alloc_frame_dropper(size_t max_backlog, uint32_t fps) {
+  if (!max_backlog || !fps) {
+    debug_perror("alloc_frame_dropper", EINVAL);
+    return NULL;
+  }
+
+  frame_dropper_t* dropper = reinterpret_cast<frame_dropper_t*>(
+                               calloc(1, sizeof(frame_dropper_t)));
+  if (!dropper) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  dropper->max_backlog = max_backlog;
+  dropper->frame_interval_ns = UINT64_C(1000000000) / fps;
+  dropper->keep_ratio = 1.0;
+  return dropper;
+}
+
+bool frame_dropper_admit(frame_dropper_t* dropper, size_t backlog) {
+  if (!dropper) {
+    return true;
+  }
+
+  if (backlog > dropper->max_backlog) {
+    dropper->keep_ratio *= FRAME_DROPPER_DECREASE;
+    if (dropper->keep_ratio < FRAME_DROPPER_MIN_KEEP) {
+      dropper->keep_ratio = FRAME_DROPPER_MIN_KEEP;
+    }
+  } else if (backlog <= dropper->max_backlog / 2 && dropper->keep_ratio < 1.0) {
+    dropper->keep_ratio += FRAME_DROPPER_INCREASE;
+    if (dropper->keep_ratio > 1.0) {
+      dropper->keep_ratio = 1.0;
+    }
+  }
+
+  dropper->frames_in++;
+  if (next_in_cadence(dropper)) {
+    return true;
+  }
+
+  dropper->frames_dropped++;
+  return false;
+}
+
+bool frame_dropper_admit_encoded(frame_dropper_t* dropper, bool key_frame) {
+  if (!dropper) {
+    return true;
+  }
+
+  dropper->frames_in++;
+  if (key_frame) {
+    dropper->skip_to_key = false;
+    next_in_cadence(dropper);  // key frames pass whatever the cadence says
+    return true;
+  }
+
+  if (dropper->skip_to_key || !next_in_cadence(dropper)) {
+    dropper->skip_to_key = true;
+    dropper->frames_dropped++;
+    return false;
+  }
+  return true;
+}
+
+void frame_dropper_processed(frame_dropper_t* dropper, uint64_t elapsed_ns) {
+  if (!dropper) {
+    return;
+  }
+
+  if (!dropper->process_ns) {
+    dropper->process_ns = elapsed_ns;
+    return;
+  }
+
+  int64_t delta = static_cast<int64_t>(elapsed_ns) - static_cast<int64_t>(dropper->process_ns);
+  dropper->process_ns += delta / (1 << FRAME_DROPPER_EWMA_SHIFT);
+}
+
+double frame_dropper_keep_ratio(const frame_dropper_t* dropper) {
+  if (!dropper) {
+    return 1.0;
+  }
+
+  double ratio = realtime_ratio(dropper);
+  if (dropper->keep_ratio < ratio) {
+    ratio = dropper->keep_ratio;
+  }
+  return ratio < FRAME_DROPPER_MIN_KEEP ? FRAME_DROPPER_MIN_KEEP : ratio;
+}
+
+void free_frame_dropper(frame_dropper_t* dropper) {
+  if (!dropper) {
+    return;
+  }
+
+  debug_msg("Frame dropper: %" PRIu64 " frames in, %" PRIu64 " dropped\n",
+            dropper->frames_in, dropper->frames_dropped);
+  free(dropper);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,42 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include "macros.h"
+
+#define FRAME_DROPPER_MIN_KEEP 0.25  // at least every fourth frame is encoded
+#define FRAME_DROPPER_DECREASE 0.9  // keep ratio factor per frame over the backlog limit
+#define FRAME_DROPPER_INCREASE 0.02  // keep ratio step back per frame under half the limit
+#define FRAME_DROPPER_EWMA_SHIFT 3  // processing time averaged over about 8 frames
+
+namespace fasto {
+namespace media {
+
+/* decides which captured frames get encoded when encoding falls behind: the share of
+ * frames kept follows the backlog in front of the encoder (AIMD) and the synchronous
+ * processing time against the frame interval, kept frames are spread evenly */
+typedef struct frame_dropper_t {
+  size_t max_backlog;  // frames waiting for the encoder before dropping starts
+  uint64_t frame_interval_ns;
+
+  double keep_ratio;  // backlog driven
+  double credit;  // kept when it reaches a whole frame
+  uint64_t process_ns;  // moving average of admitted frames, 0 - none yet
+  bool skip_to_key;  // encoded input: frames depending on a dropped one go as well
+  bool dropping;
+
+  uint64_t frames_in;
+  uint64_t frames_dropped;
+} frame_dropper_t;
+
+frame_dropper_t* alloc_frame_dropper(size_t max_backlog, uint32_t fps);
+// raw frame, backlog - admitted frames the encoder has not taken yet
+bool frame_dropper_admit(frame_dropper_t* dropper, size_t backlog);
+// already encoded frame muxed as is: key frames always pass, a drop lasts to the next one
+bool frame_dropper_admit_encoded(frame_dropper_t* dropper, bool key_frame);
+void frame_dropper_processed(frame_dropper_t* dropper, uint64_t elapsed_ns);  // caller time
+double frame_dropper_keep_ratio(const frame_dropper_t* dropper);
+void free_frame_dropper(frame_dropper_t* dropper);
+
+}  // namespace media
+}  // namespace fasto
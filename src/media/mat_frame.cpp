@@ -0,0 +1,100 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/mat_frame.h"
+
+#include <new>
+
+#include "log.h"
+
+#include "media/video_converter.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void release_mat(void* opaque, uint8_t*) {
+  delete reinterpret_cast<cv::Mat*>(opaque);
+}
+
+}  // namespace
+
+int mat_frame_ref(AVFrame* frame, const cv::Mat* mat) {
+  if (!frame || !mat || mat->empty() || mat->dims != 2) {
+    debug_perror("mat_frame_ref", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  enum AVPixelFormat pix_fmt = cv_type_to_pix_fmt(mat->type());
+  if (pix_fmt == AV_PIX_FMT_NONE) {
+    debug_error("Mat type %d has no pixel format\n", mat->type());
+    return ERROR_RESULT_VALUE;
+  }
+
+  frame->buf[0] = mat_buffer_ref(mat);
+  if (!frame->buf[0]) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  // a clone may have a tighter step than mat
+  const cv::Mat* holder = reinterpret_cast<const cv::Mat*>(av_buffer_get_opaque(frame->buf[0]));
+  frame->data[0] = holder->data;
+  frame->linesize[0] = holder->step[0];
+  frame->format = pix_fmt;
+  frame->width = holder->cols;
+  frame->height = holder->rows;
+  return SUCCESS_RESULT_VALUE;
+}
+
+AVBufferRef* mat_buffer_ref(const cv::Mat* mat) {
+  if (!mat || mat->empty() || mat->dims != 2) {
+    debug_perror("mat_buffer_ref", EINVAL);
+    return NULL;
+  }
+
+  // header copy shares the pixels and keeps them alive
+  cv::Mat* holder = mat->u ? new (std::nothrow) cv::Mat(*mat) :
+                             new (std::nothrow) cv::Mat(mat->clone());
+  if (!holder) {
+    debug_perror("new", ENOMEM);
+    return NULL;
+  }
+
+  size_t size = holder->step[0] * (holder->rows - 1) + holder->cols * holder->elemSize();
+  AVBufferRef* buf = av_buffer_create(holder->data, size, release_mat, holder,
+                                      AV_BUFFER_FLAG_READONLY);
+  if (!buf) {
+    debug_perror("av_buffer_create", ENOMEM);
+    delete holder;
+    return NULL;
+  }
+
+  return buf;
+}
+
+AVFrame* alloc_mat_frame(const cv::Mat* mat) {
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    debug_perror("av_frame_alloc", ENOMEM);
+    return NULL;
+  }
+
+  if (mat_frame_ref(frame, mat) == ERROR_RESULT_VALUE) {
+    av_frame_free(&frame);
+    return NULL;
+  }
+
+  return frame;
+}
+
+bool mat_frame_in_use(const cv::Mat* mat) {
+  if (!mat) {
+    debug_perror("mat_frame_in_use", EINVAL);
+    return false;
+  }
+
+  return mat->u && __atomic_load_n(&mat->u->refcount, __ATOMIC_ACQUIRE) > 1;
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,28 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+#include "macros.h"
+
+namespace fasto {
+namespace media {
+
+/* frame referencing the pixels of mat, no copy: the buffer holds a reference on
+ * the Mat data until the last av_frame_unref, linesize is mat.step; a Mat over
+ * caller memory (not refcounted) is cloned instead */
+int mat_frame_ref(AVFrame* frame, const cv::Mat* mat);  // frame must be unreferenced
+// read-only buffer over the bytes of mat, same referencing as mat_frame_ref, any Mat type
+AVBufferRef* mat_buffer_ref(const cv::Mat* mat);
+AVFrame* alloc_mat_frame(const cv::Mat* mat);  // av_frame_free
+/* true while some frame still references the pixels of mat: writing into it
+ * (VideoCapture::read into the same Mat) is then not safe, release() always is */
+bool mat_frame_in_use(const cv::Mat* mat);
+
+}  // namespace media
+}  // namespace fasto
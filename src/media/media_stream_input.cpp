@@ -0,0 +1,418 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/media_stream_input.h"
+
+#include <new>
+
+#include "log.h"
+
+#include "media/codec_holder.h"
+#include "media/mat_frame.h"
+
+#include "utils/spsc_queue.h"
+
+#define MEDIA_INPUT_SWS_FLAGS SWS_BILINEAR  // sizes are kept, only the format changes
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+int interrupt_callback(void* opaque) {
+  media_stream_input_t* input = reinterpret_cast<media_stream_input_t*>(opaque);
+  return __atomic_load_n(&input->aborted, __ATOMIC_ACQUIRE);
+}
+
+bool is_aborted(media_stream_input_t* input) {
+  return __atomic_load_n(&input->aborted, __ATOMIC_ACQUIRE);
+}
+
+int convert_picture(media_stream_input_t* input, const AVFrame* picture,
+                    media_input_frame_t* fslot) {
+  int width = picture->width;
+  int height = picture->height;
+  uint8_t* dst_data[4] = { NULL, NULL, NULL, NULL };
+  int dst_linesize[4] = { 0, 0, 0, 0 };
+  enum AVPixelFormat dst_fmt = AV_PIX_FMT_BGR24;
+  if (mat_frame_in_use(&fslot->mat)) {
+    fslot->mat.release();  // pixels still referenced by an encoder pipeline, not reused
+  }
+
+  if (input->params.format == MEDIA_INPUT_YUV420P) {
+    if ((width | height) & 1) {
+      debug_error("Picture %dx%d can't be stored as I420 Mat\n", width, height);
+      return ERROR_RESULT_VALUE;
+    }
+
+    fslot->mat.create(height * 3 / 2, width, CV_8UC1);
+    dst_data[0] = fslot->mat.data;
+    dst_data[1] = dst_data[0] + width * height;
+    dst_data[2] = dst_data[1] + width * height / 4;
+    dst_linesize[0] = width;
+    dst_linesize[1] = width / 2;
+    dst_linesize[2] = width / 2;
+    dst_fmt = AV_PIX_FMT_YUV420P;
+  } else {
+    fslot->mat.create(height, width, CV_8UC3);
+    dst_data[0] = fslot->mat.data;
+    dst_linesize[0] = fslot->mat.step[0];
+  }
+
+  input->sws_ctx = sws_getCachedContext(input->sws_ctx, width, height,
+                                        static_cast<enum AVPixelFormat>(picture->format),
+                                        width, height, dst_fmt, MEDIA_INPUT_SWS_FLAGS,
+                                        NULL, NULL, NULL);
+  if (!input->sws_ctx) {
+    debug_error("Could not create SwsContext %dx%d(%d)\n", width, height, picture->format);
+    return ERROR_RESULT_VALUE;
+  }
+
+  sws_scale(input->sws_ctx, picture->data, picture->linesize, 0, height, dst_data,
+            dst_linesize);
+  return SUCCESS_RESULT_VALUE;
+}
+
+// ERROR_RESULT_VALUE if the reader is gone
+int deliver_picture(media_stream_input_t* input) {
+  void* item = NULL;
+  if (utils::spsc_queue_pop_wait(input->frame_free, &item) == ERROR_RESULT_VALUE) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  media_input_frame_t* fslot = reinterpret_cast<media_input_frame_t*>(item);
+  const AVFrame* picture = input->picture;
+  if (convert_picture(input, picture, fslot) == ERROR_RESULT_VALUE) {
+    // still handed to the reader, only it may return slots to frame_free
+    fslot->mat.release();
+    input->decode_errors++;
+  }
+
+  AVStream* st = input->format_context->streams[input->video_index];
+  int64_t ts = av_frame_get_best_effort_timestamp(picture);
+  AVRational msec = { 1, 1000 };
+  fslot->pts_msec = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, st->time_base, msec) :
+                                           AV_NOPTS_VALUE;
+  fslot->frame_id = input->frames_decoded++;
+  utils::spsc_queue_push(input->ready_queue, fslot);
+  return SUCCESS_RESULT_VALUE;
+}
+
+void* demux_thread_routine(void* arg) {
+  media_stream_input_t* input = reinterpret_cast<media_stream_input_t*>(arg);
+
+  media_input_packet_slot_t* pslot = NULL;  // kept while packets of other streams are read
+  while (!is_aborted(input)) {
+    if (!pslot) {
+      void* item = NULL;
+      if (utils::spsc_queue_pop_wait(input->packet_free, &item) == ERROR_RESULT_VALUE) {
+        break;
+      }
+      pslot = reinterpret_cast<media_input_packet_slot_t*>(item);
+    }
+
+    int ret = av_read_frame(input->format_context, &pslot->pkt);
+    if (ret < 0) {
+      if (ret != AVERROR_EOF && !is_aborted(input)) {
+        debug_av_perror("av_read_frame", ret);
+      }
+      break;
+    }
+
+    if (pslot->pkt.stream_index != input->video_index) {
+      av_free_packet(&pslot->pkt);
+      continue;
+    }
+
+    input->packets_read++;
+    utils::spsc_queue_push(input->decode_queue, pslot);
+    pslot = NULL;
+  }
+
+  utils::spsc_queue_close(input->decode_queue);
+  return NULL;
+}
+
+// every picture the decoder has ready, ERROR_RESULT_VALUE if the reader is gone
+int deliver_pictures(media_stream_input_t* input) {
+  int ret = 0;
+  while ((ret = decoder_receive_frame(input->decoder, input->picture)) == 0) {
+    if (deliver_picture(input) == ERROR_RESULT_VALUE) {
+      return ERROR_RESULT_VALUE;
+    }
+  }
+
+  if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+    input->decode_errors++;  // broken packet, decoder resyncs on the next ones
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+void* decode_thread_routine(void* arg) {
+  media_stream_input_t* input = reinterpret_cast<media_stream_input_t*>(arg);
+
+  bool reader_gone = false;
+  void* item = NULL;
+  while (utils::spsc_queue_pop_wait(input->decode_queue, &item) == SUCCESS_RESULT_VALUE) {
+    media_input_packet_slot_t* pslot = reinterpret_cast<media_input_packet_slot_t*>(item);
+
+    int res = decoder_send_packet(input->decoder, &pslot->pkt);
+    av_free_packet(&pslot->pkt);
+    utils::spsc_queue_push(input->packet_free, pslot);
+    if (res < 0) {
+      input->decode_errors++;
+      continue;
+    }
+
+    if (deliver_pictures(input) == ERROR_RESULT_VALUE) {
+      reader_gone = true;
+      break;
+    }
+  }
+
+  if (!reader_gone && !is_aborted(input)) {
+    // pictures still held by the frame threads
+    decoder_send_packet(input->decoder, NULL);
+    deliver_pictures(input);
+  }
+
+  utils::spsc_queue_close(input->ready_queue);
+  return NULL;
+}
+
+void free_media_stream_input_slots(media_stream_input_t* input) {
+  if (input->packet_slots) {
+    for (size_t i = 0; i < input->depth; ++i) {
+      av_free_packet(&input->packet_slots[i].pkt);
+    }
+    free(input->packet_slots);
+    input->packet_slots = NULL;
+  }
+
+  if (input->frame_slots) {
+    for (size_t i = 0; i < input->depth; ++i) {
+      input->frame_slots[i].~media_input_frame_t();
+    }
+    free(input->frame_slots);
+    input->frame_slots = NULL;
+  }
+
+  utils::spsc_queue_t** queues[] = { &input->packet_free, &input->decode_queue,
+                                     &input->frame_free, &input->ready_queue };
+  for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); ++i) {
+    if (*queues[i]) {
+      utils::free_spsc_queue(*queues[i]);
+      *queues[i] = NULL;
+    }
+  }
+}
+
+int alloc_media_stream_input_slots(media_stream_input_t* input) {
+  size_t depth = input->depth;
+  input->packet_free = utils::alloc_spsc_queue(depth);
+  input->decode_queue = utils::alloc_spsc_queue(depth);
+  input->frame_free = utils::alloc_spsc_queue(depth);
+  input->ready_queue = utils::alloc_spsc_queue(depth);
+  if (!input->packet_free || !input->decode_queue || !input->frame_free ||
+      !input->ready_queue) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  input->packet_slots = reinterpret_cast<media_input_packet_slot_t*>(
+                          calloc(depth, sizeof(media_input_packet_slot_t)));
+  if (!input->packet_slots) {
+    debug_perror("calloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    av_init_packet(&input->packet_slots[i].pkt);
+    utils::spsc_queue_push(input->packet_free, &input->packet_slots[i]);
+  }
+
+  input->frame_slots = reinterpret_cast<media_input_frame_t*>(
+                         calloc(depth, sizeof(media_input_frame_t)));
+  if (!input->frame_slots) {
+    debug_perror("calloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    new (&input->frame_slots[i]) media_input_frame_t();
+    utils::spsc_queue_push(input->frame_free, &input->frame_slots[i]);
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+int open_media_stream_input(media_stream_input_t* input, const char* path) {
+  input->format_context = avformat_alloc_context();
+  if (!input->format_context) {
+    debug_perror("avformat_alloc_context", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // lets free_media_stream_input stop a blocking network read
+  input->format_context->interrupt_callback.callback = interrupt_callback;
+  input->format_context->interrupt_callback.opaque = input;
+
+  int ret = avformat_open_input(&input->format_context, path, NULL, NULL);
+  if (ret < 0) {
+    debug_av_perror("avformat_open_input", ret);
+    return ERROR_RESULT_VALUE;  // context freed by avformat_open_input
+  }
+
+  ret = avformat_find_stream_info(input->format_context, NULL);
+  if (ret < 0) {
+    debug_av_perror("avformat_find_stream_info", ret);
+    return ERROR_RESULT_VALUE;
+  }
+
+  ret = av_find_best_stream(input->format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (ret < 0) {
+    debug_av_perror("av_find_best_stream", ret);
+    return ERROR_RESULT_VALUE;
+  }
+  input->video_index = ret;
+
+  codec_threading_t threading;
+  threading.thread_count = input->params.decoder_thread_count;
+  threading.thread_type = input->params.decoder_thread_type ?
+                          input->params.decoder_thread_type : FF_THREAD_FRAME;
+  threading.cpu_mask = input->params.decoder_cpu_mask;
+
+  AVStream* st = input->format_context->streams[input->video_index];
+  input->decoder = alloc_decoder_by_ctx(st->codec, &threading);
+  if (!input->decoder) {
+    debug_error("Could not open decoder for %s\n", path);
+    return ERROR_RESULT_VALUE;
+  }
+
+  input->width = input->decoder->context->width;
+  input->height = input->decoder->context->height;
+  input->frame_rate = st->avg_frame_rate;
+  input->duration_msec = input->format_context->duration != AV_NOPTS_VALUE ?
+                         av_rescale(input->format_context->duration, 1000, AV_TIME_BASE) :
+                         AV_NOPTS_VALUE;
+
+  input->picture = av_frame_alloc();
+  if (!input->picture) {
+    debug_perror("av_frame_alloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+
+  debug_msg("Input %s: %dx%d, decoder threads %d\n", path, input->width, input->height,
+            input->decoder->threading.thread_count);
+  return SUCCESS_RESULT_VALUE;
+}
+
+}  // namespace
+
+media_stream_input_t* alloc_media_stream_input(const char* path,
+                                               const media_stream_input_params_t* params) {
+  if (!path) {
+    debug_perror("alloc_media_stream_input", EINVAL);
+    return NULL;
+  }
+
+  media_stream_input_t* input = reinterpret_cast<media_stream_input_t*>(
+                                  calloc(1, sizeof(media_stream_input_t)));
+  if (!input) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  if (params) {
+    input->params = *params;
+  }
+  input->depth = input->params.prefetch_depth ? input->params.prefetch_depth :
+                                                MEDIA_INPUT_DEFAULT_PREFETCH;
+
+  if (open_media_stream_input(input, path) == ERROR_RESULT_VALUE ||
+      alloc_media_stream_input_slots(input) == ERROR_RESULT_VALUE) {
+    free_media_stream_input(input);
+    return NULL;
+  }
+
+  int err = pthread_create(&input->decode_tid, NULL, decode_thread_routine, input);
+  if (err) {
+    debug_perror("pthread_create", err);
+    free_media_stream_input(input);
+    return NULL;
+  }
+
+  err = pthread_create(&input->demux_tid, NULL, demux_thread_routine, input);
+  if (err) {
+    debug_perror("pthread_create", err);
+    utils::spsc_queue_close(input->decode_queue);
+    pthread_join(input->decode_tid, NULL);
+    free_media_stream_input(input);
+    return NULL;
+  }
+
+  input->threads_started = true;
+  return input;
+}
+
+media_input_frame_t* media_stream_input_read(media_stream_input_t* input) {
+  if (!input) {
+    debug_perror("media_stream_input_read", EINVAL);
+    return NULL;
+  }
+
+  void* item = NULL;
+  if (utils::spsc_queue_pop_wait(input->ready_queue, &item) == ERROR_RESULT_VALUE) {
+    return NULL;
+  }
+
+  return reinterpret_cast<media_input_frame_t*>(item);
+}
+
+void media_stream_input_release(media_stream_input_t* input, media_input_frame_t* frame) {
+  if (!input || !frame) {
+    debug_perror("media_stream_input_release", EINVAL);
+    return;
+  }
+
+  utils::spsc_queue_push(input->frame_free, frame);
+}
+
+void free_media_stream_input(media_stream_input_t* input) {
+  if (!input) {
+    debug_perror("free_media_stream_input", EINVAL);
+    return;
+  }
+
+  if (input->threads_started) {
+    // wakes both threads wherever they wait, demux closes the queue behind it
+    __atomic_store_n(&input->aborted, 1, __ATOMIC_RELEASE);
+    utils::spsc_queue_close(input->packet_free);
+    utils::spsc_queue_close(input->frame_free);
+    pthread_join(input->demux_tid, NULL);
+    pthread_join(input->decode_tid, NULL);
+    input->threads_started = false;
+    debug_msg("Input finished, packets %" PRIu64 ", frames %" PRIu64 ", errors %" PRIu64 "\n",
+              input->packets_read, input->frames_decoded, input->decode_errors);
+  }
+
+  free_media_stream_input_slots(input);
+
+  if (input->sws_ctx) {
+    sws_freeContext(input->sws_ctx);
+    input->sws_ctx = NULL;
+  }
+
+  if (input->picture) {
+    av_frame_free(&input->picture);
+  }
+
+  if (input->decoder) {
+    free_decoder(input->decoder);
+    input->decoder = NULL;
+  }
+
+  if (input->format_context) {
+    avformat_close_input(&input->format_context);
+  }
+  free(input);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,94 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include <opencv2/opencv.hpp>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "macros.h"
+
+#define MEDIA_INPUT_DEFAULT_PREFETCH 8
+
+namespace fasto {
+namespace utils {
+struct spsc_queue_t;
+}  // namespace utils
+
+namespace media {
+
+struct decoder_t;
+
+typedef enum media_input_format_t {
+  MEDIA_INPUT_BGR = 0,  // CV_8UC3
+  MEDIA_INPUT_YUV420P  // I420 in one CV_8UC1 Mat of height * 3 / 2 rows, even sizes only
+} media_input_format_t;
+
+typedef struct media_stream_input_params_t {
+  uint32_t prefetch_depth;  // packets demuxed and frames decoded ahead of the reader, 0 - default
+  uint32_t decoder_thread_count;  // 0 - auto
+  uint32_t decoder_thread_type;  // FF_THREAD_FRAME | FF_THREAD_SLICE, 0 - FF_THREAD_FRAME
+  uint64_t decoder_cpu_mask;  // bit per cpu decoder threads pinned to, 0 - not pinned
+  media_input_format_t format;
+} media_stream_input_params_t;
+
+typedef struct media_input_frame_t {
+  cv::Mat mat;  // reused for the next frames, clone to keep it, empty if not converted
+  int64_t pts_msec;  // AV_NOPTS_VALUE if the container has no timestamps
+  uint64_t frame_id;
+} media_input_frame_t;
+
+typedef struct media_input_packet_slot_t {
+  AVPacket pkt;
+} media_input_packet_slot_t;
+
+// demux -> decode + convert -> reader, demux and decode on their own threads,
+// linked by spsc queues, packet and frame slots travel back through *_free queues
+typedef struct media_stream_input_t {
+  AVFormatContext* format_context;
+  int video_index;
+  struct decoder_t* decoder;
+  struct SwsContext* sws_ctx;  // decode thread only
+  AVFrame* picture;  // decode thread only
+
+  int width;
+  int height;
+  AVRational frame_rate;  // 0/1 if unknown
+  int64_t duration_msec;  // AV_NOPTS_VALUE if unknown
+  media_stream_input_params_t params;
+
+  size_t depth;
+  media_input_packet_slot_t* packet_slots;
+  media_input_frame_t* frame_slots;
+
+  struct utils::spsc_queue_t* packet_free;  // decode -> demux
+  struct utils::spsc_queue_t* decode_queue;  // demux -> decode
+  struct utils::spsc_queue_t* frame_free;  // reader -> decode
+  struct utils::spsc_queue_t* ready_queue;  // decode -> reader
+
+  pthread_t demux_tid;
+  pthread_t decode_tid;
+  bool threads_started;
+  int aborted;  // reader gave up before the end, also interrupts blocking reads
+
+  uint64_t packets_read;
+  uint64_t frames_decoded;
+  uint64_t decode_errors;
+} media_stream_input_t;
+
+// video stream of a file or network url, params may be NULL (BGR, default prefetch)
+media_stream_input_t* alloc_media_stream_input(const char* path,
+                                               const media_stream_input_params_t* params);
+// blocks until the next frame is decoded, NULL at the end of the stream
+media_input_frame_t* media_stream_input_read(media_stream_input_t* input);
+void media_stream_input_release(media_stream_input_t* input, media_input_frame_t* frame);
+void free_media_stream_input(media_stream_input_t* input);  // stops at once, queued frames lost
+
+}  // namespace media
+}  // namespace fasto
@@ -4,12 +4,18 @@
 
 #include "log.h"
 
+#include "media/audio_accumulator.h"
 #include "media/codec_holder.h"
+#include "media/frame_dropper.h"
+#include "media/mat_frame.h"
 #include "media/nal_units.h"
-
-#ifdef WITH_OPUS
+#include "media/output_fanout.h"
+#include "media/packet_pool.h"
 #include "media/resampler.h"
-#endif
+#include "media/segment_rotator.h"
+#include "media/stream_stats.h"
+#include "media/video_converter.h"
+#include "media/video_pipeline.h"
 
 #include "utils/time_utils.h"
 #include "utils/utils.h"
@@ -17,6 +23,8 @@
 #define WITH_CODEC 0
 
 #define PCM_SAMPLES_COUNT 1024
+#define OPUS_DEFAULT_FRAME_MSEC 20
+#define LOW_LATENCY_REFRESH_SEC 1  // intra refresh wave sweeps the picture once a second
 
 #define SAVE_LOCAL_TIME 0
 #define SAVE_REMOTE_TIME 1
@@ -36,21 +44,91 @@ void write_empty_audio_samples(media_stream_t *stream, int count) {
   debug_warning("try to write empty audio packets count %d\n", count);
   int i = 0;
   for (i = 0; i < count; ++i) {
+    static uint8_t zero[PCM_SAMPLES_COUNT * 4] = {0};
+    if (send_ostream_audio_buffer(stream->ostream, zero, PCM_SAMPLES_COUNT * 4) < 0) {
+      continue;
+    }
+
     AVPacket avpkt2 = {0};
     av_init_packet(&avpkt2);
-    int got_packet = 0;
-    static uint8_t zero[PCM_SAMPLES_COUNT * 4] = {0};
-    if (encode_ostream_audio_buffer(stream->ostream, zero, PCM_SAMPLES_COUNT * 4,
-                                     &avpkt2, &got_packet) >= 0) {
-      if (got_packet) {
-        update_audio_packet_pts(stream->ostream, stream->sample_id, &avpkt2);
-        stream->sample_id++;
-        write_audio_frame(stream->ostream, &avpkt2);
-      }
+    while (receive_ostream_audio_packet(stream->ostream, &avpkt2) == 0) {
+      update_audio_packet_pts(stream->ostream, stream->sample_id, &avpkt2);
+      stream->sample_id++;
+      write_audio_frame(stream->ostream, &avpkt2);
+      av_free_packet(&avpkt2);
+    }
+  }
+}
+
+// everything the encoders have ready, muxer lock held by the caller when the pipeline runs
+void write_ready_audio_packets(media_stream_t *stream) {
+  AVPacket avpkt2 = {0};
+  av_init_packet(&avpkt2);
+  while (receive_ostream_audio_packet(stream->ostream, &avpkt2) == 0) {
+    write_audio_frame(stream->ostream, &avpkt2);
+    av_free_packet(&avpkt2);
+    stream->sample_id++;
+  }
+}
+
+void write_ready_video_packets(media_stream_t *stream) {
+  AVPacket avpkt2 = {0};
+  av_init_packet(&avpkt2);
+  while (receive_ostream_video_packet(stream->ostream, &avpkt2) == 0) {
+    write_video_frame(stream->ostream, &avpkt2);
+    av_free_packet(&avpkt2);
+  }
+}
+
+// bit_per_sample of the capture, main passes bytes
+enum AVSampleFormat capture_sample_fmt(uint32_t bit_per_sample) {
+  switch (bit_per_sample) {
+    case 1:
+    case 8:
+      return AV_SAMPLE_FMT_U8;
+    case 2:
+    case 16:
+      return AV_SAMPLE_FMT_S16;
+    case 4:
+    case 32:
+      return AV_SAMPLE_FMT_S32;
+    default:
+      return AV_SAMPLE_FMT_NONE;
+  }
+}
+
+// frames for the encoder, the resampler keeps its own when capture format differs
+audio_accumulator_t* stream_audio_accumulator(media_stream_t *stream) {
+  return stream->audio_resampler ? stream->audio_resampler->accumulator :
+                                   stream->audio_accumulator;
+}
+
+// caller holds the muxer lock when the video pipeline runs
+int encode_audio_accumulated(media_stream_t *stream, bool flush) {
+  audio_accumulator_t* accumulator = stream_audio_accumulator(stream);
+  if (flush && stream->audio_resampler) {
+    resampler_send_samples(stream->audio_resampler, NULL, 0);
+  }
+
+  AVFrame* frame = NULL;
+  while ((frame = audio_accumulator_next_frame(accumulator, flush))) {
+    if (send_ostream_audio_frame(stream->ostream, frame) < 0) {
+      return ERROR_RESULT_VALUE;
     }
+    write_ready_audio_packets(stream);
   }
+
+  if (flush) {
+    send_ostream_audio_frame(stream->ostream, NULL);
+    write_ready_audio_packets(stream);
+  }
+
+  return SUCCESS_RESULT_VALUE;
 }
 
+/* own framing (header_enc_frame_t) path: no caller sets stream->nalu, so it is not
+ * reached by any recording; rewrites the slice length in the header data to a start code
+ * and copies IDR slices once behind the cached SPS/PPS prefix into a pooled buffer */
 void write_video_frame_inner(media_stream_t * stream, header_enc_frame_t * header) {
   if (!header) {
     return;
@@ -72,22 +150,41 @@ void write_video_frame_inner(media_stream_t * stream, header_enc_frame_t * heade
   }
 
   uint64_t cur_msr = av_rescale(header->t1.value, 1000, header->t1.timescale);
-  uint8_t* key_frame = create_sps_pps_key_frame(stream->nalu, fdata->data, fdata->len, &len);
   int is_key_f = is_key_frame(fdata->data, fdata->len);
 
-  // DCHECK(key_frame);
-  if (key_frame) {
+  /* SPS/PPS go only in front of IDR slices, assembled in a pooled buffer
+   * behind the cached prefix; other slices are muxed in place */
+  uint8_t* frame = NULL;
+  AVBufferRef* frame_buf = NULL;
+  if (is_key_f) {
+    frame_buf = packet_pool_get_buffer(stream->ostream->video_packets,
+                                       sps_pps_key_frame_size(stream->nalu, fdata->len));
+    if (frame_buf && write_sps_pps_key_frame(stream->nalu, fdata->data, fdata->len,
+                                             frame_buf->data, frame_buf->size, &len) ==
+        SUCCESS_RESULT_VALUE) {
+      frame = frame_buf->data;
+      stream->video_frame_sps_pps_id++;
+    } else {
+      av_buffer_unref(&frame_buf);
+    }
+  } else {
+    frame = annexb_slice_in_place(fdata->data, fdata->len, &len);
+  }
+
+  // DCHECK(frame);
+  if (frame) {
     AVPacket pkt = {0};
     uint32_t cur_msl = mst - stream->ts_fpackv_in_stream_msec;
 #if SAVE_FRAME_POLICY == SAVE_FRAME_ID
-    init_video_packet(stream->ostream, key_frame, len, stream->frame_id, &pkt);
+    init_video_packet(stream->ostream, frame, len, stream->frame_id, &pkt);
 #elif SAVE_FRAME_POLICY == SAVE_REMOTE_TIME
-    init_video_packet_ms(stream->ostream, key_frame, len, cur_msr, &pkt);
+    init_video_packet_ms(stream->ostream, frame, len, cur_msr, &pkt);
 #elif SAVE_FRAME_POLICY == SAVE_LOCAL_TIME
-    init_video_packet_ms(stream->ostream, key_frame, len, cur_msl, &pkt);
+    init_video_packet_ms(stream->ostream, frame, len, cur_msl, &pkt);
 #else
 #error please specify policy to save
 #endif
+    pkt.buf = frame_buf;  // returned to the pool by av_free_packet
     stream->cur_ts_video_remote_msec = cur_msr;
     stream->cur_ts_video_local_msec = cur_msl;
     stream->video_frame_id++;
@@ -97,7 +194,6 @@ void write_video_frame_inner(media_stream_t * stream, header_enc_frame_t * heade
     write_video_frame(stream->ostream, &pkt);
 
     av_free_packet(&pkt);
-    free(key_frame);
   }
 }
 
@@ -115,6 +211,14 @@ media_stream_t* alloc_video_stream(const char * path_to_save, media_stream_param
 
   stream->ostream = NULL;
   stream->nalu = NULL;
+  stream->vconverter = NULL;
+  stream->vpipeline = NULL;
+  stream->fanout = NULL;
+  stream->rotator = NULL;
+  stream->audio_accumulator = NULL;
+  stream->audio_resampler = NULL;
+  stream->stats = NULL;
+  stream->dropper = NULL;
   stream->audio_pcm_id = 0;
   stream->video_frame_id = 0;
   stream->video_frame_sps_pps_id = 0;
@@ -123,7 +227,6 @@ media_stream_t* alloc_video_stream(const char * path_to_save, media_stream_param
   stream->ts_fpackv_in_stream_msec = 0;
   stream->ts_fpacka_in_stream_msec = 0;
   stream->sample_id = 0;
-  stream->mkf_buffer = NULL;
 #if DUMP_MEDIA
   char media_dump_path[PATH_MAX] = {0};
   sprintf(media_dump_path, "%s.data", path_to_save);
@@ -136,21 +239,23 @@ media_stream_t* alloc_video_stream(const char * path_to_save, media_stream_param
   int res;
   AVFormatContext *formatContext;
 
-  if(!params->need_encode){
-    stream->ostream = alloc_output_stream(NULL, path_to_save, NULL);
+  if(params->need_encode){
+    stream->ostream = alloc_output_stream(NULL, path_to_save, NULL, params->avio_buffer_size,
+                                          params->io_backend);
     if (stream->ostream) {
       debug_msg("Created output media file path: %s!\n", path_to_save);
       formatContext = stream->ostream->oformat_context;
       res = add_video_stream(stream->ostream, AV_CODEC_ID_H264,
                                                params->width_video, params->height_video,
-                                               40000, params->video_fps);
+                                               params->video_bit_rate, params->video_fps);
     } else {
       debug_error("WARNING initiator output video stream with path %s not opened!", path_to_save);
       free(stream);
       return NULL;
     }
   } else {
-    stream->ostream = alloc_output_stream_without_codec(path_to_save);
+    stream->ostream = alloc_output_stream_without_codec(path_to_save, params->avio_buffer_size,
+                                                        params->io_backend);
     if (stream->ostream) {
       debug_msg("Created output media file path: %s!\n", path_to_save);
       formatContext = stream->ostream->oformat_context;
@@ -171,20 +276,95 @@ media_stream_t* alloc_video_stream(const char * path_to_save, media_stream_param
     return NULL;
   }
 
-  res = add_audio_stream(stream->ostream, AV_CODEC_ID_AAC, params->audio_sample_rate_out,
+  if (params->need_encode) {
+    codec_threading_t threading;
+    threading.thread_count = params->video_thread_count;
+    threading.thread_type = params->video_thread_type;
+    threading.cpu_mask = params->video_cpu_mask;
+    AVDictionary* vopt = NULL;
+    if (params->video_profile == MEDIA_VIDEO_PROFILE_LOW_LATENCY) {
+      // frame threads hold back one frame each
+      threading.thread_type = FF_THREAD_SLICE;
+      prepare_video_low_latency(stream->ostream, params->video_gop_size ? params->video_gop_size :
+                                                 params->video_fps * LOW_LATENCY_REFRESH_SEC,
+                                &vopt);
+    } else if (params->video_gop_size) {
+      stream->ostream->video_stream->codec->gop_size = params->video_gop_size;
+    }
+    res = open_video_stream(stream->ostream, &threading, vopt);
+    if (res == ERROR_RESULT_VALUE) {
+      debug_error("open_video_stream failed!\n");
+      free_output_stream(stream->ostream);
+      free(stream);
+      return NULL;
+    }
+
+    AVCodecContext *codec_ctx = stream->ostream->video_stream->codec;
+    stream->vconverter = alloc_video_converter(codec_ctx->width, codec_ctx->height,
+                                               codec_ctx->pix_fmt, VIDEO_FRAME_POOL_SIZE);
+    if (!stream->vconverter) {
+      debug_error("alloc_video_converter failed!\n");
+      free_output_stream(stream->ostream);
+      free(stream);
+      return NULL;
+    }
+  }
+
+  enum AVCodecID audio_codec_id = AV_CODEC_ID_AAC;
+  if (params->audio_codec == MEDIA_AUDIO_OPUS) {
+    // muxers without query_codec or codec_tag (mpegts) answer < 0, unknown: tried,
+    // avformat_write_header rejects it if the muxer really can't
+    if (avformat_query_codec(formatContext->oformat, AV_CODEC_ID_OPUS,
+                             FF_COMPLIANCE_NORMAL) != 0) {
+      audio_codec_id = AV_CODEC_ID_OPUS;
+    } else {
+      debug_warning("%s can't carry opus, audio falls back to aac\n",
+                    formatContext->oformat->name);
+    }
+  }
+
+  res = add_audio_stream(stream->ostream, audio_codec_id, params->audio_sample_rate_out,
                          params->audio_channels_out, params->audio_bit_rate_out);
   if (res == ERROR_RESULT_VALUE) {
     debug_error("add_audio_stream failed!\n");
+    if (stream->vconverter) {
+      free_video_converter(stream->vconverter);
+    }
     free_output_stream(stream->ostream);
     free(stream);
     return NULL;
   }
 
   AVDictionary* opt = NULL;
-  av_dict_set(&opt, "strict", "experimental", 0);
+  if (audio_codec_id == AV_CODEC_ID_OPUS) {
+    // speech tuned, dtx needs the voip application
+    av_dict_set(&opt, "application", "voip", 0);
+    av_dict_set_int(&opt, "frame_duration",
+                    params->audio_frame_msec ? params->audio_frame_msec : OPUS_DEFAULT_FRAME_MSEC,
+                    0);
+    av_dict_set_int(&opt, "dtx", params->audio_dtx, 0);
+  } else {
+    av_dict_set(&opt, "strict", "experimental", 0);
+  }
   res = open_audio_stream(stream->ostream, opt);
   if (res < 0) {
     debug_error("open_audio_stream failed!\n");
+  } else {
+    AVCodecContext* actx = stream->ostream->audio_stream->codec;
+    enum AVSampleFormat capture_fmt = capture_sample_fmt(params->bit_per_sample);
+    uint64_t capture_layout = av_get_default_channel_layout(params->audio_channels);
+    if (capture_fmt == actx->sample_fmt && capture_layout == actx->channel_layout &&
+        static_cast<int>(params->audio_sample_rate) == actx->sample_rate) {
+      stream->audio_accumulator = alloc_audio_accumulator(actx);
+    } else if (capture_fmt != AV_SAMPLE_FMT_NONE && params->audio_sample_rate) {
+      stream->audio_resampler = alloc_resampler(actx, params->audio_sample_rate, capture_fmt,
+                                                capture_layout, 0);
+    } else {
+      debug_warning("unknown capture format, pcm can't be encoded\n");
+    }
+    debug_msg("Audio %s %d Hz frame %d samples, capture pcm %s\n", actx->codec->name,
+              actx->sample_rate, actx->frame_size,
+              stream->audio_resampler ? "resampled" : "taken as is");
   }
 
 // av_dump_format(stream->ostream->oformat_context, 0, path_to_save, 1);
@@ -200,6 +380,37 @@ media_stream_t* alloc_video_stream(const char * path_to_save, media_stream_param
 
   av_dump_format(stream->ostream->oformat_context, 0, path_to_save, 1);
 
+  stream->stats = alloc_stream_stats();
+  stream->ostream->stats = stream->stats;
+
+  if (params->muxer_queue_size) {
+    res = start_output_stream_writer(stream->ostream, params->muxer_queue_size);
+    if (res == ERROR_RESULT_VALUE) {
+      debug_error("start_output_stream_writer failed, packets will be written synchronously!\n");
+    }
+  }
+
+  stream->fanout = alloc_output_fanout(stream->ostream, params->muxer_queue_size,
+                                       params->avio_buffer_size, params->io_backend);
+  stream->ostream->fanout = stream->fanout;
+
+  if (stream->vconverter && params->pipeline_depth) {
+    stream->vpipeline = alloc_video_pipeline(stream->ostream, stream->vconverter,
+                                             params->pipeline_depth);
+    if (!stream->vpipeline) {
+      debug_error("alloc_video_pipeline failed, frames will be encoded synchronously!\n");
+    }
+  }
+
+  if (params->video_max_backlog && params->video_fps && !params->offline) {
+    size_t max_backlog = params->video_max_backlog;
+    if (stream->vpipeline && max_backlog >= params->pipeline_depth) {
+      // dropped evenly before a full pipeline rejects frames at random
+      max_backlog = params->pipeline_depth > 1 ? params->pipeline_depth - 1 : 1;
+    }
+    stream->dropper = alloc_frame_dropper(max_backlog, params->video_fps);
+  }
+
   stream->params = *params;
 
   return stream;
@@ -218,41 +429,87 @@ const char * get_media_stream_file_path(media_stream_t* stream) {
   return formatContext->filename;
 }
 
-static AVFrame * icv_alloc_picture_FFMPEG(int pix_fmt, int width, int height, bool alloc)
-{
-    AVFrame * picture;
-    uint8_t * picture_buf;
-    int size;
-
-    picture = av_frame_alloc();
-    if (!picture)
-        return NULL;
-
-    picture->format = pix_fmt;
-    picture->width = width;
-    picture->height = height;
-
-    size = avpicture_get_size( (AVPixelFormat) pix_fmt, width, height);
-    if(alloc){
-        picture_buf = (uint8_t *) malloc(size);
-        if (!picture_buf)
-        {
-            av_free(picture);
-            return NULL;
-        }
-        avpicture_fill((AVPicture *)picture, picture_buf,
-                       (AVPixelFormat) pix_fmt, width, height);
-    }
-    else {
+int get_media_stream_video_threading(media_stream_t* stream, codec_threading_t* applied) {
+  if (!stream || !stream->ostream || !applied || !stream->params.need_encode) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  *applied = stream->ostream->video_threading;
+  return SUCCESS_RESULT_VALUE;
+}
+
+int get_media_stream_latency(media_stream_t* stream, video_latency_t* latency) {
+  if (!stream || !stream->stats || !latency || !stream->params.need_encode) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  get_stream_end_to_end_latency(stream->stats, latency);
+  return SUCCESS_RESULT_VALUE;
+}
+
+int get_media_stream_stats(media_stream_t* stream, stream_stats_snapshot_t* snapshot) {
+  if (!stream || !stream->stats || !snapshot) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  get_stream_stats(stream->stats, snapshot);
+  return SUCCESS_RESULT_VALUE;
+}
+
+int add_media_stream_output(media_stream_t* stream, const char* path, const char* format_name,
+                            AVDictionary* opt) {
+  if (!stream || !stream->fanout || !path) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  return output_fanout_add(stream->fanout, path, format_name, opt);
+}
+
+int remove_media_stream_output(media_stream_t* stream, int id) {
+  if (!stream || !stream->fanout) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  return output_fanout_remove(stream->fanout, id);
+}
+
+int rotate_media_stream(media_stream_t* stream, const char* path) {
+  if (!stream || !stream->ostream || !path) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  // on first use, a stream never rotated has no thread and no lock per packet for it
+  if (!stream->rotator) {
+    stream->rotator = alloc_segment_rotator(stream->ostream, stream->params.muxer_queue_size,
+                                            stream->params.avio_buffer_size,
+                                            stream->params.io_backend);
+    if (!stream->rotator) {
+      return ERROR_RESULT_VALUE;
     }
-    return picture;
+    __atomic_store_n(&stream->ostream->rotator, stream->rotator, __ATOMIC_RELEASE);
+  }
+
+  return segment_rotator_rotate(stream->rotator, path);
 }
 
 int write_video_frame_to_media_stream(media_stream_t * stream, const cv::Mat *mat) {
+  return write_video_frame_to_media_stream_at(stream, mat, AV_NOPTS_VALUE);
+}
+
+int write_video_frame_to_media_stream_at(media_stream_t * stream, const cv::Mat *mat,
+                                         int64_t pts_msec) {
   if (!stream || !mat) {
     return ERROR_RESULT_VALUE;
   }
 
+  if (pts_msec != AV_NOPTS_VALUE && stream->params.video_fps) {
+    // source time in frame units, never behind the last frame so pts stay increasing
+    uint64_t frame_id = av_rescale(pts_msec, stream->params.video_fps, 1000);
+    if (pts_msec >= 0 && frame_id > stream->video_frame_id) {
+      stream->video_frame_id = frame_id;
+    }
+  }
+
 #if DUMP_MEDIA
   if (stream->media_dump) {
     fwrite(data, sizeof(uint8_t), size, stream->media_dump);
@@ -262,48 +519,80 @@ int write_video_frame_to_media_stream(media_stream_t * stream, const cv::Mat *ma
   }
 #endif
 
-  if(!stream->params.need_encode){
-    AVCodecContext *codec_ctx = stream->ostream->video_stream->codec;
-
-    AVFrame * frame = av_frame_alloc();
-    int res = avpicture_fill((AVPicture*)frame, mat->data, AV_PIX_FMT_BGR24,
-                   codec_ctx->width, codec_ctx->height);
-
+  if (stream->params.need_encode) {
+    stream_stats_captured(stream->stats, stream->video_frame_id);
+    // a requested key frame waits for the next encoded frame, the encoder counts its gop
+    // in encoded frames, so dropping never loses an IDR
+    size_t backlog = stream->vpipeline ? video_pipeline_backlog(stream->vpipeline) : 0;
+    if (!frame_dropper_admit(stream->dropper, backlog)) {
+      stream->video_frame_id++;
+      stream_stats_shed(stream->stats);
+      return SUCCESS_RESULT_VALUE;
+    }
+  }
+  if (stream->vpipeline) {
+    int res = stream->params.offline ?
+        video_pipeline_push_wait(stream->vpipeline, mat, stream->video_frame_id++) :
+        video_pipeline_push(stream->vpipeline, mat, stream->video_frame_id++);
+    if (res == ERROR_RESULT_VALUE) {
+      stream_stats_dropped(stream->stats);
+      return ERROR_RESULT_VALUE;
+    }
+    return SUCCESS_RESULT_VALUE;
+  }
 
-    struct SwsContext *final_sws_ctx = sws_getContext(codec_ctx->width, codec_ctx->height,
-        AV_PIX_FMT_RGB24, codec_ctx->width, codec_ctx->height,
-        codec_ctx->pix_fmt, SWS_BICUBIC, 0, 0, 0);
+  uint64_t start_ns = utils::currentns();
+  if(stream->params.need_encode){
+    AVFrame * yframe = video_converter_convert(stream->vconverter, mat->data, mat->step[0],
+                                               mat->cols, mat->rows,
+                                               cv_type_to_pix_fmt(mat->type()));
+    if (!yframe) {
+      stream_stats_dropped(stream->stats);
+      return ERROR_RESULT_VALUE;
+    }
 
-    AVFrame * yframe = icv_alloc_picture_FFMPEG(codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height, true);
-    res = sws_scale(final_sws_ctx, frame->data,
-              frame->linesize,
-              0, codec_ctx->height,
-              yframe->data,
-              yframe->linesize);
+    yframe->pts = stream->video_frame_id++;
+    stream_stats_converted(stream->stats, yframe->pts);
 
-    AVPacket avpkt2 = {0};
-    av_init_packet(&avpkt2);
-    int got_packet = 0;
-    if (encode_ostream_video_frame(stream->ostream, frame, &avpkt2,
-                                    &got_packet) >= 0) {
-      if (got_packet) {
-        write_video_frame(stream->ostream, &avpkt2);
-      }
+    if (send_ostream_video_frame(stream->ostream, yframe) < 0) {
+      stream_stats_dropped(stream->stats);
+      return ERROR_RESULT_VALUE;
     }
-
-    av_frame_free(&yframe);
-    av_frame_free(&frame);
+    write_ready_video_packets(stream);
   } else {
-    uint32_t mst = utils::currentms();
-    if (stream->ts_fpackv_in_stream_msec == 0) {
-      stream->ts_fpackv_in_stream_msec = mst;
+    size_t sz = mat->cols * mat->rows;
+    int key = is_key_access_unit(mat->data, sz);
+    if (!frame_dropper_admit_encoded(stream->dropper, key)) {
+      stream_stats_shed(stream->stats);
+      return SUCCESS_RESULT_VALUE;
+    }
+
+    uint32_t msec = 0;
+    if (stream->params.offline) {
+      msec = pts_msec != AV_NOPTS_VALUE && pts_msec >= 0 ? pts_msec :
+          av_rescale(stream->video_frame_id, 1000, stream->params.video_fps);
+      stream->video_frame_id++;
+    } else {
+      uint32_t mst = utils::currentms();
+      if (stream->ts_fpackv_in_stream_msec == 0) {
+        stream->ts_fpackv_in_stream_msec = mst;
+      }
+      msec = mst - stream->ts_fpackv_in_stream_msec;
     }
 
     AVPacket avpkt2 = {0};
-    size_t sz = mat->cols * mat->rows;
-    init_video_packet_ms(stream->ostream, mat->data, sz, mst - stream->ts_fpackv_in_stream_msec, &avpkt2);
+    init_video_packet_ms(stream->ostream, mat->data, sz, msec, &avpkt2);
+    if (mat->u) {
+      // bytes referenced for the writer thread, fanout and rotator, never copied
+      avpkt2.buf = mat_buffer_ref(mat);
+    }
+    if (key) {
+      avpkt2.flags |= AV_PKT_FLAG_KEY;
+    }
     write_video_frame(stream->ostream, &avpkt2);
+    av_free_packet(&avpkt2);
   }
+  frame_dropper_processed(stream->dropper, utils::currentns() - start_ns);
 
   return SUCCESS_RESULT_VALUE;
 }
@@ -316,18 +605,92 @@ int write_audio_frame_to_media_stream(media_stream_t *stream, uint8_t *data, siz
   AVPacket avpkt2 = {0};
   init_audio_packet(stream->ostream, data, size, stream->sample_id, &avpkt2);
   stream->sample_id++;
+  if (stream->vpipeline) {
+    video_pipeline_lock_muxer(stream->vpipeline);
+  }
   write_audio_frame(stream->ostream, &avpkt2);
+  if (stream->vpipeline) {
+    video_pipeline_unlock_muxer(stream->vpipeline);
+  }
   av_free_packet(&avpkt2);
 
   stream->audio_pcm_id++;
   return SUCCESS_RESULT_VALUE;
 }
 
+int write_audio_samples_to_media_stream(media_stream_t *stream, const uint8_t * const *data,
+                                        int nb_samples) {
+  if (!stream || !stream_audio_accumulator(stream) || !data) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  int res = stream->audio_resampler ?
+            resampler_send_samples(stream->audio_resampler, const_cast<const uint8_t**>(data),
+                                   nb_samples) :
+            audio_accumulator_write(stream->audio_accumulator, data, nb_samples);
+  if (res == ERROR_RESULT_VALUE) {
+    return ERROR_RESULT_VALUE;
+  }
+  stream->audio_pcm_id++;
+
+  audio_accumulator_t* accumulator = stream_audio_accumulator(stream);
+  if (audio_accumulator_size(accumulator) < accumulator->frame_size) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  if (stream->vpipeline) {
+    video_pipeline_lock_muxer(stream->vpipeline);
+  }
+  res = encode_audio_accumulated(stream, false);
+  if (stream->vpipeline) {
+    video_pipeline_unlock_muxer(stream->vpipeline);
+  }
+  return res;
+}
+
 void free_video_stream(media_stream_t * stream) {
   if (!stream) {
     return;
   }
 
+  if (stream->vpipeline) {
+    free_video_pipeline(stream->vpipeline);
+    stream->vpipeline = NULL;
+  }
+
+  if (stream->params.need_encode && stream->ostream) {
+    // frames still inside the encoder, the pipeline has drained it already
+    send_ostream_video_frame(stream->ostream, NULL);
+    write_ready_video_packets(stream);
+  }
+
+  if (stream_audio_accumulator(stream)) {
+    // tail of the pcm and the encoder delay land in every output before the trailer
+    if (stream->ostream) {
+      encode_audio_accumulated(stream, true);
+    }
+  }
+  if (stream->audio_accumulator) {
+    free_audio_accumulator(stream->audio_accumulator);
+    stream->audio_accumulator = NULL;
+  }
+  if (stream->audio_resampler) {
+    free_resampler(stream->audio_resampler);
+    stream->audio_resampler = NULL;
+  }
+
+  if (stream->fanout) {
+    stream->ostream->fanout = NULL;
+    free_output_fanout(stream->fanout);
+    stream->fanout = NULL;
+  }
+
+  if (stream->rotator) {
+    stream->ostream->rotator = NULL;
+    free_segment_rotator(stream->rotator);
+    stream->rotator = NULL;
+  }
+
   if (stream->ostream) {
     uint32_t video_lenght_sec = stream->cur_ts_video_remote_msec/1000UL;
     int den = stream->ostream->video_stream->codec->time_base.den;
@@ -346,15 +709,37 @@ void free_video_stream(media_stream_t * stream) {
               video_lenght_sec,
               stream->ts_fpackv_in_stream_msec, stream->ts_fpacka_in_stream_msec);
 
-    AVFormatContext *formatContext = stream->ostream->oformat_context;
-    int ret = av_write_trailer(formatContext);
-    if (ret < 0) {
-      debug_av_perror("av_write_trailer", ret);
+    if (stream->stats) {
+      stream_stats_snapshot_t snapshot;
+      get_stream_stats(stream->stats, &snapshot);
+      debug_msg("    FPS %.2f, captured %" PRIu64 ", muxed %" PRIu64 ", dropped %" PRIu64
+                " (%" PRIu64 " behind), %" PRIu64 " bytes\n", snapshot.fps,
+                snapshot.frames_captured, snapshot.frames_muxed, snapshot.frames_dropped,
+                snapshot.frames_shed, snapshot.bytes_muxed);
+      for (int i = 0; i < STREAM_STAGE_COUNT; ++i) {
+        const stream_stage_latency_t* stage = &snapshot.stages[i];
+        if (stage->frames) {
+          debug_msg("    %s %" PRIu64 " frames, p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+                    stream_stage_name(static_cast<stream_stage_t>(i)), stage->frames,
+                    stage->p50_ns / 1e6, stage->p99_ns / 1e6, stage->max_ns / 1e6);
+        }
+      }
     }
+
+    // every queued packet reaches the muxer before the trailer, no-op if rotated away
+    close_output_stream_file(stream->ostream);
     close_output_stream(stream->ostream);
     free_output_stream(stream->ostream);
     stream->ostream = NULL;
   }
+  if (stream->stats) {
+    free_stream_stats(stream->stats);
+    stream->stats = NULL;
+  }
+  if (stream->dropper) {
+    free_frame_dropper(stream->dropper);
+    stream->dropper = NULL;
+  }
 #if DUMP_MEDIA
   if (stream->media_dump) {
     fclose(stream->media_dump);
@@ -374,15 +759,15 @@ void free_video_stream(media_stream_t * stream) {
   stream->ts_fpacka_in_stream_msec = 0;
   stream->sample_id = 0;
 
-  if (stream->mkf_buffer) {
-    free(stream->mkf_buffer);
-    stream->mkf_buffer = NULL;
-  }
-
   if (stream->nalu) {
     free_own_nal_unit(stream->nalu);
     stream->nalu = NULL;
   }
+
+  if (stream->vconverter) {
+    free_video_converter(stream->vconverter);
+    stream->vconverter = NULL;
+  }
   stream->audio_pcm_id = 0;
 
   free(stream);
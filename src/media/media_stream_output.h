@@ -4,9 +4,14 @@
 
 #include "macros.h"
 
+#include "media/file_writer.h"
+
 #include <opencv2/opencv.hpp>
 
+struct AVDictionary;
+
 #define DUMP_MEDIA 0
+#define VIDEO_FRAME_POOL_SIZE 4
 
 namespace fasto {
 namespace media {
@@ -14,6 +19,26 @@ namespace media {
 struct output_stream_t;
 struct resampler_t;
 struct own_nal_unit_t;
+struct video_converter_t;
+struct video_pipeline_t;
+struct output_fanout_t;
+struct segment_rotator_t;
+struct codec_threading_t;
+struct video_latency_t;
+struct stream_stats_t;
+struct stream_stats_snapshot_t;
+struct audio_accumulator_t;
+struct frame_dropper_t;
+
+typedef enum media_audio_codec_t {
+  MEDIA_AUDIO_AAC = 0,
+  MEDIA_AUDIO_OPUS  // libopus, mkv/webm/mpegts, other containers fall back to aac
+} media_audio_codec_t;
+
+typedef enum media_video_profile_t {
+  MEDIA_VIDEO_PROFILE_DEFAULT = 0,
+  MEDIA_VIDEO_PROFILE_LOW_LATENCY  // live view: no b-frames or lookahead, intra refresh, vbv
+} media_video_profile_t;
 
 typedef struct media_stream_params_t {
   uint32_t height_video;
@@ -28,13 +53,40 @@ typedef struct media_stream_params_t {
   uint32_t audio_channels_out;
   uint32_t audio_sample_rate_out;
   uint32_t audio_bit_rate_out;
+  media_audio_codec_t audio_codec;
+  uint32_t audio_frame_msec;  // opus frame duration 10, 20, 40 or 60, 0 - 20
+  bool audio_dtx;  // opus: almost no packets while silent
 
   bool need_encode;
+  media_video_profile_t video_profile;
+  uint32_t video_bit_rate;  // bits per second, 0 - codec default quality (crf with x264)
+  uint32_t video_gop_size;  // frames, 0 - 12, one second with low latency
+  uint32_t video_thread_count;  // encoder threads, 0 - auto
+  uint32_t video_thread_type;  // FF_THREAD_FRAME | FF_THREAD_SLICE, 0 - codec default
+  uint64_t video_cpu_mask;  // bit per cpu encoder threads pinned to, 0 - not pinned
+  uint32_t pipeline_depth;  // frames in flight convert/encode/mux threads, 0 - synchronous
+  // frames waiting for the encoder (below pipeline_depth) before frames are dropped evenly,
+  // synchronous encoding drops once a frame takes longer than 1 / video_fps, 0 - never
+  uint32_t video_max_backlog;
+  uint32_t muxer_queue_size;  // packets queued for the writer thread, 0 - write in place
+  uint32_t avio_buffer_size;  // bytes per write to the file, 0 - libavformat default
+  output_io_backend_t io_backend;  // how the files of the stream reach the disk
+  // file to file as fast as possible: timestamps from the frame index or the source pts
+  // instead of the clock, a full pipeline blocks the writer, no frame is dropped
+  bool offline;
 } media_stream_params_t;
 
 typedef struct media_stream_t {
   struct output_stream_t* ostream;
   struct own_nal_unit_t * nalu;
+  struct video_converter_t * vconverter;  // BGR Mat -> encoder pix_fmt, built once
+  struct video_pipeline_t * vpipeline;  // NULL if frames encoded in caller thread
+  struct output_fanout_t * fanout;  // extra containers muxed from the same packets
+  struct segment_rotator_t * rotator;  // created by the first rotate_media_stream, else NULL
+  struct audio_accumulator_t * audio_accumulator;  // pcm sliced into audio encoder frames
+  struct resampler_t * audio_resampler;  // used instead if capture and encoder formats differ
+  struct stream_stats_t * stats;  // per stage video latency and counters, NULL if not allocated
+  struct frame_dropper_t * dropper;  // NULL - every frame encoded however late
 
   uint64_t audio_pcm_id;
   uint64_t video_frame_id;
@@ -45,7 +97,6 @@ typedef struct media_stream_t {
   uint32_t cur_ts_video_remote_msec;
   uint32_t cur_ts_video_local_msec;
   uint64_t sample_id;
-  uint8_t * mkf_buffer;
 
 #if DUMP_MEDIA
   FILE * media_dump;
@@ -58,8 +109,34 @@ typedef struct media_stream_t {
 media_stream_t* alloc_video_stream(const char * path_to_save,
                                    media_stream_params_t * params);  // h264, aac
 const char * get_media_stream_file_path(media_stream_t* stream);
+// threading applied to the video encoder
+int get_media_stream_video_threading(media_stream_t* stream, struct codec_threading_t* applied);
+// capture to mux of encoded frames so far
+int get_media_stream_latency(media_stream_t* stream, struct video_latency_t* latency);
+// per stage latency percentiles, fps, dropped frames and bytes muxed, any time while running
+int get_media_stream_stats(media_stream_t* stream, struct stream_stats_snapshot_t* snapshot);
+// one more container fed by the running encoders, format guessed from path if
+// format_name is NULL, returns output id or ERROR_RESULT_VALUE
+int add_media_stream_output(media_stream_t* stream, const char* path, const char* format_name,
+                            struct AVDictionary* opt);
+int remove_media_stream_output(media_stream_t* stream, int id);
+// continues in path from the next key frame (forced when encoding), encoders stay open,
+// returns at once, ERROR_RESULT_VALUE while the previous rotation is in progress
+int rotate_media_stream(media_stream_t* stream, const char* path);
+// SUCCESS_RESULT_VALUE also when the frame is dropped because encoding falls behind,
+// its pts is skipped so the output stays valid with a variable frame rate
 int write_video_frame_to_media_stream(media_stream_t * stream, const cv::Mat *mat);
+// pts_msec from the source, AV_NOPTS_VALUE - next frame index, earlier than the previous
+// frame is moved after it; without need_encode mat holds one Annex-B access unit whose
+// bytes are muxed by reference, like pipeline frames: write the next one into a new Mat
+int write_video_frame_to_media_stream_at(media_stream_t * stream, const cv::Mat *mat,
+                                         int64_t pts_msec);
 int write_audio_frame_to_media_stream(media_stream_t * stream, uint8_t *data, size_t size);
+// pcm in the capture format of params (rate, channels, bit_per_sample), any nb_samples,
+// converted to the encoder format if it differs, encoded as soon as a full encoder frame
+// is buffered, pts counted in samples
+int write_audio_samples_to_media_stream(media_stream_t * stream, const uint8_t * const * data,
+                                        int nb_samples);
 void free_video_stream(media_stream_t * stream);
 
 }  // namespace media
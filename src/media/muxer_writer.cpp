@@ -0,0 +1,200 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/muxer_writer.h"
+
+#include "log.h"
+
+#include "media/ffmpeg_utils.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void* writer_thread_routine(void* arg) {
+  muxer_writer_t* writer = reinterpret_cast<muxer_writer_t*>(arg);
+
+  pthread_mutex_lock(&writer->lock);
+  while (true) {
+    while (writer->count == 0 && !writer->closed) {
+      pthread_cond_wait(&writer->not_empty, &writer->lock);
+    }
+    if (writer->count == 0) {
+      break;
+    }
+
+    /* producers only append behind head + count,
+     * the batch is written without holding the lock */
+    size_t start = writer->head;
+    size_t batch = writer->count;
+    pthread_mutex_unlock(&writer->lock);
+
+    int err = 0;
+    for (size_t i = 0; i < batch; ++i) {
+      AVPacket* pkt = &writer->packets[(start + i) % writer->capacity];
+      int ret = av_write_frame(writer->oformat_context, pkt);
+      if (ret < 0) {
+        debug_av_perror("av_write_frame", ret);
+        err = ret;
+      }
+      av_free_packet(pkt);
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    writer->head = (start + batch) % writer->capacity;
+    writer->count -= batch;
+    writer->packets_written += batch;
+    writer->batches++;
+    if (err) {
+      writer->last_error = err;
+    }
+    pthread_cond_broadcast(&writer->not_full);
+    if (writer->count == 0) {
+      pthread_cond_broadcast(&writer->drained);
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return NULL;
+}
+
+}  // namespace
+
+muxer_writer_t* alloc_muxer_writer(AVFormatContext* oformat_context, size_t capacity) {
+  if (!oformat_context || capacity == 0) {
+    debug_perror("alloc_muxer_writer", EINVAL);
+    return NULL;
+  }
+
+  muxer_writer_t* writer = reinterpret_cast<muxer_writer_t*>(calloc(1, sizeof(muxer_writer_t)));
+  if (!writer) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  writer->packets = reinterpret_cast<AVPacket*>(calloc(capacity, sizeof(AVPacket)));
+  if (!writer->packets) {
+    debug_perror("calloc", ENOMEM);
+    free(writer);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < capacity; ++i) {
+    av_init_packet(&writer->packets[i]);
+  }
+
+  writer->oformat_context = oformat_context;
+  writer->capacity = capacity;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->not_empty, NULL);
+  pthread_cond_init(&writer->not_full, NULL);
+  pthread_cond_init(&writer->drained, NULL);
+
+  int err = pthread_create(&writer->tid, NULL, writer_thread_routine, writer);
+  if (err) {
+    debug_perror("pthread_create", err);
+    free_muxer_writer(writer);
+    return NULL;
+  }
+
+  writer->thread_started = true;
+  return writer;
+}
+
+int muxer_writer_push(muxer_writer_t* writer, AVPacket* pkt) {
+  if (!writer || !pkt) {
+    debug_perror("muxer_writer_push", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  if (writer->count == writer->capacity) {
+    writer->producer_waits++;
+    while (writer->count == writer->capacity && !writer->closed) {
+      pthread_cond_wait(&writer->not_full, &writer->lock);
+    }
+  }
+
+  if (writer->closed) {
+    pthread_mutex_unlock(&writer->lock);
+    debug_perror("muxer_writer_push", EPIPE);
+    return ERROR_RESULT_VALUE;
+  }
+
+  int ret = writer->last_error;
+  AVPacket* slot = &writer->packets[(writer->head + writer->count) % writer->capacity];
+  if (pkt->buf) {
+    av_packet_move_ref(slot, pkt);
+  } else {
+    // caller memory, does not outlive this call
+    int err = av_packet_ref(slot, pkt);
+    if (err < 0) {
+      pthread_mutex_unlock(&writer->lock);
+      debug_av_perror("av_packet_ref", err);
+      return err;
+    }
+    av_free_packet(pkt);
+  }
+
+  writer->count++;
+  if (writer->count > writer->max_queued) {
+    writer->max_queued = writer->count;
+  }
+  pthread_cond_signal(&writer->not_empty);
+  pthread_mutex_unlock(&writer->lock);
+  return ret < 0 ? ret : SUCCESS_RESULT_VALUE;
+}
+
+int muxer_writer_flush(muxer_writer_t* writer) {
+  if (!writer) {
+    debug_perror("muxer_writer_flush", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  while (writer->count != 0) {
+    pthread_cond_wait(&writer->drained, &writer->lock);
+  }
+
+  // writer can not start a batch while we hold the lock with nothing queued
+  if (writer->oformat_context->pb) {
+    avio_flush(writer->oformat_context->pb);
+  }
+  int ret = writer->last_error;
+  pthread_mutex_unlock(&writer->lock);
+  return ret < 0 ? ret : SUCCESS_RESULT_VALUE;
+}
+
+void free_muxer_writer(muxer_writer_t* writer) {
+  if (!writer) {
+    debug_perror("free_muxer_writer", EINVAL);
+    return;
+  }
+
+  if (writer->thread_started) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closed = true;
+    pthread_cond_broadcast(&writer->not_empty);
+    pthread_cond_broadcast(&writer->not_full);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->tid, NULL);
+    writer->thread_started = false;
+    debug_msg("Muxer writer finished, packets %" PRIu64 " in %" PRIu64 " batches,"
+              " max queued %" PRIu64 ", producer waits %" PRIu64 "\n",
+              writer->packets_written, writer->batches, writer->max_queued,
+              writer->producer_waits);
+  }
+
+  for (size_t i = 0; i < writer->capacity; ++i) {
+    av_free_packet(&writer->packets[i]);
+  }
+  free(writer->packets);
+  pthread_cond_destroy(&writer->drained);
+  pthread_cond_destroy(&writer->not_full);
+  pthread_cond_destroy(&writer->not_empty);
+  pthread_mutex_destroy(&writer->lock);
+  free(writer);
+}
+
+}  // namespace media
+}  // namespace fasto
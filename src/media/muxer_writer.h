@@ -0,0 +1,51 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "macros.h"
+
+namespace fasto {
+namespace media {
+
+// bounded packet queue in front of av_write_frame, one writer thread drains it in batches
+// so slow storage stalls the writer and not the encoders, producers may be many threads
+typedef struct muxer_writer_t {
+  AVFormatContext* oformat_context;  // not owned
+
+  AVPacket* packets;  // ring, [head, head + count) queued or being written
+  size_t capacity;
+  size_t head;
+  size_t count;
+  bool closed;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  pthread_cond_t drained;
+  pthread_t tid;
+  bool thread_started;
+
+  uint64_t packets_written;
+  uint64_t batches;
+  uint64_t max_queued;
+  uint64_t producer_waits;  // push found the queue full
+  int last_error;  // last av_write_frame error, 0 if none
+} muxer_writer_t;
+
+muxer_writer_t* alloc_muxer_writer(AVFormatContext* oformat_context, size_t capacity);
+// takes the packet reference, pkt is reset, blocks while the queue is full,
+// returns last write error if the writer failed before
+int muxer_writer_push(muxer_writer_t* writer, AVPacket* pkt);
+// barrier: returns when every packet pushed before is written and AVIO flushed
+int muxer_writer_flush(muxer_writer_t* writer);
+void free_muxer_writer(muxer_writer_t* writer);  // writes all queued packets
+
+}  // namespace media
+}  // namespace fasto
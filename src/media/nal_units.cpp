@@ -6,6 +6,10 @@
 #include <memory.h>
 #include <stdlib.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "log.h"
 
 #define MEMCPY_VAR(type, hx, var, buff) \
@@ -19,6 +23,94 @@ namespace {
   const uint8_t pps_header[] = { 0x00, 0x00, 0x01 };
   const uint8_t idr_header[] = { 0x00, 0x00, 0x01 };
   const uint8_t slice_header[] = { 0x00, 0x00, 0x01 };
+
+// position of the next 00 00 01 at or after from, -1 if none
+typedef int (*next_start_code_t)(const uint8_t* buf, int from, int size);
+
+typedef struct start_code_scanner_t {
+  const char* name;
+  next_start_code_t next_start_code;
+} start_code_scanner_t;
+
+int next_start_code_c(const uint8_t* buf, int from, int size) {
+  for (int i = from; i + 3 <= size; ++i) {
+    if (buf[i + 2] > 1) {  // no start code may begin at i, i + 1 or i + 2
+      i += 2;
+    } else if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+int next_start_code_sse2(const uint8_t* buf, int from, int size) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+
+  int i = from;
+  for (; i + 16 + 2 <= size; i += 16) {
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+    __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + 1));
+    __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + 2));
+    __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero),
+                                              _mm_cmpeq_epi8(b1, zero)),
+                                _mm_cmpeq_epi8(b2, one));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return next_start_code_c(buf, i, size);
+}
+
+__attribute__((target("avx2")))
+int next_start_code_avx2(const uint8_t* buf, int from, int size) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+
+  int i = from;
+  for (; i + 32 + 2 <= size; i += 32) {
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i + 1));
+    __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i + 2));
+    __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                                                    _mm256_cmpeq_epi8(b1, zero)),
+                                   _mm256_cmpeq_epi8(b2, one));
+    uint32_t mask = _mm256_movemask_epi8(hit);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return next_start_code_sse2(buf, i, size);
+}
+#endif
+
+const start_code_scanner_t* select_start_code_scanner() {
+  static const start_code_scanner_t scanner_c = { "c", next_start_code_c };
+#if defined(__x86_64__) || defined(__i386__)
+  static const start_code_scanner_t scanner_sse2 = { "sse2", next_start_code_sse2 };
+  static const start_code_scanner_t scanner_avx2 = { "avx2", next_start_code_avx2 };
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return &scanner_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return &scanner_sse2;
+  }
+#endif
+  return &scanner_c;
+}
+
+const start_code_scanner_t* start_code_scanner() {
+  static const start_code_scanner_t* scanner = select_start_code_scanner();
+  return scanner;
+}
 }
 
 namespace fasto {
@@ -29,6 +121,10 @@ int find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end, uint8_t*
   *nal_start = 0;
   *nal_end = 0;
 
+  if (size < 4) {
+    return 0;
+  }
+
   int i = 0;
   while (   //( next_bits( 24 ) != 0x000001 && next_bits( 32 ) != 0x00000001 )
     (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01) &&
@@ -50,18 +146,53 @@ int find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end, uint8_t*
   *nal_start = i;
 
   while (   //( next_bits( 24 ) != 0x000000 && next_bits( 24 ) != 0x000001 )
+    i + 3 <= size &&
     (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0) &&
     (buf[i] != 0 || buf[i+1] != 0 || buf[i+2] != 0x01)
     ) {
     i++;
-    // FIXME the next line fails when reading a nal that ends exactly at the end of the data
-    if (i+3 >= size) { *nal_end = size; return -1; }  // did not find nal end, stream ended first
+  }
+
+  if (i + 3 > size) {  // nal ends exactly at the end of the data
+    i = size;
   }
 
   *nal_end = i;
   return (*nal_end - *nal_start);
 }
 
+int find_nal_units(const uint8_t* buf, int size, nal_unit_info_t* units, int max_units) {
+  if (!buf || size < 0 || !units || max_units <= 0) {
+    debug_perror("find_nal_units", EINVAL);
+    return 0;
+  }
+
+  next_start_code_t next_start_code = start_code_scanner()->next_start_code;
+  int count = 0;
+  int pos = next_start_code(buf, 0, size);
+  while (pos >= 0 && count < max_units) {
+    nal_unit_info_t* unit = &units[count++];
+    int offset = pos + sizeof(slice_header);
+    unit->offset = offset;
+    unit->start_code_size = (pos > 0 && buf[pos - 1] == 0) ? 4 : 3;
+    unit->type = offset < size ? (buf[offset] & 0x1F) : NAL_UNIT_TYPE_UNSPECIFIED;
+
+    int next = next_start_code(buf, offset, size);
+    int end = next >= 0 ? next : size;
+    while (end > offset && buf[end - 1] == 0) {  // zero_byte of the next start code, trailing_zero_8bits
+      end--;
+    }
+    unit->size = end - offset;
+    pos = next;
+  }
+
+  return count;
+}
+
+const char* nal_scanner_name() {
+  return start_code_scanner()->name;
+}
+
 own_nal_unit_t *alloc_own_nal_unit_from_string(const uint8_t *data, uint32_t * len) {
   *len = 0;
   if (!data) {
@@ -113,6 +244,10 @@ void free_own_nal_unit(own_nal_unit_t * nal_unit) {
     free(nal_unit->parametrs);
     nal_unit->parametrs = NULL;
   }
+  if (nal_unit->sps_pps_prefix) {
+    free(nal_unit->sps_pps_prefix);
+    nal_unit->sps_pps_prefix = NULL;
+  }
   free(nal_unit);
 }
 
@@ -224,15 +359,48 @@ int is_key_frame(uint8_t* raw_idr, int32_t len) {
   return (raw_idr[4] & 0x1F) == NAL_UNIT_TYPE_CODED_SLICE_IDR;
 }
 
+int is_key_access_unit(const uint8_t* buf, int size) {
+  if (!buf || size <= 0) {
+    debug_perror("is_key_access_unit", EINVAL);
+    return 0;
+  }
+
+  nal_unit_info_t units[NAL_UNITS_PER_SCAN];
+  int offset = 0;
+  bool indexed = false;
+  while (offset < size) {
+    int count = find_nal_units(buf + offset, size - offset, units, NAL_UNITS_PER_SCAN);
+    for (int i = 0; i < count; ++i) {
+      if (units[i].type == NAL_UNIT_TYPE_CODED_SLICE_IDR) {
+        return 1;
+      }
+    }
+    indexed = indexed || count > 0;
+    if (count < NAL_UNITS_PER_SCAN) {
+      break;
+    }
+    // index full, continue behind the last unit
+    offset += units[count - 1].offset + units[count - 1].size;
+  }
 
-uint8_t* create_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int32_t raw_idr_len,
-                                  uint32_t* olen) {
+  if (!indexed && size > 4) {
+    return is_key_frame(const_cast<uint8_t*>(buf), size);
+  }
+  return 0;
+}
+
+const uint8_t* get_sps_pps_prefix(own_nal_unit_t * nal_u, uint32_t* olen) {
   *olen = 0;
-  if (!nal_u || !raw_idr) {
-    debug_perror("create_non_idr_nal_unit", EINVAL);
+  if (!nal_u || nal_u->parametr_count < 2) {
+    debug_perror("get_sps_pps_prefix", EINVAL);
     return NULL;
   }
 
+  if (nal_u->sps_pps_prefix) {
+    *olen = nal_u->sps_pps_prefix_len;
+    return nal_u->sps_pps_prefix;
+  }
+
   uint32_t sps_len = nal_u->parametrs[0].len;
   uint8_t* sps = nal_u->parametrs[0].value;
   DCHECK((sps[0] & 0x1F) == NAL_UNIT_TYPE_SPS);
@@ -240,40 +408,122 @@ uint8_t* create_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int3
   uint8_t* pps = nal_u->parametrs[1].value;
   DCHECK((pps[0] & 0x1F) == NAL_UNIT_TYPE_PPS);
 
+  uint32_t prefix_len = sizeof(sps_header) + sps_len + sizeof(pps_header) + pps_len +
+      sizeof(idr_header);
+  uint8_t* prefix = reinterpret_cast<uint8_t*>(malloc(prefix_len));
+  if (!prefix) {
+    debug_perror("malloc", ENOMEM);
+    return NULL;
+  }
+
+  uint32_t offset = 0;
+  memcpy(prefix + offset, sps_header, sizeof(sps_header));
+  offset += sizeof(sps_header);
+  memcpy(prefix + offset, sps, sps_len);
+  offset += sps_len;
+
+  memcpy(prefix + offset, pps_header, sizeof(pps_header));
+  offset += sizeof(pps_header);
+  memcpy(prefix + offset, pps, pps_len);
+  offset += pps_len;
+
+  memcpy(prefix + offset, idr_header, sizeof(idr_header));
+  offset += sizeof(idr_header);
+  DCHECK(offset == prefix_len);
+
+  nal_u->sps_pps_prefix = prefix;
+  nal_u->sps_pps_prefix_len = prefix_len;
+  *olen = prefix_len;
+  return prefix;
+}
+
+uint32_t sps_pps_key_frame_size(own_nal_unit_t * nal_u, int32_t raw_idr_len) {
+  uint32_t prefix_len = 0;
+  if (!get_sps_pps_prefix(nal_u, &prefix_len) || raw_idr_len <= 4) {
+    return 0;
+  }
+
+  return prefix_len + raw_idr_len - 4;
+}
+
+int write_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int32_t raw_idr_len,
+                            uint8_t* dst, uint32_t dst_size, uint32_t* olen) {
+  *olen = 0;
+  if (!nal_u || !raw_idr || raw_idr_len <= 4 || !dst) {
+    debug_perror("write_sps_pps_key_frame", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
   uint8_t* ridr = raw_idr + 4;
   uint32_t ridr_len = raw_idr_len - 4;
 
   int nal_type = ridr[0] & 0x1F;
-
   if (nal_type != NAL_UNIT_TYPE_CODED_SLICE_IDR && nal_type != NAL_UNIT_TYPE_CODED_SLICE_NON_IDR) {
     debug_warning("WARNING UNKNOWN FRAME_TYPE: %d\n", nal_type);
-    return NULL;
+    return ERROR_RESULT_VALUE;
   }
 
-  *olen = sizeof(sps_header) + sps_len + sizeof(pps_header) + pps_len +
-      sizeof(idr_header) + ridr_len;
+  uint32_t prefix_len = 0;
+  const uint8_t* prefix = get_sps_pps_prefix(nal_u, &prefix_len);
+  if (!prefix || prefix_len + ridr_len > dst_size) {
+    return ERROR_RESULT_VALUE;
+  }
 
-  uint8_t* key_frame = reinterpret_cast<uint8_t*>(calloc(*olen, sizeof(uint8_t)));
+  memcpy(dst, prefix, prefix_len);
+  memcpy(dst + prefix_len, ridr, ridr_len);
+  *olen = prefix_len + ridr_len;
+  return SUCCESS_RESULT_VALUE;
+}
 
-  uint32_t offset = 0;
-  memcpy(key_frame + offset, sps_header, sizeof(sps_header));
-  offset += sizeof(sps_header);
-  memcpy(key_frame + offset, sps, sps_len);
-  offset += sps_len;
+uint8_t* create_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int32_t raw_idr_len,
+                                  uint32_t* olen) {
+  *olen = 0;
+  if (!nal_u || !raw_idr) {
+    debug_perror("create_non_idr_nal_unit", EINVAL);
+    return NULL;
+  }
 
-  memcpy(key_frame + offset, pps_header, sizeof(pps_header));
-  offset += sizeof(pps_header);
-  memcpy(key_frame + offset, pps, pps_len);
-  offset += pps_len;
+  uint32_t size = sps_pps_key_frame_size(nal_u, raw_idr_len);
+  if (!size) {
+    return NULL;
+  }
 
-  memcpy(key_frame + offset, idr_header, sizeof(idr_header));
-  offset += sizeof(idr_header);
-  memcpy(key_frame + offset, ridr, ridr_len);
-  offset += ridr_len;
+  uint8_t* key_frame = reinterpret_cast<uint8_t*>(malloc(size));
+  if (!key_frame) {
+    debug_perror("malloc", ENOMEM);
+    return NULL;
+  }
 
-  DCHECK(offset == *olen);
+  if (write_sps_pps_key_frame(nal_u, raw_idr, raw_idr_len, key_frame, size, olen) ==
+      ERROR_RESULT_VALUE) {
+    free(key_frame);
+    return NULL;
+  }
+
+  DCHECK(*olen == size);
   return key_frame;
 }
 
+uint8_t* annexb_slice_in_place(uint8_t* raw_slice, int32_t len, uint32_t* olen) {
+  *olen = 0;
+  if (!raw_slice || len <= 4) {
+    debug_perror("annexb_slice_in_place", EINVAL);
+    return NULL;
+  }
+
+  int nal_type = raw_slice[4] & 0x1F;
+  if (nal_type != NAL_UNIT_TYPE_CODED_SLICE_IDR && nal_type != NAL_UNIT_TYPE_CODED_SLICE_NON_IDR) {
+    debug_warning("WARNING UNKNOWN FRAME_TYPE: %d\n", nal_type);
+    return NULL;
+  }
+
+  raw_slice[0] = 0x00;
+  raw_slice[1] = 0x00;
+  raw_slice[2] = 0x00;
+  raw_slice[3] = 0x01;
+  *olen = len;
+  return raw_slice;
+}
+
 }  // namespace media
 }  // namespace fasto
@@ -5,6 +5,7 @@
 #include "macros.h"
 
 #define NAL_TYPE_HEADER_SIZE 3
+#define NAL_UNITS_PER_SCAN 32  // index entries per find_nal_units call over an access unit
 
 // Table 7-1 NAL unit type codes
 #define NAL_UNIT_TYPE_UNSPECIFIED                    0    // Unspecified
@@ -44,6 +45,9 @@ typedef struct own_nal_unit_t {
   uint32_t total_size;
   size_t parametr_count;
   len_value_t *parametrs;
+
+  uint8_t *sps_pps_prefix;  // start code + SPS + start code + PPS + start code, built once
+  uint32_t sps_pps_prefix_len;
 } own_nal_unit_t;
 
 /*
@@ -85,7 +89,17 @@ typedef struct header_enc_frame_t {
 
 #pragma pack(pop)
 
+typedef struct nal_unit_info_t {
+  uint32_t offset;  // first byte after start code
+  uint32_t size;  // trailing zero bytes excluded
+  uint8_t start_code_size;  // 3 or 4
+  uint8_t type;  // Table 7-1
+} nal_unit_info_t;
+
 int find_nal_unit(uint8_t* buf, int size, int* nal_start, int* nal_end, uint8_t* nal_type);
+// one pass over Annex-B buffer, fills at most max_units entries, returns filled count
+int find_nal_units(const uint8_t* buf, int size, nal_unit_info_t* units, int max_units);
+const char* nal_scanner_name();  // start code scanner selected for this cpu
 
 own_nal_unit_t * alloc_own_nal_unit_from_string(const uint8_t* data, uint32_t * len);
 void free_own_nal_unit(own_nal_unit_t * nal_unit);
@@ -98,8 +112,20 @@ void free_header_enc_frame(header_enc_frame_t * hencfr);
 
 uint8_t* create_non_idr_nal_unit(frame_data_t* raw_slice, uint32_t * len);
 int is_key_frame(uint8_t* raw_idr, int32_t len);
+// IDR slice in any NAL of an Annex-B access unit (also behind AUD, SPS, PPS or SEI),
+// indexed in one pass, a buffer without start codes is checked with is_key_frame
+int is_key_access_unit(const uint8_t* buf, int size);
 uint8_t* create_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int32_t len,
                                   uint32_t* olen);
 
+const uint8_t* get_sps_pps_prefix(own_nal_unit_t * nal_u, uint32_t* olen);
+uint32_t sps_pps_key_frame_size(own_nal_unit_t * nal_u, int32_t raw_idr_len);
+// writes key frame into caller buffer (dst_size >= sps_pps_key_frame_size), no allocations
+int write_sps_pps_key_frame(own_nal_unit_t * nal_u, uint8_t* raw_idr, int32_t raw_idr_len,
+                            uint8_t* dst, uint32_t dst_size, uint32_t* olen);
+// modifies the caller's buffer: the 4 byte length in front of the slice is overwritten
+// with a start code, returns raw_slice itself, ready to be muxed without copying
+uint8_t* annexb_slice_in_place(uint8_t* raw_slice, int32_t len, uint32_t* olen);
+
 }  // namespace media
 }  // namespace fasto
@@ -0,0 +1,198 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/output_fanout.h"
+
+#include "log.h"
+
+#include "media/codec_holder.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void close_fanout_output(fanout_output_t* output) {
+  output_stream_t* ostream = output->ostream;
+  close_output_stream_file(ostream);
+  debug_msg("Fanout output %d %s closed, packets %" PRIu64 "\n", output->id,
+            ostream->oformat_context->filename, output->packets);
+  close_output_stream(ostream);
+  free_output_stream(ostream);
+}
+
+int write_fanout_output(fanout_output_t* output, const AVStream* src_st, const AVPacket* pkt) {
+  output_stream_t* ostream = output->ostream;
+  bool is_video = src_st->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+  AVStream* st = is_video ? ostream->video_stream : ostream->audio_stream;
+  if (!st) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  // joined mid-stream, nothing before the first key frame can be decoded
+  if (!output->started) {
+    if (ostream->video_stream && (!is_video || !(pkt->flags & AV_PKT_FLAG_KEY))) {
+      return SUCCESS_RESULT_VALUE;
+    }
+    output->started = true;
+  }
+
+  AVPacket ref;
+  av_init_packet(&ref);
+  int ret = av_packet_ref(&ref, pkt);
+  if (ret < 0) {
+    debug_av_perror("av_packet_ref", ret);
+    return ret;
+  }
+
+  av_packet_rescale_ts(&ref, src_st->time_base, st->time_base);
+  ret = is_video ? write_video_frame(ostream, &ref) : write_audio_frame(ostream, &ref);
+  av_free_packet(&ref);
+  output->packets++;
+  return ret;
+}
+
+}  // namespace
+
+output_fanout_t* alloc_output_fanout(output_stream_t* source, size_t writer_queue_size,
+                                     int avio_buffer_size, output_io_backend_t io_backend) {
+  if (!source) {
+    debug_perror("alloc_output_fanout", EINVAL);
+    return NULL;
+  }
+
+  output_fanout_t* fanout = reinterpret_cast<output_fanout_t*>(
+                              calloc(1, sizeof(output_fanout_t)));
+  if (!fanout) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  fanout->source = source;
+  fanout->writer_queue_size = writer_queue_size;
+  fanout->avio_buffer_size = avio_buffer_size;
+  fanout->io_backend = io_backend;
+  pthread_mutex_init(&fanout->lock, NULL);
+  return fanout;
+}
+
+int output_fanout_add(output_fanout_t* fanout, const char* file_path, const char* format_name,
+                      AVDictionary* opt) {
+  if (!fanout || !file_path) {
+    debug_perror("output_fanout_add", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // header written before the output becomes visible to writers
+  output_stream_t* ostream = alloc_output_stream_copy(fanout->source, file_path, format_name, opt,
+                                                      fanout->avio_buffer_size, fanout->io_backend,
+                                                      fanout->writer_queue_size);
+  if (!ostream) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&fanout->lock);
+  fanout_output_t* output = NULL;
+  for (int i = 0; i < OUTPUT_FANOUT_MAX_OUTPUTS; ++i) {
+    if (!fanout->outputs[i].id) {
+      output = &fanout->outputs[i];
+      break;
+    }
+  }
+
+  if (!output) {
+    pthread_mutex_unlock(&fanout->lock);
+    debug_error("Fanout is full, %s not added!\n", file_path);
+    fanout_output_t tmp = {0, ostream, false, 0};
+    close_fanout_output(&tmp);
+    return ERROR_RESULT_VALUE;
+  }
+
+  output->id = ++fanout->last_id;
+  output->ostream = ostream;
+  output->started = false;
+  output->packets = 0;
+  __atomic_add_fetch(&fanout->outputs_count, 1, __ATOMIC_RELAXED);
+  int id = output->id;
+  pthread_mutex_unlock(&fanout->lock);
+
+  debug_msg("Fanout output %d added: %s\n", id, file_path);
+  return id;
+}
+
+int output_fanout_remove(output_fanout_t* fanout, int id) {
+  if (!fanout || id <= 0) {
+    debug_perror("output_fanout_remove", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  fanout_output_t removed = {0, NULL, false, 0};
+  pthread_mutex_lock(&fanout->lock);
+  for (int i = 0; i < OUTPUT_FANOUT_MAX_OUTPUTS; ++i) {
+    if (fanout->outputs[i].id == id) {
+      removed = fanout->outputs[i];
+      fanout->outputs[i].id = 0;
+      fanout->outputs[i].ostream = NULL;
+      __atomic_sub_fetch(&fanout->outputs_count, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&fanout->lock);
+
+  if (!removed.ostream) {
+    debug_perror("output_fanout_remove", ENOENT);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // no writer sees it any more, drain and finish outside the lock
+  close_fanout_output(&removed);
+  return SUCCESS_RESULT_VALUE;
+}
+
+int output_fanout_write(output_fanout_t* fanout, const AVStream* src_st, const AVPacket* pkt) {
+  if (!fanout || !src_st || !pkt) {
+    debug_perror("output_fanout_write", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  if (__atomic_load_n(&fanout->outputs_count, __ATOMIC_RELAXED) == 0) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  int res = SUCCESS_RESULT_VALUE;
+  pthread_mutex_lock(&fanout->lock);
+  for (int i = 0; i < OUTPUT_FANOUT_MAX_OUTPUTS; ++i) {
+    if (fanout->outputs[i].id && write_fanout_output(&fanout->outputs[i], src_st, pkt) < 0) {
+      res = ERROR_RESULT_VALUE;
+    }
+  }
+  pthread_mutex_unlock(&fanout->lock);
+  return res;
+}
+
+int output_fanout_size(output_fanout_t* fanout) {
+  if (!fanout) {
+    debug_perror("output_fanout_size", EINVAL);
+    return 0;
+  }
+
+  return __atomic_load_n(&fanout->outputs_count, __ATOMIC_RELAXED);
+}
+
+void free_output_fanout(output_fanout_t* fanout) {
+  if (!fanout) {
+    debug_perror("free_output_fanout", EINVAL);
+    return;
+  }
+
+  for (int i = 0; i < OUTPUT_FANOUT_MAX_OUTPUTS; ++i) {
+    if (fanout->outputs[i].id) {
+      output_fanout_remove(fanout, fanout->outputs[i].id);
+    }
+  }
+
+  pthread_mutex_destroy(&fanout->lock);
+  free(fanout);
+}
+
+}  // namespace media
+}  // namespace fasto
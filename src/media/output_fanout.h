@@ -0,0 +1,57 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "macros.h"
+
+#include "media/file_writer.h"
+
+#define OUTPUT_FANOUT_MAX_OUTPUTS 8
+
+namespace fasto {
+namespace media {
+
+struct output_stream_t;
+
+typedef struct fanout_output_t {
+  int id;  // 0 - free slot
+  struct output_stream_t* ostream;  // muxer only, streams copied from the source encoders
+  bool started;  // first video key frame passed
+  uint64_t packets;
+} fanout_output_t;
+
+// packets of one encoded output_stream_t muxed into more containers, every output
+// takes a reference to the same packet buffer, outputs come and go while running
+typedef struct output_fanout_t {
+  struct output_stream_t* source;  // not owned
+  size_t writer_queue_size;  // per output, 0 - written in caller thread
+  int avio_buffer_size;
+  output_io_backend_t io_backend;
+
+  pthread_mutex_t lock;
+  fanout_output_t outputs[OUTPUT_FANOUT_MAX_OUTPUTS];
+  int outputs_count;
+  int last_id;
+} output_fanout_t;
+
+output_fanout_t* alloc_output_fanout(struct output_stream_t* source, size_t writer_queue_size,
+                                     int avio_buffer_size, output_io_backend_t io_backend);
+// opens the output and writes its header, returns output id, ERROR_RESULT_VALUE on failure
+int output_fanout_add(output_fanout_t* fanout, const char* file_path, const char* format_name,
+                      AVDictionary* opt);
+// flushes queued packets and writes the trailer
+int output_fanout_remove(output_fanout_t* fanout, int id);
+// refs pkt (stream time base of src_st) into every output, pkt stays owned by caller
+int output_fanout_write(output_fanout_t* fanout, const AVStream* src_st, const AVPacket* pkt);
+int output_fanout_size(output_fanout_t* fanout);
+void free_output_fanout(output_fanout_t* fanout);  // removes all outputs
+
+}  // namespace media
+}  // namespace fasto
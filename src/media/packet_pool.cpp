@@ -0,0 +1,118 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/packet_pool.h"
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+#include "log.h"
+
+#include "media/ffmpeg_utils.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+AVBufferRef* packet_pool_alloc(void* opaque, int size) {
+  packet_pool_t* pool = reinterpret_cast<packet_pool_t*>(opaque);
+  __atomic_add_fetch(&pool->allocated, 1, __ATOMIC_RELAXED);
+  return av_buffer_alloc(size);
+}
+
+}  // namespace
+
+packet_pool_t* alloc_packet_pool(int buffer_size) {
+  if (buffer_size <= 0) {
+    debug_perror("alloc_packet_pool", EINVAL);
+    return NULL;
+  }
+
+  packet_pool_t* pool = reinterpret_cast<packet_pool_t*>(calloc(1, sizeof(packet_pool_t)));
+  if (!pool) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  pool->buffer_size = buffer_size;
+  pool->pool = av_buffer_pool_init2(buffer_size + FF_INPUT_BUFFER_PADDING_SIZE, pool,
+                                    packet_pool_alloc, NULL);
+  if (!pool->pool) {
+    debug_perror("av_buffer_pool_init2", ENOMEM);
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+AVBufferRef* packet_pool_get_buffer(packet_pool_t* pool, int size) {
+  if (!pool || size < 0) {
+    debug_perror("packet_pool_get_buffer", EINVAL);
+    return NULL;
+  }
+
+  AVBufferRef* buf = NULL;
+  if (size > pool->buffer_size) {
+    __atomic_add_fetch(&pool->oversized, 1, __ATOMIC_RELAXED);
+    buf = av_buffer_alloc(size + FF_INPUT_BUFFER_PADDING_SIZE);
+  } else {
+    __atomic_add_fetch(&pool->gets, 1, __ATOMIC_RELAXED);
+    buf = av_buffer_pool_get(pool->pool);
+  }
+
+  if (!buf) {
+    debug_perror("packet_pool_get_buffer", ENOMEM);
+    return NULL;
+  }
+
+  memset(buf->data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+  return buf;
+}
+
+int packet_pool_get_packet(packet_pool_t* pool, int size, AVPacket* pkt) {
+  if (!pkt) {
+    debug_perror("packet_pool_get_packet", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  AVBufferRef* buf = packet_pool_get_buffer(pool, size);
+  if (!buf) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  av_init_packet(pkt);
+  pkt->buf = buf;
+  pkt->data = buf->data;
+  pkt->size = size;
+  return SUCCESS_RESULT_VALUE;
+}
+
+void packet_pool_get_stats(packet_pool_t* pool, packet_pool_stats_t* stats) {
+  if (!pool || !stats) {
+    debug_perror("packet_pool_get_stats", EINVAL);
+    return;
+  }
+
+  uint64_t gets = __atomic_load_n(&pool->gets, __ATOMIC_RELAXED);
+  uint64_t allocated = __atomic_load_n(&pool->allocated, __ATOMIC_RELAXED);
+  uint64_t oversized = __atomic_load_n(&pool->oversized, __ATOMIC_RELAXED);
+  stats->hits = gets > allocated ? gets - allocated : 0;
+  stats->misses = allocated + oversized;
+  stats->high_water = allocated;
+}
+
+void free_packet_pool(packet_pool_t* pool) {
+  if (!pool) {
+    debug_perror("free_packet_pool", EINVAL);
+    return;
+  }
+
+  // buffers still referenced by packets keep the pool alive until they are freed
+  av_buffer_pool_uninit(&pool->pool);
+  free(pool);
+}
+
+}  // namespace media
+}  // namespace fasto
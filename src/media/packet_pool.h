@@ -0,0 +1,43 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "macros.h"
+
+struct AVBufferPool;
+
+namespace fasto {
+namespace media {
+
+typedef struct packet_pool_stats_t {
+  uint64_t hits;  // buffer reused from the pool
+  uint64_t misses;  // pool allocated a new buffer, or packet did not fit
+  uint64_t high_water;  // buffers allocated by the pool, most packets alive at once
+} packet_pool_stats_t;
+
+// refcounted packet buffers of one size, AVBufferPool returns them on av_free_packet,
+// safe to get and free packets from different threads
+typedef struct packet_pool_t {
+  struct AVBufferPool* pool;
+  int buffer_size;  // payload, padding not included
+
+  uint64_t gets;
+  uint64_t allocated;
+  uint64_t oversized;
+} packet_pool_t;
+
+packet_pool_t* alloc_packet_pool(int buffer_size);
+// buffer of at least size + padding, padding zeroed, falls back to av_buffer_alloc if size
+// exceeds buffer_size
+AVBufferRef* packet_pool_get_buffer(packet_pool_t* pool, int size);
+// av_init_packet, data/size point into a pooled buffer
+int packet_pool_get_packet(packet_pool_t* pool, int size, AVPacket* pkt);
+void packet_pool_get_stats(packet_pool_t* pool, packet_pool_stats_t* stats);
+void free_packet_pool(packet_pool_t* pool);
+
+}  // namespace media
+}  // namespace fasto
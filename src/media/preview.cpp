@@ -0,0 +1,153 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/preview.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+
+#define PREVIEW_WAIT_KEY_MSEC 1
+#define PREVIEW_EVENTS_MSEC 30  // window events handled at least that often without frames
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void deadline_after_msec(struct timespec* ts, long msec) {
+  clock_gettime(CLOCK_REALTIME, ts);
+  ts->tv_sec += msec / 1000;
+  ts->tv_nsec += (msec % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+void* preview_thread_routine(void* arg) {
+  preview_t* preview = reinterpret_cast<preview_t*>(arg);
+
+  // window is created, drawn and polled by this thread only
+  cv::namedWindow(preview->title, cv::WINDOW_AUTOSIZE);
+  cv::Mat frame;
+  cv::Mat scaled;
+  while (true) {
+    pthread_mutex_lock(&preview->lock);
+    // sparse frames (every_nth at a low fps) must not starve the window of its events
+    if (preview->slot.empty() && !preview->stopping) {
+      struct timespec deadline;
+      deadline_after_msec(&deadline, PREVIEW_EVENTS_MSEC);
+      pthread_cond_timedwait(&preview->cond, &preview->lock, &deadline);
+    }
+    if (preview->stopping) {
+      pthread_mutex_unlock(&preview->lock);
+      break;
+    }
+    frame = preview->slot;
+    preview->slot.release();
+    pthread_mutex_unlock(&preview->lock);
+
+    if (!frame.empty()) {
+      if (frame.cols > preview->width) {
+        cv::resize(frame, scaled,
+                   cv::Size(preview->width, frame.rows * preview->width / frame.cols),
+                   0, 0, cv::INTER_AREA);
+        cv::imshow(preview->title, scaled);
+      } else {
+        cv::imshow(preview->title, frame);
+      }
+      frame.release();  // capture buffer back to its owner before waiting
+      preview->frames_shown++;
+    }
+
+    // redraws, window manager pings and key presses, on every wakeup
+    if (cv::waitKey(PREVIEW_WAIT_KEY_MSEC) >= 0) {
+      __atomic_store_n(&preview->quit, 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  cv::destroyWindow(preview->title);
+  return NULL;
+}
+
+}  // namespace
+
+preview_t* alloc_preview(const char* title, uint32_t every_nth, int width) {
+  if (!title || every_nth == 0 || width < 0) {
+    debug_perror("alloc_preview", EINVAL);
+    return NULL;
+  }
+
+  preview_t* preview = reinterpret_cast<preview_t*>(calloc(1, sizeof(preview_t)));
+  if (!preview) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  new (&preview->slot) cv::Mat();
+  preview->title = title;
+  preview->every_nth = every_nth;
+  preview->width = width ? width : PREVIEW_DEFAULT_WIDTH;
+  pthread_mutex_init(&preview->lock, NULL);
+  pthread_cond_init(&preview->cond, NULL);
+
+  int err = pthread_create(&preview->tid, NULL, preview_thread_routine, preview);
+  if (err) {
+    debug_perror("pthread_create", err);
+    pthread_cond_destroy(&preview->cond);
+    pthread_mutex_destroy(&preview->lock);
+    preview->slot.~Mat();
+    free(preview);
+    return NULL;
+  }
+
+  return preview;
+}
+
+void preview_offer(preview_t* preview, const cv::Mat* mat) {
+  if (!preview || !mat || mat->empty()) {
+    return;
+  }
+
+  if (preview->frames_offered++ % preview->every_nth) {
+    return;
+  }
+
+  // the window thread holds the lock only to swap the slot, busy means skip this one
+  if (pthread_mutex_trylock(&preview->lock)) {
+    return;
+  }
+  preview->slot = *mat;
+  pthread_cond_signal(&preview->cond);
+  pthread_mutex_unlock(&preview->lock);
+}
+
+bool preview_quit_requested(preview_t* preview) {
+  return preview && __atomic_load_n(&preview->quit, __ATOMIC_ACQUIRE);
+}
+
+void free_preview(preview_t* preview) {
+  if (!preview) {
+    debug_perror("free_preview", EINVAL);
+    return;
+  }
+
+  pthread_mutex_lock(&preview->lock);
+  preview->stopping = true;
+  pthread_cond_signal(&preview->cond);
+  pthread_mutex_unlock(&preview->lock);
+  pthread_join(preview->tid, NULL);
+
+  debug_msg("Preview: %" PRIu64 " frames offered, %" PRIu64 " shown\n",
+            preview->frames_offered, preview->frames_shown);
+  pthread_cond_destroy(&preview->cond);
+  pthread_mutex_destroy(&preview->lock);
+  preview->slot.~Mat();
+  free(preview);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,42 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "macros.h"
+
+#define PREVIEW_DEFAULT_WIDTH 640
+
+namespace fasto {
+namespace media {
+
+// window on its own thread showing the newest offered frame, older ones are skipped
+typedef struct preview_t {
+  uint32_t every_nth;
+  int width;  // shown width, aspect kept, never upscaled
+  const char* title;
+
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  cv::Mat slot;  // latest frame wins, referenced not copied
+  bool stopping;
+  int quit;  // key pressed in the window
+
+  uint64_t frames_offered;
+  uint64_t frames_shown;
+} preview_t;
+
+preview_t* alloc_preview(const char* title, uint32_t every_nth, int width);  // width 0 - default
+/* every_nth frame is referenced for the window and the call returns at once, never
+ * waiting for the window thread; do not write into mat afterwards, read the next
+ * frame into a new Mat */
+void preview_offer(preview_t* preview, const cv::Mat* mat);
+bool preview_quit_requested(preview_t* preview);  // any key in the window
+void free_preview(preview_t* preview);
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,353 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/recorder.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+#include "media/stream_stats.h"
+
+#include "utils/spsc_queue.h"
+#include "utils/time_utils.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+recorder_stream_t* find_stream(recorder_t* recorder, int id) {
+  if (!recorder || id < 0 || static_cast<size_t>(id) >= recorder->max_streams) {
+    return NULL;
+  }
+
+  return __atomic_load_n(&recorder->streams[id], __ATOMIC_ACQUIRE);
+}
+
+void schedule_stream(recorder_stream_t* rstream) {
+  if (!__atomic_exchange_n(&rstream->scheduled, 1, __ATOMIC_SEQ_CST)) {
+    utils::executor_submit(rstream->recorder->executor, &rstream->task);
+  }
+}
+
+// a quantum of the camera's frames, then the worker is free for the next camera
+void run_stream(void* arg) {
+  recorder_stream_t* rstream = reinterpret_cast<recorder_stream_t*>(arg);
+  uint64_t start_ns = utils::currentns();
+
+  pthread_mutex_lock(&rstream->lock);
+  for (int i = 0; i < RECORDER_QUANTUM_FRAMES; ++i) {
+    void* item = NULL;
+    if (utils::spsc_queue_pop(rstream->ready_slots, &item) == ERROR_RESULT_VALUE) {
+      break;
+    }
+
+    recorder_frame_slot_t* slot = reinterpret_cast<recorder_frame_slot_t*>(item);
+    utils::histogram_record(&rstream->wait_ns, utils::currentns() - slot->queued_ns);
+    // convert, encode and mux in place, failures are counted by the stream stats
+    write_video_frame_to_media_stream(rstream->stream, &slot->mat);
+    __atomic_add_fetch(&rstream->frames_encoded, 1, __ATOMIC_RELAXED);
+    utils::spsc_queue_push(rstream->free_slots, slot);
+  }
+
+  __atomic_add_fetch(&rstream->busy_ns, utils::currentns() - start_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&rstream->batches, 1, __ATOMIC_RELAXED);
+
+  /* pairs with the push and exchange in recorder_write_video_frame:
+   * either we see the new frame or the writer sees scheduled cleared */
+  __atomic_store_n(&rstream->scheduled, 0, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bool more = utils::spsc_queue_size(rstream->ready_slots) != 0;
+  if (!more) {
+    pthread_cond_broadcast(&rstream->drained);
+  }
+  pthread_mutex_unlock(&rstream->lock);
+
+  if (more) {
+    schedule_stream(rstream);  // to the back of the queue, other cameras go first
+  }
+}
+
+void free_recorder_stream(recorder_stream_t* rstream) {
+  if (rstream->slots) {
+    for (size_t i = 0; i < rstream->depth; ++i) {
+      rstream->slots[i].~recorder_frame_slot_t();
+    }
+    free(rstream->slots);
+    rstream->slots = NULL;
+  }
+
+  if (rstream->free_slots) {
+    utils::free_spsc_queue(rstream->free_slots);
+    rstream->free_slots = NULL;
+  }
+  if (rstream->ready_slots) {
+    utils::free_spsc_queue(rstream->ready_slots);
+    rstream->ready_slots = NULL;
+  }
+
+  if (rstream->stream) {
+    free_video_stream(rstream->stream);
+    rstream->stream = NULL;
+  }
+
+  pthread_cond_destroy(&rstream->drained);
+  pthread_mutex_destroy(&rstream->lock);
+  free(rstream);
+}
+
+recorder_stream_t* alloc_recorder_stream(recorder_t* recorder, recorder_priority_t priority,
+                                         size_t depth) {
+  recorder_stream_t* rstream = reinterpret_cast<recorder_stream_t*>(
+                                 calloc(1, sizeof(recorder_stream_t)));
+  if (!rstream) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  rstream->recorder = recorder;
+  rstream->priority = priority;
+  rstream->depth = depth;
+  rstream->task.run = run_stream;
+  rstream->task.arg = rstream;
+  rstream->task.priority = priority == RECORDER_PRIORITY_LIVE ? utils::EXECUTOR_PRIORITY_HIGH :
+                                                                utils::EXECUTOR_PRIORITY_LOW;
+  pthread_mutex_init(&rstream->lock, NULL);
+  pthread_cond_init(&rstream->drained, NULL);
+
+  rstream->free_slots = utils::alloc_spsc_queue(depth);
+  rstream->ready_slots = utils::alloc_spsc_queue(depth);
+  rstream->slots = reinterpret_cast<recorder_frame_slot_t*>(
+                     calloc(depth, sizeof(recorder_frame_slot_t)));
+  if (!rstream->free_slots || !rstream->ready_slots || !rstream->slots) {
+    debug_perror("alloc_recorder_stream", ENOMEM);
+    free_recorder_stream(rstream);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < depth; ++i) {
+    new (&rstream->slots[i]) recorder_frame_slot_t();
+    utils::spsc_queue_push(rstream->free_slots, &rstream->slots[i]);
+  }
+
+  return rstream;
+}
+
+}  // namespace
+
+recorder_t* alloc_recorder(size_t max_streams, size_t thread_count) {
+  if (max_streams == 0) {
+    debug_perror("alloc_recorder", EINVAL);
+    return NULL;
+  }
+
+  recorder_t* recorder = reinterpret_cast<recorder_t*>(calloc(1, sizeof(recorder_t)));
+  if (!recorder) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  recorder->streams = reinterpret_cast<recorder_stream_t**>(
+                        calloc(max_streams, sizeof(recorder_stream_t*)));
+  if (!recorder->streams) {
+    debug_perror("calloc", ENOMEM);
+    free(recorder);
+    return NULL;
+  }
+
+  recorder->executor = utils::alloc_executor(thread_count);
+  if (!recorder->executor) {
+    free(recorder->streams);
+    free(recorder);
+    return NULL;
+  }
+
+  recorder->max_streams = max_streams;
+  pthread_mutex_init(&recorder->lock, NULL);
+  debug_msg("Recorder for %zu cameras on %zu threads\n", max_streams,
+            utils::executor_thread_count(recorder->executor));
+  return recorder;
+}
+
+int recorder_add_stream(recorder_t* recorder, const char* path, media_stream_params_t* params,
+                        recorder_priority_t priority, size_t queue_depth) {
+  if (!recorder || !path || !params) {
+    debug_perror("recorder_add_stream", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // parallelism comes from the executor running cameras side by side
+  media_stream_params_t stream_params = *params;
+  stream_params.video_thread_count = 1;
+  stream_params.video_cpu_mask = 0;
+  stream_params.pipeline_depth = 0;
+  stream_params.muxer_queue_size = 0;
+
+  recorder_stream_t* rstream = alloc_recorder_stream(recorder, priority,
+                                                     queue_depth ? queue_depth :
+                                                                   RECORDER_DEFAULT_QUEUE_DEPTH);
+  if (!rstream) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  rstream->stream = alloc_video_stream(path, &stream_params);
+  if (!rstream->stream) {
+    free_recorder_stream(rstream);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&recorder->lock);
+  int id = ERROR_RESULT_VALUE;
+  for (size_t i = 0; i < recorder->max_streams; ++i) {
+    if (!recorder->streams[i]) {
+      id = static_cast<int>(i);
+      rstream->id = id;
+      __atomic_store_n(&recorder->streams[i], rstream, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&recorder->lock);
+
+  if (id == ERROR_RESULT_VALUE) {
+    debug_error("recorder is full, %zu cameras at most\n", recorder->max_streams);
+    free_recorder_stream(rstream);
+  }
+  return id;
+}
+
+int recorder_write_video_frame(recorder_t* recorder, int id, const cv::Mat* mat) {
+  recorder_stream_t* rstream = find_stream(recorder, id);
+  if (!rstream || !mat || mat->empty()) {
+    debug_perror("recorder_write_video_frame", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  void* item = NULL;
+  if (utils::spsc_queue_pop(rstream->free_slots, &item) == ERROR_RESULT_VALUE) {
+    __atomic_add_fetch(&rstream->frames_dropped, 1, __ATOMIC_RELAXED);
+    stream_stats_dropped(rstream->stream->stats);
+    return ERROR_RESULT_VALUE;
+  }
+
+  recorder_frame_slot_t* slot = reinterpret_cast<recorder_frame_slot_t*>(item);
+  mat->copyTo(slot->mat);  // buffer reused while the size stays
+  slot->queued_ns = utils::currentns();
+  utils::spsc_queue_push(rstream->ready_slots, slot);
+  __atomic_add_fetch(&rstream->frames_queued, 1, __ATOMIC_RELAXED);
+  schedule_stream(rstream);
+  return SUCCESS_RESULT_VALUE;
+}
+
+int recorder_write_audio_samples(recorder_t* recorder, int id, const uint8_t* const* data,
+                                 int nb_samples) {
+  recorder_stream_t* rstream = find_stream(recorder, id);
+  if (!rstream || !data) {
+    debug_perror("recorder_write_audio_samples", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&rstream->lock);
+  int res = write_audio_samples_to_media_stream(rstream->stream, data, nb_samples);
+  pthread_mutex_unlock(&rstream->lock);
+  return res;
+}
+
+int recorder_get_stream_stats(recorder_t* recorder, int id, recorder_stream_stats_t* stats) {
+  if (!recorder || !stats) {
+    debug_perror("recorder_get_stream_stats", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // the table lock keeps recorder_remove_stream from freeing the stream meanwhile
+  pthread_mutex_lock(&recorder->lock);
+  recorder_stream_t* rstream = find_stream(recorder, id);
+  if (!rstream) {
+    pthread_mutex_unlock(&recorder->lock);
+    debug_perror("recorder_get_stream_stats", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  stats->priority = rstream->priority;
+  stats->frames_queued = __atomic_load_n(&rstream->frames_queued, __ATOMIC_RELAXED);
+  stats->frames_dropped = __atomic_load_n(&rstream->frames_dropped, __ATOMIC_RELAXED);
+  stats->frames_encoded = __atomic_load_n(&rstream->frames_encoded, __ATOMIC_RELAXED);
+  stats->batches = __atomic_load_n(&rstream->batches, __ATOMIC_RELAXED);
+  stats->busy_ns = __atomic_load_n(&rstream->busy_ns, __ATOMIC_RELAXED);
+  stats->wait_p50_ns = utils::histogram_percentile(&rstream->wait_ns, 50.0);
+  stats->wait_p99_ns = utils::histogram_percentile(&rstream->wait_ns, 99.0);
+  stats->wait_max_ns = utils::histogram_max(&rstream->wait_ns);
+
+  uint64_t total_busy_ns = 0;
+  for (size_t i = 0; i < recorder->max_streams; ++i) {
+    if (recorder->streams[i]) {
+      total_busy_ns += __atomic_load_n(&recorder->streams[i]->busy_ns, __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&recorder->lock);
+  stats->busy_share = total_busy_ns ? static_cast<double>(stats->busy_ns) / total_busy_ns : 0.0;
+  return SUCCESS_RESULT_VALUE;
+}
+
+media_stream_t* recorder_get_stream(recorder_t* recorder, int id) {
+  recorder_stream_t* rstream = find_stream(recorder, id);
+  return rstream ? rstream->stream : NULL;
+}
+
+int recorder_remove_stream(recorder_t* recorder, int id) {
+  if (!recorder) {
+    debug_perror("recorder_remove_stream", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // looked up and cleared in one go, stats readers hold the same lock
+  pthread_mutex_lock(&recorder->lock);
+  recorder_stream_t* rstream = find_stream(recorder, id);
+  if (rstream) {
+    __atomic_store_n(&recorder->streams[id], static_cast<recorder_stream_t*>(NULL),
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&recorder->lock);
+  if (!rstream) {
+    debug_perror("recorder_remove_stream", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&rstream->lock);
+  while (__atomic_load_n(&rstream->scheduled, __ATOMIC_SEQ_CST) ||
+         utils::spsc_queue_size(rstream->ready_slots)) {
+    pthread_cond_wait(&rstream->drained, &rstream->lock);
+  }
+  pthread_mutex_unlock(&rstream->lock);
+
+  debug_msg("Recorder camera %d (%s): queued %" PRIu64 ", encoded %" PRIu64
+            ", dropped %" PRIu64 ", %" PRIu64 " batches, busy %.1f ms, wait p99 %.1f ms\n",
+            id, rstream->priority == RECORDER_PRIORITY_LIVE ? "live" : "archive",
+            rstream->frames_queued, rstream->frames_encoded, rstream->frames_dropped,
+            rstream->batches, rstream->busy_ns / 1e6,
+            utils::histogram_percentile(&rstream->wait_ns, 99.0) / 1e6);
+  free_recorder_stream(rstream);
+  return SUCCESS_RESULT_VALUE;
+}
+
+void free_recorder(recorder_t* recorder) {
+  if (!recorder) {
+    debug_perror("free_recorder", EINVAL);
+    return;
+  }
+
+  for (size_t i = 0; i < recorder->max_streams; ++i) {
+    if (recorder->streams[i]) {
+      recorder_remove_stream(recorder, static_cast<int>(i));
+    }
+  }
+
+  utils::free_executor(recorder->executor);
+  pthread_mutex_destroy(&recorder->lock);
+  free(recorder->streams);
+  free(recorder);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,107 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "macros.h"
+
+#include "media/media_stream_output.h"
+
+#include "utils/executor.h"
+#include "utils/histogram.h"
+
+#define RECORDER_DEFAULT_QUEUE_DEPTH 4  // frames copied and waiting per camera
+#define RECORDER_QUANTUM_FRAMES 2  // frames a camera encodes before its worker moves on
+
+namespace fasto {
+namespace utils {
+struct spsc_queue_t;
+}  // namespace utils
+
+namespace media {
+
+struct recorder_t;
+
+typedef enum recorder_priority_t {
+  RECORDER_PRIORITY_LIVE = 0,  // watched now, served first
+  RECORDER_PRIORITY_ARCHIVE  // gets a turn after EXECUTOR_HIGH_BURST live batches
+} recorder_priority_t;
+
+typedef struct recorder_frame_slot_t {
+  cv::Mat mat;  // copy of the captured frame, buffer reused
+  uint64_t queued_ns;
+} recorder_frame_slot_t;
+
+// one camera: frames queued by its capture thread, encoded and muxed in order by
+// whichever worker picks the camera up, at most one at a time
+typedef struct recorder_stream_t {
+  struct recorder_t* recorder;
+  int id;
+  media_stream_t* stream;
+  recorder_priority_t priority;
+
+  utils::executor_task_t task;
+  int scheduled;  // task submitted or running
+  pthread_mutex_t lock;  // media stream, video on a worker vs audio in caller
+  pthread_cond_t drained;
+
+  size_t depth;
+  recorder_frame_slot_t* slots;
+  struct utils::spsc_queue_t* free_slots;  // worker -> capture
+  struct utils::spsc_queue_t* ready_slots;  // capture -> worker
+
+  uint64_t frames_queued;
+  uint64_t frames_dropped;  // no free slot
+  uint64_t frames_encoded;
+  uint64_t batches;
+  uint64_t busy_ns;  // worker time spent on this camera
+  utils::histogram_t wait_ns;  // queued -> picked by a worker
+} recorder_stream_t;
+
+typedef struct recorder_stream_stats_t {
+  recorder_priority_t priority;
+  uint64_t frames_queued;
+  uint64_t frames_dropped;
+  uint64_t frames_encoded;
+  uint64_t batches;
+  uint64_t busy_ns;
+  double busy_share;  // of the worker time all cameras used
+  uint64_t wait_p50_ns;
+  uint64_t wait_p99_ns;
+  uint64_t wait_max_ns;
+} recorder_stream_stats_t;
+
+// cameras recorded on one shared executor instead of threads of their own
+typedef struct recorder_t {
+  utils::executor_t* executor;
+  size_t max_streams;
+  recorder_stream_t** streams;  // by id, NULL - free
+  pthread_mutex_t lock;  // streams table
+} recorder_t;
+
+recorder_t* alloc_recorder(size_t max_streams, size_t thread_count);  // 0 threads - per cpu
+/* opens the file like alloc_video_stream with encoder threads, pipeline and muxer thread
+ * turned off (the executor replaces them), queue_depth 0 - default, returns id or
+ * ERROR_RESULT_VALUE */
+int recorder_add_stream(recorder_t* recorder, const char* path, media_stream_params_t* params,
+                        recorder_priority_t priority, size_t queue_depth);
+// copies mat and returns at once, ERROR_RESULT_VALUE if the camera's queue is full
+// (frame dropped); one capture thread per camera
+int recorder_write_video_frame(recorder_t* recorder, int id, const cv::Mat* mat);
+// encoded in the caller thread, waits while a worker holds the camera
+int recorder_write_audio_samples(recorder_t* recorder, int id, const uint8_t* const* data,
+                                 int nb_samples);
+// safe against a concurrent recorder_remove_stream, ERROR_RESULT_VALUE once id is removed
+int recorder_get_stream_stats(recorder_t* recorder, int id, recorder_stream_stats_t* stats);
+// the pointer is freed by recorder_remove_stream, not to be used past it
+media_stream_t* recorder_get_stream(recorder_t* recorder, int id);
+/* queued frames are encoded, then the file is closed; the write calls and
+ * recorder_get_stream for id must not run meanwhile or after it */
+int recorder_remove_stream(recorder_t* recorder, int id);
+void free_recorder(recorder_t* recorder);  // removes every stream
+
+}  // namespace media
+}  // namespace fasto
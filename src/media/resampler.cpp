@@ -4,6 +4,9 @@
 
 #include "log.h"
 
+#include "media/audio_accumulator.h"
+#include "media/ffmpeg_utils.h"
+
 namespace fasto {
 namespace media {
 
@@ -48,10 +51,18 @@ resampler_t* alloc_resampler(AVCodecContext *outctx, int src_rate, enum AVSample
 
     if (swr_init(resampler->swr_ctx) < 0) {
         debug_msg("fe_resample_open: Can't init convertor\n");
-        free(resampler);
+        free_resampler(resampler);
         return NULL;
     }
 
+    if (outctx->codec_type == AVMEDIA_TYPE_AUDIO) {
+        resampler->accumulator = alloc_audio_accumulator(outctx);
+        if (!resampler->accumulator) {
+            free_resampler(resampler);
+            return NULL;
+        }
+    }
+
     return resampler;
 }
 
@@ -91,6 +102,73 @@ int resampler_convert(resampler_t *resampler, uint8_t **out, int out_count,
     return ret;
 }
 
+int resampler_convert_stream(resampler_t *resampler, const uint8_t **in, int in_count,
+                             uint8_t ***out) {
+    if (!resampler || !out || in_count < 0 || (!in && in_count)) {
+        debug_perror("resampler_convert_stream", EINVAL);
+        return ERROR_RESULT_VALUE;
+    }
+
+    int64_t delay = swr_get_delay(resampler->swr_ctx, resampler->src_rate);
+    int needed = av_rescale_rnd(delay + in_count, resampler->dst_rate, resampler->src_rate,
+                                AV_ROUND_UP);
+    if (needed > resampler->stream_capacity) {
+        int dst_nb_channels = av_get_channel_layout_nb_channels(resampler->dst_ch_layout);
+        int capacity = FFMAX(needed, resampler->stream_capacity * 3 / 2);
+        int ret = 0;
+        if (!resampler->stream_data) {
+            ret = av_samples_alloc_array_and_samples(&resampler->stream_data,
+                                                     &resampler->stream_linesize,
+                                                     dst_nb_channels, capacity,
+                                                     resampler->dst_fmt, 0);
+        } else {
+            av_freep(&resampler->stream_data[0]);
+            ret = av_samples_alloc(resampler->stream_data, &resampler->stream_linesize,
+                                   dst_nb_channels, capacity, resampler->dst_fmt, 0);
+        }
+        if (ret < 0) {
+            debug_av_perror("av_samples_alloc", ret);
+            resampler->stream_capacity = 0;
+            return ERROR_RESULT_VALUE;
+        }
+        resampler->stream_capacity = capacity;
+    }
+
+    int ret = swr_convert(resampler->swr_ctx, resampler->stream_data, resampler->stream_capacity,
+                          in, in_count);
+    if (ret < 0) {
+        debug_av_perror("swr_convert", ret);
+        return ERROR_RESULT_VALUE;
+    }
+
+    *out = resampler->stream_data;
+    return ret;
+}
+
+int resampler_send_samples(resampler_t *resampler, const uint8_t **in, int in_count) {
+    if (!resampler || !resampler->accumulator) {
+        debug_perror("resampler_send_samples", EINVAL);
+        return ERROR_RESULT_VALUE;
+    }
+
+    uint8_t **out = NULL;
+    int count = resampler_convert_stream(resampler, in, in_count, &out);
+    if (count == ERROR_RESULT_VALUE) {
+        return ERROR_RESULT_VALUE;
+    }
+
+    return audio_accumulator_write(resampler->accumulator, out, count);
+}
+
+AVFrame* resampler_receive_frame(resampler_t *resampler, bool flush) {
+    if (!resampler || !resampler->accumulator) {
+        debug_perror("resampler_receive_frame", EINVAL);
+        return NULL;
+    }
+
+    return audio_accumulator_next_frame(resampler->accumulator, flush);
+}
+
 void free_resampler(resampler_t *resampler) {
     if (!resampler) {
         debug_perror("free_resampler", EINVAL);
@@ -100,6 +178,14 @@ void free_resampler(resampler_t *resampler) {
     if (resampler->swr_ctx) {
         swr_free(&resampler->swr_ctx);
     }
+    if (resampler->stream_data) {
+        av_freep(&resampler->stream_data[0]);
+        av_freep(&resampler->stream_data);
+    }
+    if (resampler->accumulator) {
+        free_audio_accumulator(resampler->accumulator);
+        resampler->accumulator = NULL;
+    }
     free(resampler);
 }
 
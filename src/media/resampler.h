@@ -12,6 +12,8 @@ extern "C" {
 namespace fasto {
 namespace media {
 
+struct audio_accumulator_t;
+
 typedef struct resampler_t {
   SwrContext *swr_ctx;
 
@@ -25,6 +27,12 @@ typedef struct resampler_t {
   uint64_t dst_ch_layout;
   int dst_nb_samples;
   int dst_linesize;
+
+  // streaming mode
+  uint8_t **stream_data;  // owned output, grown to the largest chunk then reused
+  int stream_capacity;  // samples per channel
+  int stream_linesize;
+  struct audio_accumulator_t* accumulator;  // NULL unless outctx is an audio encoder
 } resampler_t;
 
 resampler_t* alloc_resampler(AVCodecContext *outctx, int src_rate, enum AVSampleFormat src_fmt,
@@ -32,6 +40,17 @@ resampler_t* alloc_resampler(AVCodecContext *outctx, int src_rate, enum AVSample
 int resampler_alloc_array_and_samples(resampler_t *resampler, uint8_t ***dst_data);
 int resampler_convert(resampler_t *resampler, uint8_t **out, int out_count,
                       const uint8_t **in , int in_count);
+
+/* streaming mode: any in_count per call, samples delayed inside swr accounted for,
+ * in NULL drains them at the end of stream; *out points into the resampler buffer,
+ * valid until the next call; returns samples per channel in *out */
+int resampler_convert_stream(resampler_t *resampler, const uint8_t **in, int in_count,
+                             uint8_t ***out);
+// resampled into encoder frames, in NULL drains swr
+int resampler_send_samples(resampler_t *resampler, const uint8_t **in, int in_count);
+/* next frame of the encoder frame_size with pts in samples, NULL if not enough buffered,
+ * flush - also the last partial frame; frame valid until the next call */
+AVFrame* resampler_receive_frame(resampler_t *resampler, bool flush);
 void free_resampler(resampler_t *resampler);
 
 }  // namespace media
@@ -0,0 +1,243 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/segment_rotator.h"
+
+#include "log.h"
+
+#include "media/codec_holder.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void finish_segment(segment_t* segment) {
+  output_stream_t* ostream = segment->ostream;
+  debug_msg("Segment %s finished\n", ostream->oformat_context->filename);
+  close_output_stream_file(ostream);
+  close_output_stream(ostream);
+  free_output_stream(ostream);
+  segment->ostream = NULL;
+}
+
+void* rotator_thread_routine(void* arg) {
+  segment_rotator_t* rotator = reinterpret_cast<segment_rotator_t*>(arg);
+
+  pthread_mutex_lock(&rotator->lock);
+  while (true) {
+    while (!rotator->open_requested && !rotator->finishing.ostream &&
+           !rotator->source_finishing && !rotator->closed) {
+      pthread_cond_wait(&rotator->cond, &rotator->lock);
+    }
+
+    if (rotator->finishing.ostream) {
+      segment_t finishing = rotator->finishing;
+      rotator->finishing.ostream = NULL;
+      pthread_mutex_unlock(&rotator->lock);
+      finish_segment(&finishing);
+      pthread_mutex_lock(&rotator->lock);
+      pthread_cond_broadcast(&rotator->cond);
+      continue;
+    }
+
+    if (rotator->source_finishing) {
+      pthread_mutex_unlock(&rotator->lock);
+      // source is not written any more, encoders stay with its streams
+      debug_msg("Segment %s finished\n", rotator->source->oformat_context->filename);
+      close_output_stream_file(rotator->source);
+      pthread_mutex_lock(&rotator->lock);
+      rotator->source_finishing = false;
+      pthread_cond_broadcast(&rotator->cond);
+      continue;
+    }
+
+    if (rotator->closed) {
+      break;
+    }
+
+    char file_path[PATH_MAX];
+    strncpy(file_path, rotator->next_path, sizeof(file_path));
+    pthread_mutex_unlock(&rotator->lock);
+
+    output_stream_t* ostream = alloc_output_stream_copy(rotator->source, file_path, NULL, NULL,
+                                                        rotator->avio_buffer_size,
+                                                        rotator->io_backend,
+                                                        rotator->writer_queue_size);
+    if (!ostream) {
+      debug_error("Segment %s not opened, current file continues!\n", file_path);
+    }
+
+    pthread_mutex_lock(&rotator->lock);
+    rotator->open_requested = false;
+    rotator->pending.ostream = ostream;
+    rotator->pending.start_ts = AV_NOPTS_VALUE;
+    if (ostream) {
+      // encoded streams need not wait for the next gop
+      request_video_key_frame(rotator->source);
+    }
+  }
+  pthread_mutex_unlock(&rotator->lock);
+
+  return NULL;
+}
+
+void write_segment(segment_t* segment, const AVStream* src_st, const AVPacket* pkt,
+                   AVRational start_time_base) {
+  output_stream_t* ostream = segment->ostream;
+  bool is_video = src_st->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+  AVStream* st = is_video ? ostream->video_stream : ostream->audio_stream;
+  if (!st) {
+    return;
+  }
+
+  AVPacket ref;
+  av_init_packet(&ref);
+  int ret = av_packet_ref(&ref, pkt);
+  if (ret < 0) {
+    debug_av_perror("av_packet_ref", ret);
+    return;
+  }
+
+  // every segment starts at zero
+  int64_t start = av_rescale_q(segment->start_ts, start_time_base, src_st->time_base);
+  if (ref.dts != AV_NOPTS_VALUE) {
+    if (ref.dts < start) {  // audio slightly older than the key frame
+      av_free_packet(&ref);
+      return;
+    }
+    ref.dts -= start;
+  }
+  if (ref.pts != AV_NOPTS_VALUE) {
+    ref.pts -= start;
+  }
+
+  av_packet_rescale_ts(&ref, src_st->time_base, st->time_base);
+  if (is_video) {
+    write_video_frame(ostream, &ref);
+  } else {
+    write_audio_frame(ostream, &ref);
+  }
+  av_free_packet(&ref);
+}
+
+}  // namespace
+
+segment_rotator_t* alloc_segment_rotator(output_stream_t* source, size_t writer_queue_size,
+                                         int avio_buffer_size, output_io_backend_t io_backend) {
+  if (!source || !source->video_stream) {
+    debug_perror("alloc_segment_rotator", EINVAL);
+    return NULL;
+  }
+
+  segment_rotator_t* rotator = reinterpret_cast<segment_rotator_t*>(
+                                 calloc(1, sizeof(segment_rotator_t)));
+  if (!rotator) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  rotator->source = source;
+  rotator->writer_queue_size = writer_queue_size;
+  rotator->avio_buffer_size = avio_buffer_size;
+  rotator->io_backend = io_backend;
+  pthread_mutex_init(&rotator->lock, NULL);
+  pthread_cond_init(&rotator->cond, NULL);
+
+  int err = pthread_create(&rotator->tid, NULL, rotator_thread_routine, rotator);
+  if (err) {
+    debug_perror("pthread_create", err);
+    free_segment_rotator(rotator);
+    return NULL;
+  }
+
+  rotator->thread_started = true;
+  return rotator;
+}
+
+int segment_rotator_rotate(segment_rotator_t* rotator, const char* file_path) {
+  if (!rotator || !file_path || strlen(file_path) >= PATH_MAX) {
+    debug_perror("segment_rotator_rotate", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  pthread_mutex_lock(&rotator->lock);
+  if (rotator->open_requested || rotator->pending.ostream || rotator->closed) {
+    pthread_mutex_unlock(&rotator->lock);
+    debug_perror("segment_rotator_rotate", EBUSY);
+    return ERROR_RESULT_VALUE;
+  }
+
+  strcpy(rotator->next_path, file_path);
+  rotator->open_requested = true;
+  pthread_cond_broadcast(&rotator->cond);
+  pthread_mutex_unlock(&rotator->lock);
+  return SUCCESS_RESULT_VALUE;
+}
+
+bool segment_rotator_write(segment_rotator_t* rotator, const AVStream* src_st,
+                           const AVPacket* pkt) {
+  if (!rotator || !src_st || !pkt) {
+    debug_perror("segment_rotator_write", EINVAL);
+    return false;
+  }
+
+  pthread_mutex_lock(&rotator->lock);
+  bool is_video = src_st->codec->codec_type == AVMEDIA_TYPE_VIDEO;
+  // switch only when the previous hand-over is done, else wait for the next key frame
+  if (is_video && (pkt->flags & AV_PKT_FLAG_KEY) && rotator->pending.ostream &&
+      !rotator->finishing.ostream && !rotator->source_finishing) {
+    if (rotator->current.ostream) {
+      rotator->finishing = rotator->current;
+    } else {
+      rotator->source_finishing = true;
+    }
+    rotator->current = rotator->pending;
+    rotator->current.start_ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    rotator->pending.ostream = NULL;
+    rotator->rotations++;
+    pthread_cond_broadcast(&rotator->cond);
+  }
+
+  if (!rotator->current.ostream) {
+    pthread_mutex_unlock(&rotator->lock);
+    return false;
+  }
+
+  write_segment(&rotator->current, src_st, pkt, rotator->source->video_stream->time_base);
+  pthread_mutex_unlock(&rotator->lock);
+  return true;
+}
+
+void free_segment_rotator(segment_rotator_t* rotator) {
+  if (!rotator) {
+    debug_perror("free_segment_rotator", EINVAL);
+    return;
+  }
+
+  if (rotator->thread_started) {
+    // thread finishes hand-overs in progress before it exits
+    pthread_mutex_lock(&rotator->lock);
+    rotator->closed = true;
+    rotator->open_requested = false;
+    pthread_cond_broadcast(&rotator->cond);
+    pthread_mutex_unlock(&rotator->lock);
+    pthread_join(rotator->tid, NULL);
+    rotator->thread_started = false;
+    debug_msg("Segment rotator finished, rotations %" PRIu64 "\n", rotator->rotations);
+  }
+
+  if (rotator->pending.ostream) {
+    finish_segment(&rotator->pending);
+  }
+
+  if (rotator->current.ostream) {
+    finish_segment(&rotator->current);
+  }
+
+  pthread_cond_destroy(&rotator->cond);
+  pthread_mutex_destroy(&rotator->lock);
+  free(rotator);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,61 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <limits.h>
+#include <pthread.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "macros.h"
+
+#include "media/file_writer.h"
+
+namespace fasto {
+namespace media {
+
+struct output_stream_t;
+
+typedef struct segment_t {
+  struct output_stream_t* ostream;  // muxer only, streams copied from the source encoders
+  int64_t start_ts;  // dts of the first key frame, source video time base
+} segment_t;
+
+/* splits the file of an encoding output_stream_t into segments without touching
+ * the encoders: next segment is opened in background, packets switch to it at the
+ * next video key frame, the finished one gets its trailer in background too */
+typedef struct segment_rotator_t {
+  struct output_stream_t* source;  // not owned, writes its own file until first rotation
+  size_t writer_queue_size;  // per segment, 0 - written in caller thread
+  int avio_buffer_size;
+  output_io_backend_t io_backend;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t tid;
+  bool thread_started;
+  bool closed;
+
+  char next_path[PATH_MAX];
+  bool open_requested;
+  segment_t pending;  // opened, waits for a key frame
+  segment_t current;  // NULL ostream - source file still written
+  segment_t finishing;  // handed to the thread for the trailer
+  bool source_finishing;  // source file handed to the thread
+
+  uint64_t rotations;
+} segment_rotator_t;
+
+segment_rotator_t* alloc_segment_rotator(struct output_stream_t* source, size_t writer_queue_size,
+                                         int avio_buffer_size, output_io_backend_t io_backend);
+// returns at once, ERROR_RESULT_VALUE if the previous rotation is not done yet
+int segment_rotator_rotate(segment_rotator_t* rotator, const char* file_path);
+// called from the source write path, true if pkt went into a segment and source must skip it
+bool segment_rotator_write(segment_rotator_t* rotator, const AVStream* src_st, const AVPacket* pkt);
+void free_segment_rotator(segment_rotator_t* rotator);  // finishes the current segment
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,198 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/stream_stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+#include "utils/time_utils.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+// slot of pts if it still holds that frame
+stream_frame_timing_t* frame_timing(stream_stats_t* stats, int64_t pts) {
+  if (!stats || pts < 0) {
+    return NULL;
+  }
+
+  stream_frame_timing_t* timing = &stats->frames[pts % STREAM_STATS_RING];
+  if (__atomic_load_n(&timing->pts, __ATOMIC_ACQUIRE) != pts) {
+    return NULL;
+  }
+  return timing;
+}
+
+void record_since(stream_stats_t* stats, stream_stage_t stage, uint64_t since_ns,
+                  uint64_t now) {
+  if (since_ns && now >= since_ns) {
+    utils::histogram_record(&stats->stages[stage], now - since_ns);
+  }
+}
+
+void get_stage_latency(const utils::histogram_t* hist, stream_stage_latency_t* latency) {
+  latency->frames = utils::histogram_count(hist);
+  latency->p50_ns = utils::histogram_percentile(hist, 50.0);
+  latency->p99_ns = utils::histogram_percentile(hist, 99.0);
+  latency->max_ns = utils::histogram_max(hist);
+}
+
+}  // namespace
+
+stream_stats_t* alloc_stream_stats() {
+  stream_stats_t* stats = reinterpret_cast<stream_stats_t*>(calloc(1, sizeof(stream_stats_t)));
+  if (!stats) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < STREAM_STATS_RING; ++i) {
+    stats->frames[i].pts = -1;
+  }
+  return stats;
+}
+
+void free_stream_stats(stream_stats_t* stats) {
+  if (!stats) {
+    return;
+  }
+
+  free(stats);
+}
+
+void stream_stats_captured(stream_stats_t* stats, int64_t pts) {
+  if (!stats || pts < 0) {
+    return;
+  }
+
+  uint64_t now = utils::currentns();
+  uint64_t unset = 0;
+  __atomic_compare_exchange_n(&stats->start_ns, &unset, now, false, __ATOMIC_RELAXED,
+                              __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->frames_captured, 1, __ATOMIC_RELAXED);
+
+  // the frame STREAM_STATS_RING back is forgotten, stages still holding it skip it
+  stream_frame_timing_t* timing = &stats->frames[pts % STREAM_STATS_RING];
+  __atomic_store_n(&timing->pts, -1, __ATOMIC_RELEASE);
+  __atomic_store_n(&timing->converted_ns, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->encoded_ns, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->captured_ns, now, __ATOMIC_RELAXED);
+  __atomic_store_n(&timing->pts, pts, __ATOMIC_RELEASE);
+}
+
+void stream_stats_converted(stream_stats_t* stats, int64_t pts) {
+  stream_frame_timing_t* timing = frame_timing(stats, pts);
+  if (!timing) {
+    return;
+  }
+
+  uint64_t now = utils::currentns();
+  __atomic_store_n(&timing->converted_ns, now, __ATOMIC_RELEASE);
+  record_since(stats, STREAM_STAGE_CAPTURE_TO_CONVERT,
+               __atomic_load_n(&timing->captured_ns, __ATOMIC_RELAXED), now);
+}
+
+void stream_stats_encoded(stream_stats_t* stats, int64_t pts) {
+  stream_frame_timing_t* timing = frame_timing(stats, pts);
+  if (!timing) {
+    return;
+  }
+
+  uint64_t now = utils::currentns();
+  __atomic_store_n(&timing->encoded_ns, now, __ATOMIC_RELEASE);
+  record_since(stats, STREAM_STAGE_CONVERT_TO_ENCODE,
+               __atomic_load_n(&timing->converted_ns, __ATOMIC_ACQUIRE), now);
+}
+
+void stream_stats_video_muxed(stream_stats_t* stats, int64_t pts, int size) {
+  if (!stats) {
+    return;
+  }
+
+  __atomic_add_fetch(&stats->frames_muxed, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->bytes_muxed, size, __ATOMIC_RELAXED);
+
+  stream_frame_timing_t* timing = frame_timing(stats, pts);
+  if (!timing) {
+    return;
+  }
+
+  uint64_t now = utils::currentns();
+  record_since(stats, STREAM_STAGE_ENCODE_TO_MUX,
+               __atomic_load_n(&timing->encoded_ns, __ATOMIC_ACQUIRE), now);
+  record_since(stats, STREAM_STAGE_END_TO_END,
+               __atomic_load_n(&timing->captured_ns, __ATOMIC_RELAXED), now);
+}
+
+void stream_stats_audio_muxed(stream_stats_t* stats, int size) {
+  if (!stats) {
+    return;
+  }
+
+  __atomic_add_fetch(&stats->bytes_muxed, size, __ATOMIC_RELAXED);
+}
+
+void stream_stats_dropped(stream_stats_t* stats) {
+  if (!stats) {
+    return;
+  }
+
+  __atomic_add_fetch(&stats->frames_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void stream_stats_shed(stream_stats_t* stats) {
+  if (!stats) {
+    return;
+  }
+
+  __atomic_add_fetch(&stats->frames_shed, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats->frames_dropped, 1, __ATOMIC_RELAXED);
+}
+
+void get_stream_stats(const stream_stats_t* stats, stream_stats_snapshot_t* snapshot) {
+  if (!stats || !snapshot) {
+    debug_perror("get_stream_stats", EINVAL);
+    return;
+  }
+
+  for (int i = 0; i < STREAM_STAGE_COUNT; ++i) {
+    get_stage_latency(&stats->stages[i], &snapshot->stages[i]);
+  }
+
+  snapshot->frames_captured = __atomic_load_n(&stats->frames_captured, __ATOMIC_RELAXED);
+  snapshot->frames_muxed = __atomic_load_n(&stats->frames_muxed, __ATOMIC_RELAXED);
+  snapshot->frames_dropped = __atomic_load_n(&stats->frames_dropped, __ATOMIC_RELAXED);
+  snapshot->frames_shed = __atomic_load_n(&stats->frames_shed, __ATOMIC_RELAXED);
+  snapshot->bytes_muxed = __atomic_load_n(&stats->bytes_muxed, __ATOMIC_RELAXED);
+
+  uint64_t start_ns = __atomic_load_n(&stats->start_ns, __ATOMIC_RELAXED);
+  uint64_t now = utils::currentns();
+  snapshot->fps = start_ns && now > start_ns ? snapshot->frames_muxed * 1e9 / (now - start_ns) :
+                                               0.0;
+}
+
+void get_stream_end_to_end_latency(const stream_stats_t* stats, video_latency_t* latency) {
+  if (!stats || !latency) {
+    debug_perror("get_stream_end_to_end_latency", EINVAL);
+    return;
+  }
+
+  const utils::histogram_t* hist = &stats->stages[STREAM_STAGE_END_TO_END];
+  latency->frames = utils::histogram_count(hist);
+  latency->last_ns = __atomic_load_n(&hist->last, __ATOMIC_RELAXED);
+  latency->avg_ns = utils::histogram_mean(hist);
+  latency->max_ns = utils::histogram_max(hist);
+}
+
+const char* stream_stage_name(stream_stage_t stage) {
+  static const char* names[] = { "CAPTURE_TO_CONVERT", "CONVERT_TO_ENCODE", "ENCODE_TO_MUX",
+                                 "CAPTURE_TO_MUX" };
+  return stage < STREAM_STAGE_COUNT ? names[stage] : "UNKNOWN";
+}
+
+}  // namespace media
+}  // namespace fasto
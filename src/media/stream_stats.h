@@ -0,0 +1,84 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include "macros.h"
+
+#include "utils/histogram.h"
+
+#define STREAM_STATS_RING 256  // video frames between capture and mux timed at most
+
+namespace fasto {
+namespace media {
+
+typedef enum stream_stage_t {
+  STREAM_STAGE_CAPTURE_TO_CONVERT = 0,  // frame handed over -> encoder pix_fmt frame ready
+  STREAM_STAGE_CONVERT_TO_ENCODE,  // -> its packet out of the encoder
+  STREAM_STAGE_ENCODE_TO_MUX,  // -> packet handed to the muxer
+  STREAM_STAGE_END_TO_END,  // capture -> mux
+  STREAM_STAGE_COUNT
+} stream_stage_t;
+
+typedef struct stream_frame_timing_t {
+  int64_t pts;  // encoder pts the times belong to, -1 - slot unused
+  uint64_t captured_ns;
+  uint64_t converted_ns;
+  uint64_t encoded_ns;
+} stream_frame_timing_t;
+
+// per stage latency of video frames and stream counters, every stage records from
+// its own thread without locks, readable at any time
+typedef struct stream_stats_t {
+  stream_frame_timing_t frames[STREAM_STATS_RING];  // by pts % STREAM_STATS_RING
+  utils::histogram_t stages[STREAM_STAGE_COUNT];
+
+  uint64_t start_ns;  // first frame captured
+  uint64_t frames_captured;
+  uint64_t frames_muxed;
+  uint64_t frames_dropped;  // never reached the encoder
+  uint64_t frames_shed;  // of them left out on purpose while encoding fell behind
+  uint64_t bytes_muxed;  // audio and video packet payload handed to the muxer
+} stream_stats_t;
+
+typedef struct stream_stage_latency_t {
+  uint64_t frames;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+} stream_stage_latency_t;
+
+typedef struct stream_stats_snapshot_t {
+  stream_stage_latency_t stages[STREAM_STAGE_COUNT];
+  double fps;  // muxed frames per second since the first capture
+  uint64_t frames_captured;
+  uint64_t frames_muxed;
+  uint64_t frames_dropped;
+  uint64_t frames_shed;
+  uint64_t bytes_muxed;
+} stream_stats_snapshot_t;
+
+typedef struct video_latency_t {
+  uint64_t frames;
+  uint64_t last_ns;
+  uint64_t avg_ns;
+  uint64_t max_ns;
+} video_latency_t;
+
+stream_stats_t* alloc_stream_stats();
+void free_stream_stats(stream_stats_t* stats);
+
+// pts in the encoder time base, stats may be NULL
+void stream_stats_captured(stream_stats_t* stats, int64_t pts);
+void stream_stats_converted(stream_stats_t* stats, int64_t pts);
+void stream_stats_encoded(stream_stats_t* stats, int64_t pts);
+void stream_stats_video_muxed(stream_stats_t* stats, int64_t pts, int size);
+void stream_stats_audio_muxed(stream_stats_t* stats, int size);
+void stream_stats_dropped(stream_stats_t* stats);
+void stream_stats_shed(stream_stats_t* stats);  // counted as dropped too
+
+void get_stream_stats(const stream_stats_t* stats, stream_stats_snapshot_t* snapshot);
+void get_stream_end_to_end_latency(const stream_stats_t* stats, video_latency_t* latency);
+const char* stream_stage_name(stream_stage_t stage);
+
+}  // namespace media
+}  // namespace fasto
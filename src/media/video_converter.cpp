@@ -0,0 +1,201 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/video_converter.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "log.h"
+
+#include "media/bgr_to_yuv.h"
+#include "media/ffmpeg_utils.h"
+
+#define VIDEO_CONVERTER_SWS_FLAGS SWS_BICUBIC
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+AVFrame* alloc_pool_frame(enum AVPixelFormat pix_fmt, int width, int height) {
+  AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return NULL;
+  }
+
+  frame->format = pix_fmt;
+  frame->width = width;
+  frame->height = height;
+
+  int ret = av_frame_get_buffer(frame, 32);
+  if (ret < 0) {
+    debug_av_perror("av_frame_get_buffer", ret);
+    av_frame_free(&frame);
+    return NULL;
+  }
+
+  return frame;
+}
+
+int update_sws_context(video_converter_t* conv, int width, int height,
+                       enum AVPixelFormat src_fmt) {
+  if (conv->sws_ctx && conv->src_width == width && conv->src_height == height &&
+      conv->src_fmt == src_fmt) {
+    return SUCCESS_RESULT_VALUE;
+  }
+
+  if (conv->sws_ctx) {
+    debug_msg("Video converter input changed %dx%d(%d) -> %dx%d(%d), rebuild context\n",
+              conv->src_width, conv->src_height, conv->src_fmt, width, height, src_fmt);
+    sws_freeContext(conv->sws_ctx);
+    conv->sws_ctx = NULL;
+  }
+
+  conv->sws_ctx = sws_getContext(width, height, src_fmt,
+                                 conv->dst_width, conv->dst_height, conv->dst_fmt,
+                                 VIDEO_CONVERTER_SWS_FLAGS, NULL, NULL, NULL);
+  if (!conv->sws_ctx) {
+    debug_error("Could not create SwsContext %dx%d(%d)\n", width, height, src_fmt);
+    return ERROR_RESULT_VALUE;
+  }
+
+  conv->src_width = width;
+  conv->src_height = height;
+  conv->src_fmt = src_fmt;
+  return SUCCESS_RESULT_VALUE;
+}
+
+}  // namespace
+
+enum AVPixelFormat cv_type_to_pix_fmt(int cv_type) {
+  switch (cv_type) {
+    case CV_8UC3:
+      return AV_PIX_FMT_BGR24;
+    case CV_8UC4:
+      return AV_PIX_FMT_BGRA;
+    case CV_8UC1:
+      return AV_PIX_FMT_GRAY8;
+    default:
+      return AV_PIX_FMT_NONE;
+  }
+}
+
+video_converter_t* alloc_video_converter(int dst_width, int dst_height,
+                                         enum AVPixelFormat dst_fmt, size_t pool_size) {
+  if (dst_width <= 0 || dst_height <= 0 || pool_size == 0 ||
+      pool_size > VIDEO_CONVERTER_MAX_POOL_SIZE) {
+    debug_perror("alloc_video_converter", EINVAL);
+    return NULL;
+  }
+
+  video_converter_t* conv = reinterpret_cast<video_converter_t*>(
+                              calloc(1, sizeof(video_converter_t)));
+  if (!conv) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  conv->src_fmt = AV_PIX_FMT_NONE;
+  conv->dst_width = dst_width;
+  conv->dst_height = dst_height;
+  conv->dst_fmt = dst_fmt;
+
+  for (size_t i = 0; i < pool_size; ++i) {
+    conv->frames[i] = alloc_pool_frame(dst_fmt, dst_width, dst_height);
+    if (!conv->frames[i]) {
+      free_video_converter(conv);
+      return NULL;
+    }
+    conv->frames_count++;
+  }
+
+  return conv;
+}
+
+AVFrame* video_converter_convert(video_converter_t* conv, const uint8_t* data, int linesize,
+                                 int width, int height, enum AVPixelFormat src_fmt) {
+  if (!conv) {
+    debug_perror("video_converter_convert", EINVAL);
+    return NULL;
+  }
+
+  AVFrame* frame = conv->frames[conv->frame_pos];
+  conv->frame_pos = (conv->frame_pos + 1) % conv->frames_count;
+
+  if (video_converter_convert_to(conv, data, linesize, width, height, src_fmt, frame) ==
+      ERROR_RESULT_VALUE) {
+    return NULL;
+  }
+
+  return frame;
+}
+
+int video_converter_convert_to(video_converter_t* conv, const uint8_t* data, int linesize,
+                               int width, int height, enum AVPixelFormat src_fmt, AVFrame* dst) {
+  if (!conv || !data || !dst || width <= 0 || height <= 0) {
+    debug_perror("video_converter_convert_to", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  // camera pictures are not scaled, only converted: no need for swscale
+  bool direct = width == conv->dst_width && height == conv->dst_height &&
+      bgr_to_yuv_supported(src_fmt, conv->dst_fmt);
+  if (!direct && update_sws_context(conv, width, height, src_fmt) == ERROR_RESULT_VALUE) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  /* the encoder may still reference the buffer of this frame or it was handed on
+   * (Mat passed to the encoder as is): take a new buffer, old pixels are not needed */
+  if (dst->buf[0] && !av_frame_is_writable(dst)) {
+    av_frame_unref(dst);
+  }
+
+  if (!dst->buf[0]) {
+    dst->format = conv->dst_fmt;
+    dst->width = conv->dst_width;
+    dst->height = conv->dst_height;
+    int ret = av_frame_get_buffer(dst, 32);
+    if (ret < 0) {
+      debug_av_perror("av_frame_get_buffer", ret);
+      return ERROR_RESULT_VALUE;
+    }
+  }
+
+  if (direct) {
+    return bgr_to_yuv(data, linesize, width, height, src_fmt, dst->data, dst->linesize,
+                      conv->dst_fmt);
+  }
+
+  const uint8_t* src_data[4] = { data, NULL, NULL, NULL };
+  int src_linesize[4] = { linesize, 0, 0, 0 };
+  sws_scale(conv->sws_ctx, src_data, src_linesize, 0, height, dst->data, dst->linesize);
+  return SUCCESS_RESULT_VALUE;
+}
+
+AVFrame* video_converter_alloc_frame(video_converter_t* conv) {
+  if (!conv) {
+    debug_perror("video_converter_alloc_frame", EINVAL);
+    return NULL;
+  }
+
+  return alloc_pool_frame(conv->dst_fmt, conv->dst_width, conv->dst_height);
+}
+
+void free_video_converter(video_converter_t* conv) {
+  if (!conv) {
+    debug_perror("free_video_converter", EINVAL);
+    return;
+  }
+
+  for (size_t i = 0; i < conv->frames_count; ++i) {
+    av_frame_free(&conv->frames[i]);
+  }
+
+  if (conv->sws_ctx) {
+    sws_freeContext(conv->sws_ctx);
+    conv->sws_ctx = NULL;
+  }
+  free(conv);
+}
+
+}  // namespace media
+}  // namespace fasto
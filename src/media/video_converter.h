@@ -0,0 +1,48 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+}
+
+#include "macros.h"
+
+#define VIDEO_CONVERTER_MAX_POOL_SIZE 8
+
+namespace fasto {
+namespace media {
+
+typedef struct video_converter_t {
+  struct SwsContext* sws_ctx;  // rebuilt only when source geometry/format changes,
+                               // not used for same size BGR -> YUV420P/NV12
+
+  int src_width;
+  int src_height;
+  enum AVPixelFormat src_fmt;
+
+  int dst_width;
+  int dst_height;
+  enum AVPixelFormat dst_fmt;
+
+  AVFrame* frames[VIDEO_CONVERTER_MAX_POOL_SIZE];  // preallocated destination pictures
+  size_t frames_count;
+  size_t frame_pos;  // next pool slot, round-robin
+} video_converter_t;
+
+enum AVPixelFormat cv_type_to_pix_fmt(int cv_type);  // cv::Mat::type() -> AV_PIX_FMT_*
+
+video_converter_t* alloc_video_converter(int dst_width, int dst_height,
+                                         enum AVPixelFormat dst_fmt, size_t pool_size);
+// returned frame owned by converter, valid until pool_size further conversions
+AVFrame* video_converter_convert(video_converter_t* conv, const uint8_t* data, int linesize,
+                                 int width, int height, enum AVPixelFormat src_fmt);
+// converts into caller owned frame, takes a new buffer if dst has none or shares it
+int video_converter_convert_to(video_converter_t* conv, const uint8_t* data, int linesize,
+                               int width, int height, enum AVPixelFormat src_fmt, AVFrame* dst);
+AVFrame* video_converter_alloc_frame(video_converter_t* conv);  // av_frame_free
+void free_video_converter(video_converter_t* conv);
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,370 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "media/video_pipeline.h"
+
+#include "log.h"
+
+#include "media/codec_holder.h"
+#include "media/mat_frame.h"
+#include "media/stream_stats.h"
+#include "media/video_converter.h"
+
+#include "utils/spsc_queue.h"
+
+namespace fasto {
+namespace media {
+
+namespace {
+
+void* convert_thread_routine(void* arg) {
+  video_pipeline_t* pipeline = reinterpret_cast<video_pipeline_t*>(arg);
+
+  video_pipeline_frame_slot_t* fslot = NULL;  // kept across iterations if conversion failed
+  void* item = NULL;
+  while (utils::spsc_queue_pop_wait(pipeline->convert_queue, &item) == SUCCESS_RESULT_VALUE) {
+    video_pipeline_mat_slot_t* mslot = reinterpret_cast<video_pipeline_mat_slot_t*>(item);
+    if (!fslot) {
+      void* fitem = NULL;
+      if (utils::spsc_queue_pop_wait(pipeline->frame_free, &fitem) == ERROR_RESULT_VALUE) {
+        utils::spsc_queue_push(pipeline->mat_free, mslot);
+        break;
+      }
+      fslot = reinterpret_cast<video_pipeline_frame_slot_t*>(fitem);
+    }
+
+    AVFrame* mframe = mslot->frame;
+    video_converter_t* converter = pipeline->converter;
+    int res = video_converter_convert_to(converter, mframe->data[0], mframe->linesize[0],
+                                         mframe->width, mframe->height,
+                                         static_cast<enum AVPixelFormat>(mframe->format),
+                                         fslot->frame);
+    fslot->frame->pts = mframe->pts;
+    av_frame_unref(mframe);  // Mat pixels are free for the caller again
+    utils::spsc_queue_push(pipeline->mat_free, mslot);
+    if (res == ERROR_RESULT_VALUE) {
+      stream_stats_dropped(pipeline->ostream->stats);
+      __atomic_add_fetch(&pipeline->frames_sent, 1, __ATOMIC_RELEASE);
+      continue;
+    }
+    if (fslot->frame->pts != AV_NOPTS_VALUE) {
+      stream_stats_converted(pipeline->ostream->stats, fslot->frame->pts);
+    }
+
+    utils::spsc_queue_push(pipeline->encode_queue, fslot);
+    fslot = NULL;
+  }
+
+  utils::spsc_queue_close(pipeline->encode_queue);
+  return NULL;
+}
+
+// ERROR_RESULT_VALUE if the mux stage is gone
+int queue_encoded_packets(video_pipeline_t* pipeline) {
+  AVPacket pkt = {0};
+  av_init_packet(&pkt);
+  while (receive_ostream_video_packet(pipeline->ostream, &pkt) == 0) {
+    void* pitem = NULL;
+    if (utils::spsc_queue_pop_wait(pipeline->packet_free, &pitem) == ERROR_RESULT_VALUE) {
+      av_free_packet(&pkt);
+      return ERROR_RESULT_VALUE;
+    }
+
+    video_pipeline_packet_slot_t* pslot = reinterpret_cast<video_pipeline_packet_slot_t*>(pitem);
+    av_packet_move_ref(&pslot->pkt, &pkt);
+    utils::spsc_queue_push(pipeline->mux_queue, pslot);
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+void* encode_thread_routine(void* arg) {
+  video_pipeline_t* pipeline = reinterpret_cast<video_pipeline_t*>(arg);
+
+  bool mux_gone = false;
+  void* item = NULL;
+  while (utils::spsc_queue_pop_wait(pipeline->encode_queue, &item) == SUCCESS_RESULT_VALUE) {
+    video_pipeline_frame_slot_t* fslot = reinterpret_cast<video_pipeline_frame_slot_t*>(item);
+
+    // next frame is submitted as soon as the packets ready so far are handed to mux
+    int res = send_ostream_video_frame(pipeline->ostream, fslot->frame);
+    utils::spsc_queue_push(pipeline->frame_free, fslot);
+    __atomic_add_fetch(&pipeline->frames_sent, 1, __ATOMIC_RELEASE);
+    if (res < 0) {
+      stream_stats_dropped(pipeline->ostream->stats);
+      continue;
+    }
+
+    if (queue_encoded_packets(pipeline) == ERROR_RESULT_VALUE) {
+      mux_gone = true;
+      break;
+    }
+  }
+
+  if (!mux_gone) {
+    // frames still delayed inside the encoder reach the file
+    send_ostream_video_frame(pipeline->ostream, NULL);
+    queue_encoded_packets(pipeline);
+  }
+
+  utils::spsc_queue_close(pipeline->mux_queue);
+  return NULL;
+}
+
+void* mux_thread_routine(void* arg) {
+  video_pipeline_t* pipeline = reinterpret_cast<video_pipeline_t*>(arg);
+
+  void* item = NULL;
+  while (utils::spsc_queue_pop_wait(pipeline->mux_queue, &item) == SUCCESS_RESULT_VALUE) {
+    video_pipeline_packet_slot_t* pslot = reinterpret_cast<video_pipeline_packet_slot_t*>(item);
+
+    video_pipeline_lock_muxer(pipeline);
+    write_video_frame(pipeline->ostream, &pslot->pkt);
+    video_pipeline_unlock_muxer(pipeline);
+
+    av_free_packet(&pslot->pkt);
+    utils::spsc_queue_push(pipeline->packet_free, pslot);
+  }
+
+  return NULL;
+}
+
+void free_video_pipeline_slots(video_pipeline_t* pipeline) {
+  if (pipeline->mat_slots) {
+    for (size_t i = 0; i < pipeline->depth; ++i) {
+      av_frame_free(&pipeline->mat_slots[i].frame);
+    }
+    free(pipeline->mat_slots);
+    pipeline->mat_slots = NULL;
+  }
+
+  if (pipeline->frame_slots) {
+    for (size_t i = 0; i < pipeline->depth; ++i) {
+      av_frame_free(&pipeline->frame_slots[i].frame);
+    }
+    free(pipeline->frame_slots);
+    pipeline->frame_slots = NULL;
+  }
+
+  if (pipeline->packet_slots) {
+    for (size_t i = 0; i < pipeline->depth; ++i) {
+      av_free_packet(&pipeline->packet_slots[i].pkt);
+    }
+    free(pipeline->packet_slots);
+    pipeline->packet_slots = NULL;
+  }
+
+  utils::spsc_queue_t** queues[] = { &pipeline->mat_free, &pipeline->convert_queue,
+                                     &pipeline->frame_free, &pipeline->encode_queue,
+                                     &pipeline->packet_free, &pipeline->mux_queue };
+  for (size_t i = 0; i < sizeof(queues) / sizeof(queues[0]); ++i) {
+    if (*queues[i]) {
+      utils::free_spsc_queue(*queues[i]);
+      *queues[i] = NULL;
+    }
+  }
+}
+
+int alloc_video_pipeline_slots(video_pipeline_t* pipeline) {
+  size_t depth = pipeline->depth;
+  pipeline->mat_free = utils::alloc_spsc_queue(depth);
+  pipeline->convert_queue = utils::alloc_spsc_queue(depth);
+  pipeline->frame_free = utils::alloc_spsc_queue(depth);
+  pipeline->encode_queue = utils::alloc_spsc_queue(depth);
+  pipeline->packet_free = utils::alloc_spsc_queue(depth);
+  pipeline->mux_queue = utils::alloc_spsc_queue(depth);
+  if (!pipeline->mat_free || !pipeline->convert_queue || !pipeline->frame_free ||
+      !pipeline->encode_queue || !pipeline->packet_free || !pipeline->mux_queue) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  pipeline->mat_slots = reinterpret_cast<video_pipeline_mat_slot_t*>(
+                          calloc(depth, sizeof(video_pipeline_mat_slot_t)));
+  if (!pipeline->mat_slots) {
+    debug_perror("calloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    pipeline->mat_slots[i].frame = av_frame_alloc();
+    if (!pipeline->mat_slots[i].frame) {
+      debug_perror("av_frame_alloc", ENOMEM);
+      return ERROR_RESULT_VALUE;
+    }
+    utils::spsc_queue_push(pipeline->mat_free, &pipeline->mat_slots[i]);
+  }
+
+  pipeline->frame_slots = reinterpret_cast<video_pipeline_frame_slot_t*>(
+                            calloc(depth, sizeof(video_pipeline_frame_slot_t)));
+  if (!pipeline->frame_slots) {
+    debug_perror("calloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    pipeline->frame_slots[i].frame = video_converter_alloc_frame(pipeline->converter);
+    if (!pipeline->frame_slots[i].frame) {
+      return ERROR_RESULT_VALUE;
+    }
+    utils::spsc_queue_push(pipeline->frame_free, &pipeline->frame_slots[i]);
+  }
+
+  pipeline->packet_slots = reinterpret_cast<video_pipeline_packet_slot_t*>(
+                             calloc(depth, sizeof(video_pipeline_packet_slot_t)));
+  if (!pipeline->packet_slots) {
+    debug_perror("calloc", ENOMEM);
+    return ERROR_RESULT_VALUE;
+  }
+  for (size_t i = 0; i < depth; ++i) {
+    av_init_packet(&pipeline->packet_slots[i].pkt);
+    utils::spsc_queue_push(pipeline->packet_free, &pipeline->packet_slots[i]);
+  }
+
+  return SUCCESS_RESULT_VALUE;
+}
+
+/* mat_free has the convert thread as its only producer, a slot which could not take
+ * the Mat stays with the ingest side for the next push instead of going back there */
+int push_mat_slot(video_pipeline_t* pipeline, video_pipeline_mat_slot_t* mslot,
+                  const cv::Mat* mat, int64_t pts) {
+  if (mat_frame_ref(mslot->frame, mat) == ERROR_RESULT_VALUE) {
+    pipeline->spare_mat_slot = mslot;
+    return ERROR_RESULT_VALUE;
+  }
+  mslot->frame->pts = pts;
+  utils::spsc_queue_push(pipeline->convert_queue, mslot);
+  pipeline->frames_pushed++;
+  return SUCCESS_RESULT_VALUE;
+}
+
+}  // namespace
+
+video_pipeline_t* alloc_video_pipeline(output_stream_t* ostream, video_converter_t* converter,
+                                       size_t depth) {
+  if (!ostream || !converter || depth == 0) {
+    debug_perror("alloc_video_pipeline", EINVAL);
+    return NULL;
+  }
+
+  video_pipeline_t* pipeline = reinterpret_cast<video_pipeline_t*>(
+                                 calloc(1, sizeof(video_pipeline_t)));
+  if (!pipeline) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  pipeline->ostream = ostream;
+  pipeline->converter = converter;
+  pipeline->depth = depth;
+  pthread_mutex_init(&pipeline->mux_lock, NULL);
+
+  if (alloc_video_pipeline_slots(pipeline) == ERROR_RESULT_VALUE) {
+    free_video_pipeline(pipeline);
+    return NULL;
+  }
+
+  int err = pthread_create(&pipeline->mux_tid, NULL, mux_thread_routine, pipeline);
+  if (err) {
+    debug_perror("pthread_create", err);
+    free_video_pipeline(pipeline);
+    return NULL;
+  }
+
+  err = pthread_create(&pipeline->encode_tid, NULL, encode_thread_routine, pipeline);
+  if (err) {
+    debug_perror("pthread_create", err);
+    utils::spsc_queue_close(pipeline->mux_queue);
+    pthread_join(pipeline->mux_tid, NULL);
+    free_video_pipeline(pipeline);
+    return NULL;
+  }
+
+  err = pthread_create(&pipeline->convert_tid, NULL, convert_thread_routine, pipeline);
+  if (err) {
+    debug_perror("pthread_create", err);
+    utils::spsc_queue_close(pipeline->encode_queue);
+    pthread_join(pipeline->encode_tid, NULL);
+    pthread_join(pipeline->mux_tid, NULL);
+    free_video_pipeline(pipeline);
+    return NULL;
+  }
+
+  pipeline->threads_started = true;
+  return pipeline;
+}
+
+int video_pipeline_push(video_pipeline_t* pipeline, const cv::Mat* mat, int64_t pts) {
+  if (!pipeline || !mat || mat->empty()) {
+    debug_perror("video_pipeline_push", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  if (cv_type_to_pix_fmt(mat->type()) == AV_PIX_FMT_NONE) {
+    debug_perror("video_pipeline_push unsupported Mat type", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  void* item = pipeline->spare_mat_slot;
+  pipeline->spare_mat_slot = NULL;
+  if (!item && utils::spsc_queue_pop(pipeline->mat_free, &item) == ERROR_RESULT_VALUE) {
+    pipeline->frames_dropped++;
+    return ERROR_RESULT_VALUE;
+  }
+
+  return push_mat_slot(pipeline, reinterpret_cast<video_pipeline_mat_slot_t*>(item), mat, pts);
+}
+
+int video_pipeline_push_wait(video_pipeline_t* pipeline, const cv::Mat* mat, int64_t pts) {
+  if (!pipeline || !mat || mat->empty()) {
+    debug_perror("video_pipeline_push_wait", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  if (cv_type_to_pix_fmt(mat->type()) == AV_PIX_FMT_NONE) {
+    debug_perror("video_pipeline_push_wait unsupported Mat type", EINVAL);
+    return ERROR_RESULT_VALUE;
+  }
+
+  void* item = pipeline->spare_mat_slot;
+  pipeline->spare_mat_slot = NULL;
+  if (!item && utils::spsc_queue_pop_wait(pipeline->mat_free, &item) == ERROR_RESULT_VALUE) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  return push_mat_slot(pipeline, reinterpret_cast<video_pipeline_mat_slot_t*>(item), mat, pts);
+}
+
+size_t video_pipeline_backlog(video_pipeline_t* pipeline) {
+  uint64_t sent = __atomic_load_n(&pipeline->frames_sent, __ATOMIC_ACQUIRE);
+  return pipeline->frames_pushed > sent ? pipeline->frames_pushed - sent : 0;
+}
+
+void video_pipeline_lock_muxer(video_pipeline_t* pipeline) {
+  pthread_mutex_lock(&pipeline->mux_lock);
+}
+
+void video_pipeline_unlock_muxer(video_pipeline_t* pipeline) {
+  pthread_mutex_unlock(&pipeline->mux_lock);
+}
+
+void free_video_pipeline(video_pipeline_t* pipeline) {
+  if (!pipeline) {
+    debug_perror("free_video_pipeline", EINVAL);
+    return;
+  }
+
+  if (pipeline->threads_started) {
+    // closing the head queue drains every stage in order
+    utils::spsc_queue_close(pipeline->convert_queue);
+    pthread_join(pipeline->convert_tid, NULL);
+    pthread_join(pipeline->encode_tid, NULL);
+    pthread_join(pipeline->mux_tid, NULL);
+    pipeline->threads_started = false;
+    debug_msg("Video pipeline finished, frames pushed %" PRIu64 ", dropped %" PRIu64 "\n",
+              pipeline->frames_pushed, pipeline->frames_dropped);
+  }
+
+  free_video_pipeline_slots(pipeline);
+  pthread_mutex_destroy(&pipeline->mux_lock);
+  free(pipeline);
+}
+
+}  // namespace media
+}  // namespace fasto
@@ -0,0 +1,82 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include <opencv2/opencv.hpp>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "macros.h"
+
+namespace fasto {
+namespace utils {
+struct spsc_queue_t;
+}  // namespace utils
+
+namespace media {
+
+struct output_stream_t;
+struct video_converter_t;
+
+typedef struct video_pipeline_mat_slot_t {
+  AVFrame* frame;  // references the pushed Mat pixels until converted
+} video_pipeline_mat_slot_t;
+
+typedef struct video_pipeline_frame_slot_t {
+  AVFrame* frame;
+} video_pipeline_frame_slot_t;
+
+typedef struct video_pipeline_packet_slot_t {
+  AVPacket pkt;
+} video_pipeline_packet_slot_t;
+
+// ingest -> convert -> encode -> mux, every stage on its own thread,
+// stages are linked by spsc queues, slots travel back through *_free queues
+typedef struct video_pipeline_t {
+  struct output_stream_t* ostream;  // not owned
+  struct video_converter_t* converter;  // not owned
+
+  size_t depth;
+  video_pipeline_mat_slot_t* mat_slots;
+  video_pipeline_frame_slot_t* frame_slots;
+  video_pipeline_packet_slot_t* packet_slots;
+  video_pipeline_mat_slot_t* spare_mat_slot;  // taken by ingest, Mat not referenced, or NULL
+
+  struct utils::spsc_queue_t* mat_free;  // convert -> ingest
+  struct utils::spsc_queue_t* convert_queue;  // ingest -> convert
+  struct utils::spsc_queue_t* frame_free;  // encode -> convert
+  struct utils::spsc_queue_t* encode_queue;  // convert -> encode
+  struct utils::spsc_queue_t* packet_free;  // mux -> encode
+  struct utils::spsc_queue_t* mux_queue;  // encode -> mux
+
+  pthread_t convert_tid;
+  pthread_t encode_tid;
+  pthread_t mux_tid;
+  bool threads_started;
+
+  pthread_mutex_t mux_lock;  // muxer is shared with audio writes
+
+  uint64_t frames_pushed;
+  uint64_t frames_sent;  // taken by the encoder or failed to convert
+  uint64_t frames_dropped;  // no free ingest slot
+} video_pipeline_t;
+
+video_pipeline_t* alloc_video_pipeline(struct output_stream_t* ostream,
+                                       struct video_converter_t* converter, size_t depth);
+/* references mat in a free slot (no pixel copy) and returns at once, ERROR_RESULT_VALUE
+ * if pipeline is full; mat may be released at once, written again when !mat_frame_in_use */
+int video_pipeline_push(video_pipeline_t* pipeline, const cv::Mat* mat, int64_t pts);
+int video_pipeline_push_wait(video_pipeline_t* pipeline, const cv::Mat* mat,
+                             int64_t pts);  // waits for a free slot instead
+// pushed frames the encoder has not taken yet, called by the pushing thread
+size_t video_pipeline_backlog(video_pipeline_t* pipeline);
+void video_pipeline_lock_muxer(video_pipeline_t* pipeline);
+void video_pipeline_unlock_muxer(video_pipeline_t* pipeline);
+void free_video_pipeline(video_pipeline_t* pipeline);  // drains all queued frames
+
+}  // namespace media
+}  // namespace fasto
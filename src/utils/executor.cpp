@@ -0,0 +1,214 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "utils/executor.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace fasto {
+namespace utils {
+
+namespace {
+
+__thread executor_worker_t* current_worker = NULL;
+
+void push_task(executor_worker_t* worker, executor_task_t* task) {
+  task->next = NULL;
+  pthread_mutex_lock(&worker->lock);
+  executor_task_t** tail = &worker->tails[task->priority];
+  if (*tail) {
+    (*tail)->next = task;
+  } else {
+    worker->heads[task->priority] = task;
+  }
+  *tail = task;
+  pthread_mutex_unlock(&worker->lock);
+}
+
+executor_task_t* pop_task(executor_worker_t* worker, executor_priority_t priority) {
+  pthread_mutex_lock(&worker->lock);
+  executor_task_t* task = worker->heads[priority];
+  if (task) {
+    worker->heads[priority] = task->next;
+    if (!task->next) {
+      worker->tails[priority] = NULL;
+    }
+    task->next = NULL;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return task;
+}
+
+executor_task_t* take_task(executor_worker_t* worker, executor_priority_t priority) {
+  executor_task_t* task = pop_task(worker, priority);
+  if (task) {
+    return task;
+  }
+
+  executor_t* executor = worker->executor;
+  for (size_t i = 1; i < executor->worker_count; ++i) {
+    executor_worker_t* victim = &executor->workers[(worker->index + i) % executor->worker_count];
+    task = pop_task(victim, priority);
+    if (task) {
+      worker->stolen++;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// high first, a low one after EXECUTOR_HIGH_BURST high in a row so archive never starves
+executor_task_t* next_task(executor_worker_t* worker) {
+  bool low_first = worker->high_in_row >= EXECUTOR_HIGH_BURST;
+  executor_task_t* task = take_task(worker, low_first ? EXECUTOR_PRIORITY_LOW :
+                                                        EXECUTOR_PRIORITY_HIGH);
+  if (!task) {
+    task = take_task(worker, low_first ? EXECUTOR_PRIORITY_HIGH : EXECUTOR_PRIORITY_LOW);
+  }
+  if (task) {
+    worker->high_in_row = task->priority == EXECUTOR_PRIORITY_HIGH ? worker->high_in_row + 1 : 0;
+  }
+  return task;
+}
+
+void* worker_routine(void* arg) {
+  executor_worker_t* worker = reinterpret_cast<executor_worker_t*>(arg);
+  executor_t* executor = worker->executor;
+  current_worker = worker;
+
+  while (true) {
+    executor_task_t* task = next_task(worker);
+    if (task) {
+      __atomic_sub_fetch(&executor->pending, 1, __ATOMIC_ACQ_REL);
+      task->run(task->arg);
+      worker->executed++;
+      continue;
+    }
+
+    // submitters count pending before taking idle_lock, so no wakeup is lost
+    pthread_mutex_lock(&executor->idle_lock);
+    if (!__atomic_load_n(&executor->pending, __ATOMIC_ACQUIRE)) {
+      if (executor->stopping) {
+        pthread_mutex_unlock(&executor->idle_lock);
+        break;
+      }
+      executor->idle_workers++;
+      pthread_cond_wait(&executor->idle_cond, &executor->idle_lock);
+      executor->idle_workers--;
+    }
+    pthread_mutex_unlock(&executor->idle_lock);
+  }
+
+  current_worker = NULL;
+  return NULL;
+}
+
+}  // namespace
+
+executor_t* alloc_executor(size_t thread_count) {
+  if (thread_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = cpus > 0 ? cpus : 1;
+  }
+
+  executor_t* executor = reinterpret_cast<executor_t*>(calloc(1, sizeof(executor_t)));
+  if (!executor) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  executor->workers = reinterpret_cast<executor_worker_t*>(
+                        calloc(thread_count, sizeof(executor_worker_t)));
+  if (!executor->workers) {
+    debug_perror("calloc", ENOMEM);
+    free(executor);
+    return NULL;
+  }
+
+  pthread_mutex_init(&executor->idle_lock, NULL);
+  pthread_cond_init(&executor->idle_cond, NULL);
+  executor->worker_count = thread_count;
+  for (size_t i = 0; i < thread_count; ++i) {
+    executor->workers[i].executor = executor;
+    executor->workers[i].index = i;
+    pthread_mutex_init(&executor->workers[i].lock, NULL);
+  }
+
+  for (size_t i = 0; i < thread_count; ++i) {
+    int err = pthread_create(&executor->workers[i].tid, NULL, worker_routine,
+                             &executor->workers[i]);
+    if (err) {
+      debug_perror("pthread_create", err);
+      executor->worker_count = i;  // the started ones are stopped and joined
+      free_executor(executor);
+      return NULL;
+    }
+  }
+
+  return executor;
+}
+
+void executor_submit(executor_t* executor, executor_task_t* task) {
+  if (!executor || !task || !task->run || task->priority >= EXECUTOR_PRIORITY_COUNT) {
+    debug_perror("executor_submit", EINVAL);
+    return;
+  }
+
+  executor_worker_t* worker = current_worker;
+  if (!worker || worker->executor != executor) {
+    size_t index = __atomic_fetch_add(&executor->next_worker, 1, __ATOMIC_RELAXED);
+    worker = &executor->workers[index % executor->worker_count];
+  }
+
+  push_task(worker, task);
+  __atomic_add_fetch(&executor->pending, 1, __ATOMIC_ACQ_REL);
+
+  pthread_mutex_lock(&executor->idle_lock);
+  if (executor->idle_workers) {
+    pthread_cond_signal(&executor->idle_cond);
+  }
+  pthread_mutex_unlock(&executor->idle_lock);
+}
+
+size_t executor_thread_count(executor_t* executor) {
+  return executor ? executor->worker_count : 0;
+}
+
+void free_executor(executor_t* executor) {
+  if (!executor) {
+    debug_perror("free_executor", EINVAL);
+    return;
+  }
+
+  pthread_mutex_lock(&executor->idle_lock);
+  executor->stopping = true;
+  pthread_cond_broadcast(&executor->idle_cond);
+  pthread_mutex_unlock(&executor->idle_lock);
+
+  uint64_t executed = 0;
+  uint64_t stolen = 0;
+  for (size_t i = 0; i < executor->worker_count; ++i) {
+    pthread_join(executor->workers[i].tid, NULL);
+    executed += executor->workers[i].executed;
+    stolen += executor->workers[i].stolen;
+  }
+  if (executor->worker_count) {
+    debug_msg("Executor finished, %zu threads, tasks %" PRIu64 ", stolen %" PRIu64 "\n",
+              executor->worker_count, executed, stolen);
+  }
+
+  for (size_t i = 0; i < executor->worker_count; ++i) {
+    pthread_mutex_destroy(&executor->workers[i].lock);
+  }
+  pthread_cond_destroy(&executor->idle_cond);
+  pthread_mutex_destroy(&executor->idle_lock);
+  free(executor->workers);
+  free(executor);
+}
+
+}  // namespace utils
+}  // namespace fasto
@@ -0,0 +1,64 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include "macros.h"
+
+#define EXECUTOR_HIGH_BURST 8  // high priority tasks run in a row before a waiting low one
+
+namespace fasto {
+namespace utils {
+
+typedef enum executor_priority_t {
+  EXECUTOR_PRIORITY_HIGH = 0,
+  EXECUTOR_PRIORITY_LOW,
+  EXECUTOR_PRIORITY_COUNT
+} executor_priority_t;
+
+// intrusive, owned by the caller, may be submitted again once it started running
+typedef struct executor_task_t {
+  void (*run)(void* arg);
+  void* arg;
+  executor_priority_t priority;
+  struct executor_task_t* next;
+} executor_task_t;
+
+struct executor_t;
+
+typedef struct executor_worker_t {
+  struct executor_t* executor;
+  size_t index;
+  pthread_t tid;
+
+  pthread_mutex_t lock;  // taken by the owner and by thieves
+  executor_task_t* heads[EXECUTOR_PRIORITY_COUNT];  // fifo per priority
+  executor_task_t* tails[EXECUTOR_PRIORITY_COUNT];
+  unsigned high_in_row;
+
+  uint64_t executed;
+  uint64_t stolen;  // taken from another worker's queue
+} executor_worker_t;
+
+// fixed set of workers, each with its own queues; tasks submitted from a worker stay on it,
+// others are spread round robin, an idle worker steals from the rest before sleeping
+typedef struct executor_t {
+  executor_worker_t* workers;
+  size_t worker_count;
+  size_t next_worker;
+
+  size_t pending;  // submitted, not started
+  int idle_workers;
+  bool stopping;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+} executor_t;
+
+executor_t* alloc_executor(size_t thread_count);  // 0 - one per online cpu
+void executor_submit(executor_t* executor, executor_task_t* task);
+size_t executor_thread_count(executor_t* executor);
+void free_executor(executor_t* executor);  // runs every submitted task, then joins
+
+}  // namespace utils
+}  // namespace fasto
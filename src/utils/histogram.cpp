@@ -0,0 +1,116 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "utils/histogram.h"
+
+#include <string.h>
+
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_EXACT_COUNT (2 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_VALUE ((UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1)
+
+namespace fasto {
+namespace utils {
+
+namespace {
+
+size_t bucket_index(uint64_t value) {
+  if (value < HISTOGRAM_EXACT_COUNT) {
+    return value;
+  }
+
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - HISTOGRAM_SUB_BITS;
+  size_t mantissa = (value >> shift) & (HISTOGRAM_SUB_COUNT - 1);
+  return HISTOGRAM_EXACT_COUNT + (msb - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_COUNT + mantissa;
+}
+
+uint64_t bucket_upper_bound(size_t index) {
+  if (index < HISTOGRAM_EXACT_COUNT) {
+    return index;
+  }
+
+  size_t rel = index - HISTOGRAM_EXACT_COUNT;
+  int shift = rel / HISTOGRAM_SUB_COUNT + 1;
+  uint64_t mantissa = HISTOGRAM_SUB_COUNT + rel % HISTOGRAM_SUB_COUNT;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+}  // namespace
+
+void histogram_reset(histogram_t* hist) {
+  if (!hist) {
+    return;
+  }
+
+  memset(hist, 0, sizeof(histogram_t));
+}
+
+void histogram_record(histogram_t* hist, uint64_t value) {
+  if (!hist) {
+    return;
+  }
+
+  if (value > HISTOGRAM_MAX_VALUE) {
+    value = HISTOGRAM_MAX_VALUE;
+  }
+
+  __atomic_add_fetch(&hist->counts[bucket_index(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+  __atomic_store_n(&hist->last, value, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, true,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_add_fetch(&hist->total, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t histogram_count(const histogram_t* hist) {
+  return hist ? __atomic_load_n(&hist->total, __ATOMIC_ACQUIRE) : 0;
+}
+
+uint64_t histogram_max(const histogram_t* hist) {
+  return hist ? __atomic_load_n(&hist->max, __ATOMIC_RELAXED) : 0;
+}
+
+uint64_t histogram_mean(const histogram_t* hist) {
+  uint64_t total = histogram_count(hist);
+  return total ? __atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / total : 0;
+}
+
+uint64_t histogram_percentile(const histogram_t* hist, double percent) {
+  if (!hist) {
+    return 0;
+  }
+
+  // counts may run ahead of total while recording, their own sum is used
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+    total += counts[i];
+  }
+  if (!total) {
+    return 0;
+  }
+
+  uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  } else if (rank > total) {
+    rank = total;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      uint64_t bound = bucket_upper_bound(i);
+      uint64_t max = histogram_max(hist);
+      return bound < max ? bound : max;
+    }
+  }
+  return histogram_max(hist);
+}
+
+}  // namespace utils
+}  // namespace fasto
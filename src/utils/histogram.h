@@ -0,0 +1,36 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include "macros.h"
+
+// values below 2^(SUB_BITS + 1) are exact, above every power of two is split in
+// 2^SUB_BITS buckets, so a reported value is at most 1 / 2^SUB_BITS above the real one
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 36  // larger values (over ~68 s in ns) counted as 2^36 - 1
+#define HISTOGRAM_BUCKETS ((2 << HISTOGRAM_SUB_BITS) + \
+                           (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS - 1) * \
+                           (1 << HISTOGRAM_SUB_BITS))
+
+namespace fasto {
+namespace utils {
+
+// fixed log-linear buckets, recorded from any thread without locks, read while recording
+typedef struct histogram_t {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t last;
+} histogram_t;
+
+void histogram_reset(histogram_t* hist);  // not while recording
+void histogram_record(histogram_t* hist, uint64_t value);
+uint64_t histogram_count(const histogram_t* hist);
+uint64_t histogram_max(const histogram_t* hist);
+uint64_t histogram_mean(const histogram_t* hist);
+// smallest bucket bound at least percent of the values are below or equal to, 0 if empty
+uint64_t histogram_percentile(const histogram_t* hist, double percent);
+
+}  // namespace utils
+}  // namespace fasto
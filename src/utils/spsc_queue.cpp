@@ -0,0 +1,128 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#include "utils/spsc_queue.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+namespace fasto {
+namespace utils {
+
+spsc_queue_t* alloc_spsc_queue(size_t capacity) {
+  if (capacity == 0) {
+    debug_perror("alloc_spsc_queue", EINVAL);
+    return NULL;
+  }
+
+  size_t pow2 = 1;
+  while (pow2 < capacity) {
+    pow2 <<= 1;
+  }
+
+  spsc_queue_t* queue = reinterpret_cast<spsc_queue_t*>(calloc(1, sizeof(spsc_queue_t)));
+  if (!queue) {
+    debug_perror("calloc", ENOMEM);
+    return NULL;
+  }
+
+  queue->items = reinterpret_cast<void**>(calloc(pow2, sizeof(void*)));
+  if (!queue->items) {
+    debug_perror("calloc", ENOMEM);
+    free(queue);
+    return NULL;
+  }
+
+  queue->mask = pow2 - 1;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+  return queue;
+}
+
+int spsc_queue_push(spsc_queue_t* queue, void* item) {
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  if (tail - head > queue->mask) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  queue->items[tail & queue->mask] = item;
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  /* pairs with the store of waiting in spsc_queue_pop_wait:
+   * either the consumer sees the new tail or we see it waiting */
+  if (__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+  }
+  return SUCCESS_RESULT_VALUE;
+}
+
+int spsc_queue_pop(spsc_queue_t* queue, void** item) {
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return ERROR_RESULT_VALUE;
+  }
+
+  *item = queue->items[head & queue->mask];
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return SUCCESS_RESULT_VALUE;
+}
+
+int spsc_queue_pop_wait(spsc_queue_t* queue, void** item) {
+  while (true) {
+    if (spsc_queue_pop(queue, item) == SUCCESS_RESULT_VALUE) {
+      return SUCCESS_RESULT_VALUE;
+    }
+
+    if (__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE)) {
+      // the producer may have pushed right before closing
+      return spsc_queue_pop(queue, item);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) ==
+           __atomic_load_n(&queue->head, __ATOMIC_RELAXED) &&
+           !__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE)) {
+      pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+size_t spsc_queue_size(spsc_queue_t* queue) {
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  return tail - head;
+}
+
+size_t spsc_queue_capacity(spsc_queue_t* queue) {
+  return queue->mask + 1;
+}
+
+void spsc_queue_close(spsc_queue_t* queue) {
+  pthread_mutex_lock(&queue->lock);
+  __atomic_store_n(&queue->closed, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+void free_spsc_queue(spsc_queue_t* queue) {
+  if (!queue) {
+    debug_perror("free_spsc_queue", EINVAL);
+    return;
+  }
+
+  pthread_cond_destroy(&queue->cond);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->items);
+  free(queue);
+}
+
+}  // namespace utils
+}  // namespace fasto
@@ -0,0 +1,41 @@
+// Copyright (c) 2016 Alexandr Topilski. All rights reserved.
+
+#pragma once
+
+#include <pthread.h>
+
+#include "macros.h"
+
+#define CACHE_LINE_SIZE 64
+
+namespace fasto {
+namespace utils {
+
+// bounded lock-free single-producer/single-consumer ring of pointers,
+// the consumer may sleep in spsc_queue_pop_wait until an item or close arrives
+typedef struct spsc_queue_t {
+  void** items;
+  size_t mask;  // capacity - 1, capacity is power of two
+
+  size_t head;  // consumer position
+  char head_pad[CACHE_LINE_SIZE - sizeof(size_t)];
+  size_t tail;  // producer position
+  char tail_pad[CACHE_LINE_SIZE - sizeof(size_t)];
+
+  int closed;
+  int waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} spsc_queue_t;
+
+spsc_queue_t* alloc_spsc_queue(size_t capacity);  // capacity rounded up to power of two
+int spsc_queue_push(spsc_queue_t* queue, void* item);  // ERROR_RESULT_VALUE if full
+int spsc_queue_pop(spsc_queue_t* queue, void** item);  // ERROR_RESULT_VALUE if empty
+int spsc_queue_pop_wait(spsc_queue_t* queue, void** item);  // ERROR_RESULT_VALUE if closed
+size_t spsc_queue_size(spsc_queue_t* queue);
+size_t spsc_queue_capacity(spsc_queue_t* queue);
+void spsc_queue_close(spsc_queue_t* queue);  // called by producer, wakes consumer
+void free_spsc_queue(spsc_queue_t* queue);
+
+}  // namespace utils
+}  // namespace fasto